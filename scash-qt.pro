@@ -119,6 +119,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/random.h \
     src/uint256.h \
     src/kernel.h \
+    src/addressindex.h \
+    src/blockdownload.h \
+    src/compactblock.h \
     src/pbkdf2.h \
     src/serialize.h \
     src/strlcpy.h \
@@ -263,6 +266,9 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/rpcconsole.cpp \
     src/noui.cpp \
     src/kernel.cpp \
+    src/addressindex.cpp \
+    src/blockdownload.cpp \
+    src/compactblock.cpp \
     src/pbkdf2.cpp \
     src/aes_helper.c \
     src/blake.c \
@@ -0,0 +1,285 @@
+// Copyright (c) 2017-2018 The Scash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "db.h"
+
+using namespace std;
+
+bool fAddressIndex = false;
+bool fSpentIndex = false;
+
+bool GetAddressKey(const CTxDestination& dest, CAddressKey& keyRet)
+{
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest))
+    {
+        keyRet = make_pair((unsigned char)ADDRESS_KEY_PUBKEYHASH, (uint160)*keyID);
+        return true;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest))
+    {
+        keyRet = make_pair((unsigned char)ADDRESS_KEY_SCRIPTHASH, (uint160)*scriptID);
+        return true;
+    }
+    return false;
+}
+
+// Pay-to-pubkey outputs (coinbase and coinstake) are indexed under the key's address
+bool GetAddressKey(const CScript& scriptPubKey, CAddressKey& keyRet)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    return GetAddressKey(dest, keyRet);
+}
+
+void CAddressIndexUpdate::AddOutput(const CAddressKey& key, const COutPoint& outpoint, const CTxOut& txout, bool fCreate, int nHeightOut)
+{
+    CAddressBalance& delta = mapDelta[key];
+    CUnspentChange change;
+    change.key = key;
+    change.outpoint = outpoint;
+
+    // Connecting a creation or disconnecting a spend makes the output unspent
+    if (fCreate == fConnect)
+    {
+        delta.nBalance += txout.nValue;
+        change.fErase = false;
+        change.unspent = CAddressUnspent(txout.nValue, nHeightOut, txout.scriptPubKey);
+    }
+    else
+    {
+        delta.nBalance -= txout.nValue;
+        change.fErase = true;
+    }
+    if (fCreate)
+        delta.nReceived += (fConnect ? txout.nValue : -txout.nValue);
+    vUnspent.push_back(change);
+}
+
+void CAddressIndexUpdate::ConnectTx(const CTransaction& tx, const MapPrevTx& mapInputs)
+{
+    uint256 hash = tx.GetHash();
+    if (fSpent && !tx.IsCoinBase())
+    {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            vSpent.push_back(make_pair(tx.vin[i].prevout, CSpentInfo(hash, i, nHeight)));
+    }
+    if (!fAddresses)
+        return;
+
+    if (!tx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            MapPrevTx::const_iterator mi = mapInputs.find(txin.prevout.hash);
+            if (mi == mapInputs.end() || txin.prevout.n >= (*mi).second.second.vout.size())
+                continue;
+            const CTxOut& txout = (*mi).second.second.vout[txin.prevout.n];
+            CAddressKey key;
+            if (!GetAddressKey(txout.scriptPubKey, key))
+                continue;
+            AddOutput(key, txin.prevout, txout, false, 0);
+            setTx.insert(make_pair(key, hash));
+        }
+    }
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        CAddressKey key;
+        if (!GetAddressKey(tx.vout[i].scriptPubKey, key))
+            continue;
+        AddOutput(key, COutPoint(hash, i), tx.vout[i], true, nHeight);
+        setTx.insert(make_pair(key, hash));
+    }
+}
+
+bool CAddressIndexUpdate::DisconnectTx(CTxDB& txdb, const CTransaction& tx)
+{
+    return DisconnectTx(txdb, tx, MapPrevTx());
+}
+
+bool CAddressIndexUpdate::DisconnectTx(CTxDB& txdb, const CTransaction& tx, const MapPrevTx& mapInputs)
+{
+    // Read the previous transactions mapInputs lacks before changing anything
+    MapPrevTx mapRead;
+    if (fAddresses && !tx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const uint256& hashPrev = txin.prevout.hash;
+            if (mapInputs.count(hashPrev) || mapRead.count(hashPrev))
+                continue;
+            if (!txdb.ReadDiskTx(hashPrev, mapRead[hashPrev].second))
+                return error("CAddressIndexUpdate::DisconnectTx() : ReadDiskTx %s failed", hashPrev.ToString().substr(0,10).c_str());
+        }
+    }
+
+    // Undo in the reverse order of ConnectTx: outputs, then inputs
+    uint256 hash = tx.GetHash();
+    if (fSpent && !tx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vSpent.push_back(make_pair(txin.prevout, CSpentInfo()));
+    }
+    if (!fAddresses)
+        return true;
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        CAddressKey key;
+        if (!GetAddressKey(tx.vout[i].scriptPubKey, key))
+            continue;
+        AddOutput(key, COutPoint(hash, i), tx.vout[i], true, nHeight);
+        setTx.insert(make_pair(key, hash));
+    }
+
+    if (tx.IsCoinBase())
+        return true;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        MapPrevTx::const_iterator mi = mapInputs.find(txin.prevout.hash);
+        if (mi == mapInputs.end())
+            mi = mapRead.find(txin.prevout.hash);
+        const CTransaction& txPrev = (*mi).second.second;
+        if (txin.prevout.n >= txPrev.vout.size())
+            return error("CAddressIndexUpdate::DisconnectTx() : prevout.n out of range");
+        const CTxOut& txout = txPrev.vout[txin.prevout.n];
+        CAddressKey key;
+        if (!GetAddressKey(txout.scriptPubKey, key))
+            continue;
+
+        // The restored output keeps the height of the transaction that created it
+        int nHeightPrev;
+        if (!txdb.ReadAddressTx(key, txin.prevout.hash, nHeightPrev))
+            return error("CAddressIndexUpdate::DisconnectTx() : %s not indexed", txin.prevout.hash.ToString().substr(0,10).c_str());
+        AddOutput(key, txin.prevout, txout, false, nHeightPrev);
+        setTx.insert(make_pair(key, hash));
+    }
+    return true;
+}
+
+bool CAddressIndexUpdate::Write(CTxDB& txdb, uint256 hashBest) const
+{
+    for (map<CAddressKey, CAddressBalance>::const_iterator mi = mapDelta.begin(); mi != mapDelta.end(); ++mi)
+    {
+        const CAddressKey& key = (*mi).first;
+        CAddressBalance balance;
+        txdb.ReadAddressBalance(key, balance);
+        balance.nBalance += (*mi).second.nBalance;
+        balance.nReceived += (*mi).second.nReceived;
+        bool fOk = (balance.nBalance == 0 && balance.nReceived == 0) ? txdb.EraseAddressBalance(key) : txdb.WriteAddressBalance(key, balance);
+        if (!fOk)
+            return error("CAddressIndexUpdate::Write() : writing balance failed");
+    }
+
+    for (set<pair<CAddressKey, uint256> >::const_iterator it = setTx.begin(); it != setTx.end(); ++it)
+    {
+        bool fOk = fConnect ? txdb.WriteAddressTx((*it).first, (*it).second, nHeight) : txdb.EraseAddressTx((*it).first, (*it).second);
+        if (!fOk)
+            return error("CAddressIndexUpdate::Write() : writing transaction failed");
+    }
+
+    // In order: an output created and spent in the same block ends up erased
+    BOOST_FOREACH(const CUnspentChange& change, vUnspent)
+    {
+        bool fOk = change.fErase ? txdb.EraseAddressUnspent(change.key, change.outpoint) : txdb.WriteAddressUnspent(change.key, change.outpoint, change.unspent);
+        if (!fOk)
+            return error("CAddressIndexUpdate::Write() : writing unspent output failed");
+    }
+
+    for (unsigned int i = 0; i < vSpent.size(); i++)
+    {
+        bool fOk = fConnect ? txdb.WriteSpentInfo(vSpent[i].first, vSpent[i].second) : txdb.EraseSpentInfo(vSpent[i].first);
+        if (!fOk)
+            return error("CAddressIndexUpdate::Write() : writing spent info failed");
+    }
+
+    if (fAddresses && !txdb.WriteAddressIndexBest(hashBest))
+        return error("CAddressIndexUpdate::Write() : WriteAddressIndexBest failed");
+    if (fSpent && !txdb.WriteSpentIndexBest(hashBest))
+        return error("CAddressIndexUpdate::Write() : WriteSpentIndexBest failed");
+    return true;
+}
+
+bool LoadAddressIndex()
+{
+    CTxDB txdb;
+    uint256 hashAddresses = 0, hashSpent = 0;
+    bool fHaveAddresses = txdb.ReadAddressIndexBest(hashAddresses);
+    bool fHaveSpent = txdb.ReadSpentIndexBest(hashSpent);
+
+    // Blocks connected while an index is off are not indexed, so forget it
+    if (!fAddressIndex && fHaveAddresses && !txdb.EraseAddressIndexBest())
+        return error("LoadAddressIndex() : EraseAddressIndexBest failed");
+    if (!fSpentIndex && fHaveSpent && !txdb.EraseSpentIndexBest())
+        return error("LoadAddressIndex() : EraseSpentIndexBest failed");
+
+    bool fBuildAddresses = fAddressIndex && !(fHaveAddresses && hashAddresses == hashBestChain);
+    bool fBuildSpent = fSpentIndex && !(fHaveSpent && hashSpent == hashBestChain);
+    if (!fBuildAddresses && !fBuildSpent)
+        return true;
+
+    printf("Building%s%s index...\n", fBuildAddresses ? " address" : "", fBuildSpent ? " spent" : "");
+    int64 nStart = GetTimeMillis();
+    if (fBuildAddresses && (!txdb.EraseAddressIndex() || !txdb.WriteAddressIndexBest(0)))
+        return error("LoadAddressIndex() : clearing the address index failed");
+    if (fBuildSpent && (!txdb.EraseSpentIndex() || !txdb.WriteSpentIndexBest(0)))
+        return error("LoadAddressIndex() : clearing the spent index failed");
+
+    // The genesis block is never connected, so it is not indexed either
+    txdb.TxnBegin();
+    for (CBlockIndex* pindex = pindexGenesisBlock ? pindexGenesisBlock->pnext : NULL; pindex && !fRequestShutdown; pindex = pindex->pnext)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+        {
+            txdb.TxnAbort();
+            return error("LoadAddressIndex() : ReadFromDisk failed at %d", pindex->nHeight);
+        }
+
+        CAddressIndexUpdate update(true, pindex->nHeight, fBuildAddresses, fBuildSpent);
+        map<uint256, CTxIndex> mapUnused;
+        BOOST_FOREACH(CTransaction& tx, block.vtx)
+        {
+            // Only the address index needs the spent outputs
+            MapPrevTx mapInputs;
+            bool fInvalid;
+            if (fBuildAddresses && !tx.IsCoinBase() && !tx.FetchInputs(txdb, mapUnused, true, false, mapInputs, fInvalid))
+            {
+                txdb.TxnAbort();
+                return error("LoadAddressIndex() : FetchInputs failed at %d", pindex->nHeight);
+            }
+            update.ConnectTx(tx, mapInputs);
+        }
+        if (!update.Write(txdb, pindex->GetBlockHash()))
+        {
+            txdb.TxnAbort();
+            return error("LoadAddressIndex() : Write failed at %d", pindex->nHeight);
+        }
+
+        if (pindex->nHeight % ADDRESS_INDEX_BUILD_BATCH == 0)
+        {
+            if (!txdb.TxnCommit())
+                return error("LoadAddressIndex() : TxnCommit failed");
+            txdb.TxnBegin();
+            printf("Indexes built up to height %d\n", pindex->nHeight);
+        }
+    }
+    if (!fRequestShutdown)
+    {
+        if ((fBuildAddresses && !txdb.WriteAddressIndexBest(hashBestChain)) ||
+            (fBuildSpent && !txdb.WriteSpentIndexBest(hashBestChain)))
+        {
+            txdb.TxnAbort();
+            return error("LoadAddressIndex() : writing the best indexed block failed");
+        }
+    }
+    if (!txdb.TxnCommit())
+        return error("LoadAddressIndex() : TxnCommit failed");
+
+    printf(" indexes %15" PRI64d "ms\n", GetTimeMillis() - nStart);
+    return true;
+}
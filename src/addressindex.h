@@ -0,0 +1,164 @@
+// Copyright (c) 2017-2018 The Scash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SCASH_ADDRESSINDEX_H
+#define SCASH_ADDRESSINDEX_H
+
+#include "main.h"
+
+class CTxDB;
+
+// Maintain the address index (-addressindex) and the spent index (-spentindex)
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+
+// Blocks between commits while the indexes are built
+static const int ADDRESS_INDEX_BUILD_BATCH = 500;
+
+/** Address index key: destination type (ADDRESS_KEY_*) and its hash */
+typedef std::pair<unsigned char, uint160> CAddressKey;
+
+enum
+{
+    ADDRESS_KEY_PUBKEYHASH = 1,
+    ADDRESS_KEY_SCRIPTHASH = 2,
+};
+
+bool GetAddressKey(const CTxDestination& dest, CAddressKey& keyRet);
+bool GetAddressKey(const CScript& scriptPubKey, CAddressKey& keyRet);
+
+/** Running totals of an address */
+class CAddressBalance
+{
+public:
+    int64 nBalance;
+    int64 nReceived;
+
+    CAddressBalance()
+    {
+        nBalance = 0;
+        nReceived = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBalance);
+        READWRITE(nReceived);
+    )
+};
+
+/** An unspent output paying an address */
+class CAddressUnspent
+{
+public:
+    int64 nValue;
+    int nHeight;
+    CScript scriptPubKey;
+
+    CAddressUnspent()
+    {
+        nValue = 0;
+        nHeight = 0;
+    }
+
+    CAddressUnspent(int64 nValueIn, int nHeightIn, const CScript& scriptPubKeyIn)
+    {
+        nValue = nValueIn;
+        nHeight = nHeightIn;
+        scriptPubKey = scriptPubKeyIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(nHeight);
+        READWRITE(scriptPubKey);
+    )
+};
+
+/** The input spending an output, from the spent index */
+class CSpentInfo
+{
+public:
+    uint256 hashTx;
+    unsigned int nIn;
+    int nHeight;
+
+    CSpentInfo()
+    {
+        hashTx = 0;
+        nIn = 0;
+        nHeight = 0;
+    }
+
+    CSpentInfo(const uint256& hashTxIn, unsigned int nInIn, int nHeightIn)
+    {
+        hashTx = hashTxIn;
+        nIn = nInIn;
+        nHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashTx);
+        READWRITE(nIn);
+        READWRITE(nHeight);
+    )
+};
+
+/** The address and spent index changes of one block. Transactions are added in the
+ * order they are connected (or disconnected), totals are accumulated per
+ * address, and Write applies everything to blkindex.dat in one pass.
+ */
+class CAddressIndexUpdate
+{
+private:
+    class CUnspentChange
+    {
+    public:
+        bool fErase;
+        CAddressKey key;
+        COutPoint outpoint;
+        CAddressUnspent unspent;
+    };
+
+    bool fConnect;
+    int nHeight;
+    bool fAddresses;
+    bool fSpent;
+    std::map<CAddressKey, CAddressBalance> mapDelta;
+    std::set<std::pair<CAddressKey, uint256> > setTx;
+    std::vector<CUnspentChange> vUnspent;
+    std::vector<std::pair<COutPoint, CSpentInfo> > vSpent;
+
+    void AddOutput(const CAddressKey& key, const COutPoint& outpoint, const CTxOut& txout, bool fCreate, int nHeightOut);
+
+public:
+    // fAddressesIn, fSpentIn: which of the indexes to update
+    CAddressIndexUpdate(bool fConnectIn, int nHeightIn, bool fAddressesIn, bool fSpentIn)
+    {
+        fConnect = fConnectIn;
+        nHeight = nHeightIn;
+        fAddresses = fAddressesIn;
+        fSpent = fSpentIn;
+    }
+
+    // tx is connected at nHeight; mapInputs holds its previous transactions
+    void ConnectTx(const CTransaction& tx, const MapPrevTx& mapInputs);
+
+    // tx is disconnected from nHeight; its previous transactions are read from txdb
+    bool DisconnectTx(CTxDB& txdb, const CTransaction& tx);
+
+    // Same, taking the previous transactions found in mapInputs from there. Parents in
+    // the block being disconnected must be given this way, as their tx index may be gone.
+    bool DisconnectTx(CTxDB& txdb, const CTransaction& tx, const MapPrevTx& mapInputs);
+
+    // Apply the changes and record hashBest as the last indexed block
+    bool Write(CTxDB& txdb, uint256 hashBest) const;
+};
+
+// Index the main chain from scratch for each index that is enabled but
+// missing or out of date, and drop the ones that are disabled
+bool LoadAddressIndex();
+
+#endif // SCASH_ADDRESSINDEX_H
@@ -74,9 +74,25 @@ double CAddrInfo::GetChance(int64 nNow) const
     for (int n=0; n<nAttempts; n++)
         fChance /= 1.5;
 
+    // prefer fast peers; this only changes the odds within a bucket, so diversity is kept
+    fChance *= GetQuality();
+
     return fChance;
 }
 
+double CAddrInfo::GetQuality() const
+{
+    double fQuality = 1.0;
+
+    if (nLatency > 0)
+        fQuality *= 2.0 * ADDRMAN_REFERENCE_LATENCY / (ADDRMAN_REFERENCE_LATENCY + nLatency);
+
+    if (nThroughput > 0)
+        fQuality *= std::max(0.25, std::min(2.0, sqrt((double)nThroughput / ADDRMAN_REFERENCE_THROUGHPUT)));
+
+    return std::max(0.1, fQuality);
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
 {
     std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
@@ -525,3 +541,40 @@ void CAddrMan::Connected_(const CService &addr, int64 nTime)
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+void CAddrMan::SetLatency_(const CService &addr, int64 nMillis)
+{
+    CAddrInfo *pinfo = Find(addr);
+
+    // if not found, bail out
+    if (!pinfo)
+        return;
+
+    CAddrInfo &info = *pinfo;
+
+    // check whether we are talking about the exact same CService (including same port)
+    if (info != addr)
+        return;
+
+    // moving average, so one slow handshake does not bury a good peer
+    int nMillisClamped = std::max(1, (int)std::min(nMillis, (int64)60000));
+    info.nLatency = (info.nLatency == 0 ? nMillisClamped : (3 * info.nLatency + nMillisClamped) / 4);
+}
+
+void CAddrMan::SetThroughput_(const CService &addr, double dBytesPerSecond)
+{
+    CAddrInfo *pinfo = Find(addr);
+
+    // if not found, bail out
+    if (!pinfo)
+        return;
+
+    CAddrInfo &info = *pinfo;
+
+    // check whether we are talking about the exact same CService (including same port)
+    if (info != addr)
+        return;
+
+    int nRate = std::max(1, (int)std::min(dBytesPerSecond, 1e9));
+    info.nThroughput = (info.nThroughput == 0 ? nRate : (3 * (int64)info.nThroughput + nRate) / 4);
+}
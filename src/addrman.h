@@ -8,6 +8,7 @@
 #include "protocol.h"
 #include "util.h"
 #include "sync.h"
+#include "version.h"
 
 
 #include <map>
@@ -36,6 +37,12 @@ private:
     // connection attempts since last successful attempt
     int nAttempts;
 
+    // measured handshake round trip time in ms (0 = unknown)
+    int nLatency;
+
+    // measured block download rate in bytes per second (0 = unknown)
+    int nThroughput;
+
     // reference count in new sets (memory only)
     int nRefCount;
 
@@ -55,6 +62,11 @@ public:
         READWRITE(source);
         READWRITE(nLastSuccess);
         READWRITE(nAttempts);
+        if (nVersion >= ADDRMAN_QUALITY_VERSION)
+        {
+            READWRITE(nLatency);
+            READWRITE(nThroughput);
+        }
     )
 
     void Init()
@@ -62,6 +74,8 @@ public:
         nLastSuccess = 0;
         nLastTry = 0;
         nAttempts = 0;
+        nLatency = 0;
+        nThroughput = 0;
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
@@ -95,6 +109,9 @@ public:
     // Calculate the relative chance this entry should be given when selecting nodes to connect to
     double GetChance(int64 nNow = GetAdjustedTime()) const;
 
+    // Factor (0.1 - 4) applied to the chance for measured latency and throughput, 1 if unmeasured
+    double GetQuality() const;
+
 };
 
 // Stochastic address manager
@@ -165,6 +182,10 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// handshake round trip time (ms) and block download rate (bytes/s) that count as average
+#define ADDRMAN_REFERENCE_LATENCY 250
+#define ADDRMAN_REFERENCE_THROUGHPUT 100000
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -247,6 +268,12 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64 nTime);
 
+    // Fold a measured handshake round trip time into an entry.
+    void SetLatency_(const CService &addr, int64 nMillis);
+
+    // Fold a measured block download rate into an entry.
+    void SetThroughput_(const CService &addr, double dBytesPerSecond);
+
 public:
 
     unsigned int GetSerializeSize(int nType, int nVersion) const
@@ -727,6 +754,28 @@ public:
             Check();
         }
     }
+
+    // Record the handshake round trip time measured on a connection to addr.
+    void SetLatency(const CService &addr, int64 nMillis)
+    {
+        {
+            LOCK(cs);
+            Check();
+            SetLatency_(addr, nMillis);
+            Check();
+        }
+    }
+
+    // Record the block download rate measured on a connection to addr.
+    void SetThroughput(const CService &addr, double dBytesPerSecond)
+    {
+        {
+            LOCK(cs);
+            Check();
+            SetThroughput_(addr, dBytesPerSecond);
+            Check();
+        }
+    }
 };
 
 #endif
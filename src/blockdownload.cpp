@@ -0,0 +1,214 @@
+// Copyright (c) 2017-2018 The Scash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockdownload.h"
+
+using namespace std;
+
+CBlockDownloader blockDownloader;
+
+bool CBlockDownloader::IsWanted(const uint256& hash) const
+{
+    return !mapBlockIndex.count(hash) && !mapOrphanBlocks.count(hash);
+}
+
+// Drop received entries from the front of the queue
+void CBlockDownloader::PruneQueue()
+{
+    while (!vQueue.empty() && !mapEntries.count(vQueue.front()))
+        vQueue.pop_front();
+}
+
+double CBlockDownloader::GetBestThroughput() const
+{
+    double dBest = 0;
+    for (map<int, CPeerDownloadState>::const_iterator mi = mapPeers.begin(); mi != mapPeers.end(); ++mi)
+        dBest = max(dBest, (*mi).second.dBytesPerSecond);
+    return dBest;
+}
+
+int CBlockDownloader::GetMaxInFlight(const CPeerDownloadState& state) const
+{
+    double dBest = GetBestThroughput();
+    if (state.nBlocksReceived > 0 && state.dBytesPerSecond < dBest / 4)
+        return MAX_BLOCKS_IN_FLIGHT_PER_PEER / 4;
+    return MAX_BLOCKS_IN_FLIGHT_PER_PEER;
+}
+
+void CBlockDownloader::Announce(const uint256& hash, const CNode* pfrom)
+{
+    LOCK(cs);
+    map<uint256, CBlockDownloadEntry>::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+    {
+        if (mapEntries.size() >= MAX_INV_SZ)
+            return;
+        CBlockDownloadEntry entry;
+        entry.nHeightEstimate = nBestHeight + mapEntries.size() + 1;
+        mi = mapEntries.insert(make_pair(hash, entry)).first;
+        vQueue.push_back(hash);
+    }
+    (*mi).second.setSources.insert(pfrom->id);
+}
+
+void CBlockDownloader::Received(const uint256& hash, const CNode* pfrom, unsigned int nBytes)
+{
+    LOCK(cs);
+    map<uint256, CBlockDownloadEntry>::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+        return;
+
+    CBlockDownloadEntry& entry = (*mi).second;
+    if (entry.nNodeInFlight != -1)
+    {
+        CPeerDownloadState& state = mapPeers[entry.nNodeInFlight];
+        state.nBlocksInFlight--;
+        if (entry.nNodeInFlight == pfrom->id)
+        {
+            // Average of bytes over the time the request was outstanding
+            int64 nMillis = max(GetTimeMillis() - entry.nTimeRequested, (int64)1);
+            double dRate = nBytes * 1000.0 / nMillis;
+            state.dBytesPerSecond = (state.nBlocksReceived == 0 ? dRate : 0.8 * state.dBytesPerSecond + 0.2 * dRate);
+            state.nBlocksReceived++;
+        }
+    }
+    mapEntries.erase(mi);
+    PruneQueue();
+}
+
+void CBlockDownloader::SendRequests(CNode* pto)
+{
+    if (pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected)
+        return;
+
+    vector<CInv> vGetData;
+    CBlockLocator locator;
+    bool fGetBlocks = false;
+    {
+        LOCK(cs);
+        if (mapEntries.empty())
+            return;
+
+        int64 nNow = GetTimeMillis();
+        CPeerDownloadState& state = mapPeers[pto->id];
+        int nMaxInFlight = GetMaxInFlight(state);
+
+        // Slow peers leave the blocks the chain is waiting on to faster ones
+        unsigned int nSkip = (nMaxInFlight < MAX_BLOCKS_IN_FLIGHT_PER_PEER ? MAX_BLOCKS_IN_FLIGHT_PER_PEER : 0);
+
+        PruneQueue();
+        unsigned int nInWindow = 0;
+        for (deque<uint256>::iterator it = vQueue.begin(); it != vQueue.end() && nInWindow < DOWNLOAD_WINDOW; ++it)
+        {
+            map<uint256, CBlockDownloadEntry>::iterator mi = mapEntries.find(*it);
+            if (mi == mapEntries.end())
+                continue;
+            CBlockDownloadEntry& entry = (*mi).second;
+
+            // Arrived some other way (orphan resolution, another announcement)
+            if (!IsWanted(*it))
+            {
+                if (entry.nNodeInFlight != -1)
+                    mapPeers[entry.nNodeInFlight].nBlocksInFlight--;
+                mapEntries.erase(mi);
+                continue;
+            }
+            nInWindow++;
+
+            if (entry.nNodeInFlight != -1 && nNow - entry.nTimeRequested > BLOCK_DOWNLOAD_TIMEOUT * 1000)
+            {
+                CPeerDownloadState& stateSlow = mapPeers[entry.nNodeInFlight];
+                stateSlow.nBlocksInFlight--;
+                stateSlow.nTimeouts++;
+                stateSlow.dBytesPerSecond /= 2;
+                if (fDebugNet)
+                    printf("block download timeout %s from peer %d\n", (*it).ToString().c_str(), entry.nNodeInFlight);
+                entry.setTimedOut.insert(entry.nNodeInFlight);
+                entry.nNodeInFlight = -1;
+            }
+
+            if (entry.nNodeInFlight != -1 || state.nBlocksInFlight >= nMaxInFlight || nInWindow <= nSkip)
+                continue;
+            if (entry.setTimedOut.count(pto->id))
+                continue;
+            if (!entry.setSources.count(pto->id) && pto->nStartingHeight < entry.nHeightEstimate)
+                continue;
+
+            entry.nNodeInFlight = pto->id;
+            entry.nTimeRequested = nNow;
+            state.nBlocksInFlight++;
+            vGetData.push_back(CInv(MSG_BLOCK, *it));
+        }
+        PruneQueue();
+
+        // Ask a peer that announced the last queued block for the hashes after it
+        if (!vQueue.empty() && mapEntries.size() < DOWNLOAD_WINDOW / 2)
+        {
+            const uint256& hashLast = vQueue.back();
+            map<uint256, CBlockDownloadEntry>::iterator mi = mapEntries.find(hashLast);
+            if (mi != mapEntries.end() && (*mi).second.setSources.count(pto->id) &&
+                pto->nStartingHeight > (*mi).second.nHeightEstimate &&
+                (hashLast != hashLastGetBlocks || nNow - nTimeLastGetBlocks > GETBLOCKS_REFILL_INTERVAL * 1000))
+            {
+                locator.Set(pindexBest);
+                locator.Prepend(hashLast);
+                hashLastGetBlocks = hashLast;
+                nTimeLastGetBlocks = nNow;
+                fGetBlocks = true;
+            }
+        }
+    }
+
+    if (!vGetData.empty())
+    {
+        if (fDebugNet)
+            printf("block download: requesting %" PRIszu " blocks from %s\n", vGetData.size(), pto->addrName.c_str());
+        pto->PushMessage("getdata", vGetData);
+    }
+    if (fGetBlocks)
+        pto->PushMessage("getblocks", locator, uint256(0));
+}
+
+void CBlockDownloader::RemovePeer(int nNodeId)
+{
+    LOCK(cs);
+    for (map<uint256, CBlockDownloadEntry>::iterator mi = mapEntries.begin(); mi != mapEntries.end(); )
+    {
+        CBlockDownloadEntry& entry = (*mi).second;
+        if (entry.nNodeInFlight == nNodeId)
+            entry.nNodeInFlight = -1;
+        entry.setSources.erase(nNodeId);
+        entry.setTimedOut.erase(nNodeId);
+
+        // Nobody left who announced it; it will be queued again if announced
+        if (entry.setSources.empty() && entry.nNodeInFlight == -1)
+            mapEntries.erase(mi++);
+        else
+            ++mi;
+    }
+    PruneQueue();
+    mapPeers.erase(nNodeId);
+}
+
+bool CBlockDownloader::IsQueued(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapEntries.count(hash) != 0;
+}
+
+unsigned int CBlockDownloader::GetQueueSize() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+bool CBlockDownloader::GetPeerState(int nNodeId, CPeerDownloadState& stateRet) const
+{
+    LOCK(cs);
+    map<int, CPeerDownloadState>::const_iterator mi = mapPeers.find(nNodeId);
+    if (mi == mapPeers.end())
+        return false;
+    stateRet = (*mi).second;
+    return true;
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2017-2018 The Scash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SCASH_BLOCKDOWNLOAD_H
+#define SCASH_BLOCKDOWNLOAD_H
+
+#include "main.h"
+
+// Only the first DOWNLOAD_WINDOW announced blocks are requested, so orphan storage stays bounded
+static const unsigned int DOWNLOAD_WINDOW = 256;
+
+// Blocks in flight per peer; peers much slower than the fastest one get a quarter of it
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+
+// Seconds before a requested block is asked from another peer
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 30;
+
+// Seconds between getblocks sent to refill the window
+static const int64 GETBLOCKS_REFILL_INTERVAL = 30;
+
+/** Download statistics of one peer */
+class CPeerDownloadState
+{
+public:
+    int nBlocksInFlight;
+    int nBlocksReceived;
+    int nTimeouts;
+    double dBytesPerSecond;
+
+    CPeerDownloadState()
+    {
+        nBlocksInFlight = 0;
+        nBlocksReceived = 0;
+        nTimeouts = 0;
+        dBytesPerSecond = 0;
+    }
+};
+
+/** A block that has been announced but not received yet */
+class CBlockDownloadEntry
+{
+public:
+    int nHeightEstimate;
+    int nNodeInFlight;
+    int64 nTimeRequested;
+    std::set<int> setSources;
+    std::set<int> setTimedOut;
+
+    CBlockDownloadEntry()
+    {
+        nHeightEstimate = 0;
+        nNodeInFlight = -1;
+        nTimeRequested = 0;
+    }
+};
+
+/** Schedules block getdata requests over all connected peers.
+ * Announced block hashes are queued in announcement order, which during
+ * sync is chain order. A sliding window at the front of the queue is
+ * spread over the peers, requests that take too long are handed to
+ * another peer, and faster peers get more blocks in flight.
+ */
+class CBlockDownloader
+{
+private:
+    mutable CCriticalSection cs;
+    std::deque<uint256> vQueue;
+    std::map<uint256, CBlockDownloadEntry> mapEntries;
+    std::map<int, CPeerDownloadState> mapPeers;
+    int64 nTimeLastGetBlocks;
+    uint256 hashLastGetBlocks;
+
+    bool IsWanted(const uint256& hash) const;
+    void PruneQueue();
+    double GetBestThroughput() const;
+    int GetMaxInFlight(const CPeerDownloadState& state) const;
+
+public:
+    CBlockDownloader()
+    {
+        nTimeLastGetBlocks = 0;
+        hashLastGetBlocks = 0;
+    }
+
+    // A peer announced a block we do not have
+    void Announce(const uint256& hash, const CNode* pfrom);
+
+    // A block arrived (from any source); nBytes is its serialized size
+    void Received(const uint256& hash, const CNode* pfrom, unsigned int nBytes);
+
+    // Re-queue timed out requests and send getdata (and getblocks to refill the window) to pto
+    void SendRequests(CNode* pto);
+
+    // The peer disconnected, its requests go to other peers
+    void RemovePeer(int nNodeId);
+
+    bool IsQueued(const uint256& hash) const;
+    unsigned int GetQueueSize() const;
+    bool GetPeerState(int nNodeId, CPeerDownloadState& stateRet) const;
+};
+
+extern CBlockDownloader blockDownloader;
+
+#endif // SCASH_BLOCKDOWNLOAD_H
@@ -0,0 +1,151 @@
+// Copyright (c) 2017-2018 The Scash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compactblock.h"
+
+using namespace std;
+
+static const uint64 SHORTTXID_MASK = 0xffffffffffffULL;
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header = block;
+    header.vtx.clear();
+    header.vMerkleTree.clear();
+    nNonce = GetRandHash().Get64();
+
+    // Scash: coinbase and coinstake are never in the receiver's memory pool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    uint256 hashKey = GetShortIdKey();
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+            vPrefilledTx.push_back(CPrefilledTransaction(i, block.vtx[i]));
+        else
+            vShortTxIds.push_back(GetShortTxId(hashKey, block.vtx[i].GetHash()));
+    }
+}
+
+uint256 CCompactBlock::GetShortIdKey() const
+{
+    uint256 hashBlock = GetHash();
+    return Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+}
+
+uint64 CCompactBlock::GetShortTxId(const uint256& hashKey, const uint256& hashTx)
+{
+    return Hash(BEGIN(hashKey), END(hashKey), BEGIN(hashTx), END(hashTx)).Get64() & SHORTTXID_MASK;
+}
+
+CBlockTransactions::CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req)
+{
+    hashBlock = req.hashBlock;
+    BOOST_FOREACH(unsigned short nIndex, req.vIndexes)
+    {
+        if (nIndex >= block.vtx.size())
+            throw std::out_of_range("CBlockTransactions() : index out of range");
+        vtx.push_back(block.vtx[nIndex]);
+    }
+}
+
+bool CPartialBlock::Init(const CCompactBlock& cmpctblock, const CTxMemPool& pool)
+{
+    unsigned int nTxCount = cmpctblock.GetTxCount();
+    if (nTxCount == 0 || nTxCount > MAX_BLOCK_SIZE / 60)
+        return error("CPartialBlock::Init() : bad transaction count %u", nTxCount);
+
+    header = cmpctblock.header;
+    vtx.assign(nTxCount, CTransaction());
+    vHave.assign(nTxCount, false);
+    nTimeReceived = GetTime();
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTx)
+    {
+        if (prefilled.nIndex >= nTxCount || vHave[prefilled.nIndex])
+            return error("CPartialBlock::Init() : bad prefilled index %u", prefilled.nIndex);
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // Remaining slots are taken by short ids, in order
+    map<uint64, unsigned int> mapShortIds;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64 nShortId, cmpctblock.vShortTxIds)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortIds.insert(make_pair(nShortId, nIndex)).second)
+            return error("CPartialBlock::Init() : duplicate short id");
+        nIndex++;
+    }
+
+    // Two pool transactions with the same short id leave the slot to be requested
+    set<unsigned int> setCollided;
+    uint256 hashKey = cmpctblock.GetShortIdKey();
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTransaction>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            map<uint64, unsigned int>::iterator it = mapShortIds.find(CCompactBlock::GetShortTxId(hashKey, (*mi).first));
+            if (it == mapShortIds.end())
+                continue;
+            unsigned int n = (*it).second;
+            if (setCollided.count(n))
+                continue;
+            if (vHave[n])
+            {
+                vHave[n] = false;
+                vtx[n] = CTransaction();
+                setCollided.insert(n);
+                continue;
+            }
+            vtx[n] = (*mi).second;
+            vHave[n] = true;
+        }
+    }
+
+    return true;
+}
+
+void CPartialBlock::GetMissing(std::vector<unsigned short>& vIndexesRet) const
+{
+    vIndexesRet.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexesRet.push_back(i);
+}
+
+bool CPartialBlock::Fill(const std::vector<CTransaction>& vtxMissing)
+{
+    unsigned int nNext = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nNext >= vtxMissing.size())
+            return error("CPartialBlock::Fill() : too few transactions");
+        vtx[i] = vtxMissing[nNext++];
+        vHave[i] = true;
+    }
+    if (nNext != vtxMissing.size())
+        return error("CPartialBlock::Fill() : too many transactions");
+    return true;
+}
+
+bool CPartialBlock::IsComplete() const
+{
+    return find(vHave.begin(), vHave.end(), false) == vHave.end();
+}
+
+bool CPartialBlock::GetBlock(CBlock& blockRet) const
+{
+    if (!IsComplete())
+        return false;
+
+    blockRet = header;
+    blockRet.vtx = vtx;
+    if (blockRet.BuildMerkleTree() != blockRet.hashMerkleRoot)
+        return error("CPartialBlock::GetBlock() : merkle root mismatch for %s", blockRet.GetHash().ToString().c_str());
+    return true;
+}
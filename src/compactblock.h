@@ -0,0 +1,153 @@
+// Copyright (c) 2017-2018 The Scash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SCASH_COMPACTBLOCK_H
+#define SCASH_COMPACTBLOCK_H
+
+#include "main.h"
+
+// Only serve "cmpctblock" for blocks this close to the tip, older ones go as full "block"
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+
+// Forget partially reconstructed blocks after this many seconds
+static const int64 COMPACT_BLOCK_TIMEOUT = 2 * 60;
+
+// Partially reconstructed blocks kept per peer and in total; past that the full block is fetched
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 2;
+static const unsigned int MAX_PARTIAL_BLOCKS = 32;
+
+/** A transaction sent along with a compact block because the receiver
+ * can not be expected to have it (coinbase, coinstake).
+ */
+class CPrefilledTransaction
+{
+public:
+    unsigned short nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction()
+    {
+        nIndex = 0;
+    }
+
+    CPrefilledTransaction(unsigned short nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** Block header plus short transaction ids ("cmpctblock" message).
+ * The header is a CBlock without transactions so the block signature and
+ * the extended fields travel with it.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header;
+    uint64 nNonce;
+    std::vector<uint64> vShortTxIds;
+    std::vector<CPrefilledTransaction> vPrefilledTx;
+
+    CCompactBlock()
+    {
+        nNonce = 0;
+    }
+
+    explicit CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortTxIds);
+        READWRITE(vPrefilledTx);
+    )
+
+    uint256 GetHash() const
+    {
+        return header.GetHash();
+    }
+
+    unsigned int GetTxCount() const
+    {
+        return vShortTxIds.size() + vPrefilledTx.size();
+    }
+
+    // Short ids are salted with the block hash and nNonce so collisions
+    // can not be ground in advance, and truncated to 48 bits
+    uint256 GetShortIdKey() const;
+    static uint64 GetShortTxId(const uint256& hashKey, const uint256& hashTx);
+};
+
+/** Request for the transactions a compact block could not be filled with ("getblocktxn") */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned short> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Answer to "getblocktxn" ("blocktxn") */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    CBlockTransactions()
+    {
+    }
+
+    CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A compact block being reconstructed from the memory pool */
+class CPartialBlock
+{
+public:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+    int64 nTimeReceived;
+    int nNodeId; // peer asked for the missing transactions
+
+    CPartialBlock()
+    {
+        nTimeReceived = 0;
+        nNodeId = -1;
+    }
+
+    // Fill what we can from prefilled transactions and the memory pool
+    // Returns false if the compact block is malformed
+    bool Init(const CCompactBlock& cmpctblock, const CTxMemPool& pool);
+
+    // Indexes of transactions still missing
+    void GetMissing(std::vector<unsigned short>& vIndexesRet) const;
+
+    // Supply the missing transactions, in the order they were requested
+    bool Fill(const std::vector<CTransaction>& vtxMissing);
+
+    bool IsComplete() const;
+
+    // Assemble the full block; fails on merkle root mismatch (short id collision)
+    bool GetBlock(CBlock& blockRet) const;
+};
+
+#endif // SCASH_COMPACTBLOCK_H
@@ -241,7 +241,7 @@ void CDBEnv::CheckpointLSN(std::string strFile)
 
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), fBatched(false)
 {
 
     int DatabaseRecoveryAttempt = 0;
@@ -337,6 +337,14 @@ recoveryCheckpoint:
 
             bitdb.mapDb[strFile] = pdb;
         }
+
+        // Join this thread's write batch on the file
+        map<string, CDBBatch*>::iterator mi = bitdb.mapBatch.find(strFile);
+        if (pdb && mi != bitdb.mapBatch.end() && (*mi).second->IsOwner())
+        {
+            activeTxn = (*mi).second->GetTxn();
+            fBatched = (activeTxn != NULL);
+        }
     }
 }
 
@@ -352,6 +360,15 @@ void CDB::Close()
 {
     if (!pdb)
         return;
+    if (fBatched)
+    {
+        // The batch commits and checkpoints
+        activeTxn = NULL;
+        pdb = NULL;
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+        return;
+    }
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
@@ -374,6 +391,80 @@ void CDB::Close()
     }
 }
 
+CDBBatch::CDBBatch(const string& strFileIn, int nDurabilityIn) :
+    strFile(strFileIn), ptxn(NULL), nDurability(nDurabilityIn), fOuter(false)
+{
+    LOCK(bitdb.cs_db);
+    if (strFile.empty() || bitdb.mapBatch.count(strFile))
+        return;
+    threadId = boost::this_thread::get_id();
+    fOuter = true;
+    bitdb.mapBatch[strFile] = this;
+
+}
+
+CDBBatch::~CDBBatch()
+{
+    Commit();
+}
+
+bool CDBBatch::Commit()
+{
+    if (!fOuter)
+        return true;
+    fOuter = false;
+    {
+        LOCK(bitdb.cs_db);
+        bitdb.mapBatch.erase(strFile);
+    }
+    if (!ptxn)
+        return true;
+
+    int ret = ptxn->commit(GetTxnFlags());
+    ptxn = NULL;
+
+    // One checkpoint for the whole batch; below full durability it is
+    // left to -dblogsize and the wallet flush thread
+    if (nDurability >= 2)
+        bitdb.dbenv.txn_checkpoint(0, 0, 0);
+    else
+        bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100)*1024, 1, 0);
+
+    {
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+    }
+    if (ret != 0)
+        return error("CDBBatch::Commit() : commit to %s failed, error %d", strFile.c_str(), ret);
+    return true;
+}
+
+int CDBBatch::GetTxnFlags() const
+{
+    if (nDurability <= 0)
+        return DB_TXN_NOSYNC;
+    if (nDurability == 1)
+        return DB_TXN_WRITE_NOSYNC;
+    return DB_TXN_SYNC;
+}
+
+DbTxn* CDBBatch::GetTxn()
+{
+    if (!fOuter)
+        return NULL;
+    if (!ptxn)
+    {
+        ptxn = bitdb.TxnBegin(GetTxnFlags());
+        if (!ptxn)
+            return NULL;
+
+        // Keeps the file open until the commit
+        LOCK(bitdb.cs_db);
+        ++bitdb.mapFileUseCount[strFile];
+    }
+    return ptxn;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -655,6 +746,238 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
+bool CTxDB::ReadAddressBalance(const CAddressKey& key, CAddressBalance& balance)
+{
+    return Read(make_pair(string("addrbal"), key), balance);
+}
+
+bool CTxDB::WriteAddressBalance(const CAddressKey& key, const CAddressBalance& balance)
+{
+    return Write(make_pair(string("addrbal"), key), balance);
+}
+
+bool CTxDB::EraseAddressBalance(const CAddressKey& key)
+{
+    return Erase(make_pair(string("addrbal"), key));
+}
+
+bool CTxDB::ReadAddressTx(const CAddressKey& key, uint256 hashTx, int& nHeight)
+{
+    return Read(make_pair(string("addrtx"), make_pair(key, hashTx)), nHeight);
+}
+
+bool CTxDB::WriteAddressTx(const CAddressKey& key, uint256 hashTx, int nHeight)
+{
+    return Write(make_pair(string("addrtx"), make_pair(key, hashTx)), nHeight);
+}
+
+bool CTxDB::EraseAddressTx(const CAddressKey& key, uint256 hashTx)
+{
+    return Erase(make_pair(string("addrtx"), make_pair(key, hashTx)));
+}
+
+bool CTxDB::ReadAddressTxs(const CAddressKey& key, vector<pair<int, uint256> >& vTxRet)
+{
+    vTxRet.clear();
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    // The records of one address are adjacent, starting at ("addrtx", key)
+    unsigned int fFlags = DB_SET_RANGE;
+    LOOP
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("addrtx"), key);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        CAddressKey keyRead;
+        uint256 hashTx;
+        ssKey >> strType;
+        if (strType != "addrtx")
+            break;
+        ssKey >> keyRead >> hashTx;
+        if (keyRead != key)
+            break;
+        int nHeight;
+        ssValue >> nHeight;
+        vTxRet.push_back(make_pair(nHeight, hashTx));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CTxDB::WriteAddressUnspent(const CAddressKey& key, const COutPoint& outpoint, const CAddressUnspent& unspent)
+{
+    return Write(make_pair(string("addrutxo"), make_pair(key, outpoint)), unspent);
+}
+
+bool CTxDB::EraseAddressUnspent(const CAddressKey& key, const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("addrutxo"), make_pair(key, outpoint)));
+}
+
+bool CTxDB::ReadAddressUnspent(const CAddressKey& key, vector<pair<COutPoint, CAddressUnspent> >& vUnspentRet)
+{
+    vUnspentRet.clear();
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int fFlags = DB_SET_RANGE;
+    LOOP
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("addrutxo"), key);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        CAddressKey keyRead;
+        COutPoint outpoint;
+        ssKey >> strType;
+        if (strType != "addrutxo")
+            break;
+        ssKey >> keyRead >> outpoint;
+        if (keyRead != key)
+            break;
+        CAddressUnspent unspent;
+        ssValue >> unspent;
+        vUnspentRet.push_back(make_pair(outpoint, unspent));
+    }
+    pcursor->close();
+    return true;
+}
+
+bool CTxDB::ReadAddressIndexBest(uint256& hashBest)
+{
+    return Read(string("addrbest"), hashBest);
+}
+
+bool CTxDB::WriteAddressIndexBest(uint256 hashBest)
+{
+    return Write(string("addrbest"), hashBest);
+}
+
+bool CTxDB::EraseAddressIndexBest()
+{
+    return Erase(string("addrbest"));
+}
+
+// Remove all records of a type, a chunk of keys at a time so the removal
+// of a large index does not need them all in memory
+bool CTxDB::EraseRecords(const string& strType)
+{
+    LOOP
+    {
+        vector<CDataStream> vKeys;
+        Dbc* pcursor = GetCursor();
+        if (!pcursor)
+            return false;
+        unsigned int fFlags = DB_SET_RANGE;
+        while (vKeys.size() < 10000)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            if (fFlags == DB_SET_RANGE)
+                ssKey << strType;
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+            fFlags = DB_NEXT;
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                pcursor->close();
+                return false;
+            }
+            CDataStream ssKeyCopy(ssKey);
+            string strTypeRead;
+            ssKey >> strTypeRead;
+            if (strTypeRead != strType)
+                break;
+            vKeys.push_back(ssKeyCopy);
+        }
+        pcursor->close();
+        if (vKeys.empty())
+            return true;
+
+        if (!TxnBegin())
+            return false;
+        BOOST_FOREACH(CDataStream& ssKey, vKeys)
+        {
+            Dbt datKey(&ssKey[0], ssKey.size());
+            int ret = pdb->del(activeTxn, &datKey, 0);
+            if (ret != 0 && ret != DB_NOTFOUND)
+            {
+                TxnAbort();
+                return false;
+            }
+        }
+        if (!TxnCommit())
+            return false;
+    }
+}
+
+bool CTxDB::EraseAddressIndex()
+{
+    return EraseRecords("addrbal") && EraseRecords("addrtx") && EraseRecords("addrutxo");
+}
+
+bool CTxDB::ReadSpentInfo(const COutPoint& outpoint, CSpentInfo& info)
+{
+    return Read(make_pair(string("spent"), outpoint), info);
+}
+
+bool CTxDB::WriteSpentInfo(const COutPoint& outpoint, const CSpentInfo& info)
+{
+    return Write(make_pair(string("spent"), outpoint), info);
+}
+
+bool CTxDB::EraseSpentInfo(const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("spent"), outpoint));
+}
+
+bool CTxDB::ReadSpentIndexBest(uint256& hashBest)
+{
+    return Read(string("spentbest"), hashBest);
+}
+
+bool CTxDB::WriteSpentIndexBest(uint256 hashBest)
+{
+    return Write(string("spentbest"), hashBest);
+}
+
+bool CTxDB::EraseSpentIndexBest()
+{
+    return Erase(string("spentbest"));
+}
+
+bool CTxDB::EraseSpentIndex()
+{
+    return EraseRecords("spent");
+}
+
 CBlockIndex static * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -1064,3 +1387,91 @@ bool CAddrDB::Read(CAddrMan& addr)
     return true;
 }
 
+
+
+//
+// CMempoolDB
+//
+
+CMempoolDB::CMempoolDB()
+{
+    pathMempool = GetDataDir() / "mempool.dat";
+}
+
+bool CMempoolDB::Write(const vector<pair<CTransaction, int64> >& vtx)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("mempool.dat.%04x", randv);
+
+    // serialize transactions, checksum data up to that point, then append csum
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool << FLATDATA(pchMessageStart);
+    ssMempool << vtx;
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CMempoolDB::Write() : open failed");
+
+    try {
+        fileout << ssMempool;
+    }
+    catch (std::exception &e) {
+        return error("CMempoolDB::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("CMempoolDB::Write() : Rename-into-place failed");
+
+    return true;
+}
+
+bool CMempoolDB::Read(vector<pair<CTransaction, int64> >& vtx)
+{
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CMempoolDB::Read() : open failed");
+
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    if (dataSize < 0)
+        return error("CMempoolDB::Read() : file too short");
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("CMempoolDB::Read() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+    if (hashIn != Hash(ssMempool.begin(), ssMempool.end()))
+        return error("CMempoolDB::Read() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    try {
+        ssMempool >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("CMempoolDB::Read() : invalid network magic number");
+        ssMempool >> vtx;
+    }
+    catch (std::exception &e) {
+        return error("CMempoolDB::Read() : I/O error or stream data corrupted");
+    }
+
+    return true;
+}
@@ -6,6 +6,7 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "addressindex.h"
 
 #include <map>
 #include <string>
@@ -30,6 +31,8 @@ void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 
 
+class CDBBatch;
+
 class CDBEnv
 {
 private:
@@ -46,6 +49,7 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CDBBatch*> mapBatch;
 
     CDBEnv();
     ~CDBEnv();
@@ -93,6 +97,40 @@ public:
 extern CDBEnv bitdb;
 
 
+/** Groups the writes one thread makes to a database file while it is in
+ * scope into a single transaction. CDB handles the thread opens on the file
+ * meanwhile join the transaction and leave committing and checkpointing to
+ * the batch, which does both once when the outermost scope ends. Batches
+ * opened while another thread's batch is open on the file do nothing.
+ */
+class CDBBatch
+{
+private:
+    std::string strFile;
+    boost::thread::id threadId;
+    DbTxn* ptxn;
+    int nDurability;
+    bool fOuter;
+
+    CDBBatch(const CDBBatch&);
+    void operator=(const CDBBatch&);
+    int GetTxnFlags() const;
+
+public:
+    // nDurability: 0 = commit to the log buffer, 1 = write the log to the OS, 2 = sync the log and checkpoint
+    CDBBatch(const std::string& strFileIn, int nDurabilityIn);
+    ~CDBBatch();
+
+    // Commit the batch now rather than when it goes out of scope. False if
+    // the commit failed; a nested batch leaves it to the outer one and
+    // returns true.
+    bool Commit();
+
+    bool IsOwner() const { return threadId == boost::this_thread::get_id(); }
+    DbTxn* GetTxn();
+};
+
+
 /** RAII class that provides access to a Berkeley database */
 class CDB
 {
@@ -101,6 +139,7 @@ protected:
     std::string strFile;
     DbTxn *activeTxn;
     bool fReadOnly;
+    bool fBatched;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
@@ -222,7 +261,7 @@ protected:
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(activeTxn, &pcursor, 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -268,8 +307,11 @@ protected:
     }
 
 public:
+    // Within a CDBBatch these join the batch's transaction
     bool TxnBegin()
     {
+        if (fBatched)
+            return true;
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -281,6 +323,8 @@ public:
 
     bool TxnCommit()
     {
+        if (fBatched)
+            return true;
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -290,6 +334,8 @@ public:
 
     bool TxnAbort()
     {
+        if (fBatched)
+            return false;
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -344,9 +390,31 @@ public:
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
+    bool ReadAddressBalance(const CAddressKey& key, CAddressBalance& balance);
+    bool WriteAddressBalance(const CAddressKey& key, const CAddressBalance& balance);
+    bool EraseAddressBalance(const CAddressKey& key);
+    bool ReadAddressTx(const CAddressKey& key, uint256 hashTx, int& nHeight);
+    bool WriteAddressTx(const CAddressKey& key, uint256 hashTx, int nHeight);
+    bool EraseAddressTx(const CAddressKey& key, uint256 hashTx);
+    bool ReadAddressTxs(const CAddressKey& key, std::vector<std::pair<int, uint256> >& vTxRet);
+    bool WriteAddressUnspent(const CAddressKey& key, const COutPoint& outpoint, const CAddressUnspent& unspent);
+    bool EraseAddressUnspent(const CAddressKey& key, const COutPoint& outpoint);
+    bool ReadAddressUnspent(const CAddressKey& key, std::vector<std::pair<COutPoint, CAddressUnspent> >& vUnspentRet);
+    bool ReadAddressIndexBest(uint256& hashBest);
+    bool WriteAddressIndexBest(uint256 hashBest);
+    bool EraseAddressIndexBest();
+    bool EraseAddressIndex();
+    bool ReadSpentInfo(const COutPoint& outpoint, CSpentInfo& info);
+    bool WriteSpentInfo(const COutPoint& outpoint, const CSpentInfo& info);
+    bool EraseSpentInfo(const COutPoint& outpoint);
+    bool ReadSpentIndexBest(uint256& hashBest);
+    bool WriteSpentIndexBest(uint256 hashBest);
+    bool EraseSpentIndexBest();
+    bool EraseSpentIndex();
     LoadBlockIndexResult LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
+    bool EraseRecords(const std::string& strType);
 };
 
 
@@ -363,4 +431,15 @@ public:
     bool Read(CAddrMan& addr);
 };
 
+/** Access to the memory pool file (mempool.dat): transactions with the time they were received */
+class CMempoolDB
+{
+private:
+    boost::filesystem::path pathMempool;
+public:
+    CMempoolDB();
+    bool Write(const std::vector<std::pair<CTransaction, int64> >& vtx);
+    bool Read(std::vector<std::pair<CTransaction, int64> >& vtx);
+};
+
 #endif // BITCOIN_DB_H
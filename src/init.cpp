@@ -14,6 +14,7 @@
 #include "checkpoints.h"
 #include "chartdata.h"
 #include "blockexplorer.h"
+#include "addressindex.h"
 #include "blockexplorerserver.h"
 #include "msha3.h"
 
@@ -82,6 +83,7 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        DumpMempool();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -230,9 +232,12 @@ std::string HelpMessage()
         "  -pid=<file>            " + _("Specify pid file (default: Scashd.pid)") + "\n" +
         "  -gen                   " + _("Generate coins") + "\n" +
         "  -gen=0                 " + _("Don't generate coins") + "\n" +
+        "  -stakethreads=<n>      " + _("Number of threads searching stake kernels, at most one per core (default: 1)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -par=<n>               " + _("Number of threads checking scripts of received transactions, signing, loading and rescanning the wallet (default: number of cores)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -walletdurability=<n>  " + _("Durability of batched wallet writes: 0 = committed in memory, 1 = written to the OS, 2 = synced to disk (default: 1)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -254,6 +259,13 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxuploadrate=<n>     " + _("Limit total upload to <n> KB/s (default: 0 = unlimited)") + "\n" +
+        "  -maxdownloadrate=<n>   " + _("Limit total download to <n> KB/s (default: 0 = unlimited)") + "\n" +
+        "  -maxpeeruploadrate=<n> " + _("Limit upload to each peer to <n> KB/s (default: 0 = unlimited)") + "\n" +
+        "  -maxpeerdownloadrate=<n> " + _("Limit download from each peer to <n> KB/s (default: 0 = unlimited)") + "\n" +
+        "  -maxhistoryrate=<n>    " + _("Limit upload of old blocks to syncing peers to <n> KB/s (default: 0 = unlimited)") + "\n" +
+        "  -feelers               " + _("Probe addresses with short connections to rank them by latency (default: 1)") + "\n" +
+        "  -compactblocks         " + _("Relay new blocks as header and short transaction ids (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -291,6 +303,11 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 100)") + "\n" +
+        "  -mempoolexpiry=<n>     " + _("Do not keep transactions in the memory pool longer than <n> hours (default: 72)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and load it on startup (default: 1)") + "\n" +
+        "  -addressindex          " + _("Maintain an index of outputs and spends by address, for the getaddress* RPC calls (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of the input spending each output, shown by getrawtransaction and gettxout (default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -419,6 +436,9 @@ bool AppInit2()
 
     fNoListen = !GetBoolArg("-listen", true);
 
+    fAddressIndex = GetBoolArg("-addressindex");
+    fSpentIndex = GetBoolArg("-spentindex");
+
     BlockExplorer::fBlockExplorerEnabled = GetBoolArg("-blockexplorer");
 
     BlockExplorerServer::fBlockExplorerServerEnabled = GetBoolArg("-blockexplorerserver");
@@ -759,6 +779,16 @@ recoveryCheckpoint:
     }
     printf(" block index %15" PRI64d "ms\n", GetTimeMillis() - nStart);
 
+    if (fAddressIndex || fSpentIndex)
+        uiInterface.InitMessage(_("Building indexes..."));
+    if (!LoadAddressIndex())
+        return InitError(_("Error building the address and spent indexes"));
+    if (fRequestShutdown)
+    {
+        printf("Shutdown requested. Exiting.\n");
+        return false;
+    }
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree") || fDumpAll)
     {
         PrintBlockTree();
@@ -1018,8 +1048,10 @@ recoveryCheckpoint:
     if (!strErrors.str().empty())
         return InitError(strErrors.str());
 
-     // Add wallet transactions that aren't already in a block to mapTransactions
-    pwalletMain->ReacceptWalletTransactions();
+    // Check the wallet keys and add wallet transactions that aren't already in a
+    // block to mapTransactions, in the background
+    if (!NewThread(ThreadVerifyWallet, pwalletMain))
+        printf("Error: NewThread(ThreadVerifyWallet) failed\n");
 
 #if !defined(QT_GUI)
     // Loop until process is exit()ed from shutdown() function,
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "db.h"
@@ -66,48 +67,42 @@ static int64 GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
-// select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
+// A block that may contribute a bit to the next stake modifier
+class CStakeCandidate
+{
+public:
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+};
+
+// select a block from the candidate blocks in vCandidates (sorted by
+// timestamp), excluding already selected blocks in vSelected, and with
+// timestamp up to nSelectionIntervalStop.
 static bool SelectBlockFromCandidates(
-    vector<pair<int64, uint256> >& vSortedByTimestamp,
-    map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64 nSelectionIntervalStop, uint64 nStakeModifierPrev,
-    const CBlockIndex** pindexSelected)
+    const vector<CStakeCandidate>& vCandidates,
+    const vector<bool>& vSelected,
+    int64 nSelectionIntervalStop,
+    unsigned int& nSelectedRet)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
-    *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64, uint256)& item, vSortedByTimestamp)
+    for (unsigned int i = 0; i < vCandidates.size(); i++)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        const CStakeCandidate& candidate = vCandidates[i];
+        if (fSelected && candidate.pindex->GetBlockTime() > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (vSelected[i])
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
+        if (fSelected && candidate.hashSelection < hashBest)
         {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            nSelectedRet = i;
         }
         else if (!fSelected)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            nSelectedRet = i;
         }
     }
     if (fDebug && (GetBoolArg("-printstakemodifier") || fDumpAll))
@@ -150,35 +145,59 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64, uint256> > vSortedByTimestamp;
+    vector<pair<pair<int64, uint256>, const CBlockIndex*> > vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nModifierInterval / nStakeTargetSpacing);
     int64 nSelectionInterval = GetStakeModifierSelectionInterval();
     int64 nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        vSortedByTimestamp.push_back(make_pair(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()), pindex));
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
     reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
     sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
 
+    // The selection hash of a block only depends on the previous modifier,
+    // so it is computed once instead of once per round
+    vector<CStakeCandidate> vCandidates(vSortedByTimestamp.size());
+    for (unsigned int i = 0; i < vSortedByTimestamp.size(); i++)
+    {
+        CStakeCandidate& candidate = vCandidates[i];
+        candidate.pindex = vSortedByTimestamp[i].second;
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        uint256 hashProof = candidate.pindex->IsProofOfStake()? candidate.pindex->hashProofOfStake : candidate.pindex->GetBlockHash();
+        CDataStream ss(SER_GETHASH, 0);
+        ss << hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (candidate.pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+    }
+
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64 nStakeModifierNew = 0;
     int64 nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
-    for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
+    vector<bool> vSelected(vCandidates.size(), false);
+    vector<const CBlockIndex*> vSelectedBlocks;
+    for (int nRound=0; nRound<min(64, (int)vCandidates.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        unsigned int nSelected = 0;
+        if (!SelectBlockFromCandidates(vCandidates, vSelected, nSelectionIntervalStop, nSelected))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+        pindex = vCandidates[nSelected].pindex;
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64)pindex->GetStakeEntropyBit()) << nRound);
         // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        vSelected[nSelected] = true;
+        vSelectedBlocks.push_back(pindex);
         if (fDebug && (GetBoolArg("-printstakemodifier") || fDumpAll))
             printf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n",
                 nRound, DateTimeStrFormat(nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
@@ -198,11 +217,11 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CBlockIndex* pindexSelected, vSelectedBlocks)
         {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake()? "S" : "W");
         }
         printf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap.c_str());
     }
@@ -216,9 +235,49 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
     return true;
 }
 
+CStakeModifierTable stakeModifierTable;
+
+void CStakeModifierTable::Sync()
+{
+    // Forget what a reorg took out of the main chain
+    while (pindexScanned && !pindexScanned->IsInMainChain())
+        pindexScanned = pindexScanned->pprev;
+    int nHeightScanned = (pindexScanned ? pindexScanned->nHeight : -1);
+    while (!vGenerated.empty() && vGenerated.back()->nHeight > nHeightScanned)
+        vGenerated.pop_back();
+
+    // Catch up with the best block
+    const CBlockIndex* pindex = (pindexScanned ? pindexScanned->pnext : pindexGenesisBlock);
+    for (; pindex; pindex = pindex->pnext)
+    {
+        if (pindex->GeneratedStakeModifier())
+            vGenerated.push_back(pindex);
+        pindexScanned = pindex;
+    }
+}
+
+static bool CompareHeight(const CBlockIndex* pindex, int nHeight)
+{
+    return pindex->nHeight <= nHeight;
+}
+
+const CBlockIndex* CStakeModifierTable::Find(const CBlockIndex* pindexFrom, int64 nTime)
+{
+    LOCK(cs);
+    Sync();
+    if (!pindexFrom->IsInMainChain())
+        return NULL;
+
+    vector<const CBlockIndex*>::const_iterator it = lower_bound(vGenerated.begin(), vGenerated.end(), pindexFrom->nHeight, CompareHeight);
+    for (; it != vGenerated.end(); ++it)
+        if ((*it)->GetBlockTime() >= nTime)
+            return *it;
+    return NULL;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
+static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake, const CBlockIndex** ppindexModifier = NULL)
 {
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
@@ -227,32 +286,29 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64 nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
-    const CBlockIndex* pindex = pindexFrom;
 
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
-    {
-        if (!pindex->pnext)
-        {   // reached best block; may happen if node is behind on block chain
-            if (fPrintProofOfStake || (pindex->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
-                return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
-                    pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, hashBlockFrom.ToString().c_str());
-            else
-            {
-                if(fDebug && fPrintProofOfStake)
-                    printf(">> nStakeModifierTime = %" PRI64d ", pindexFrom->GetBlockTime() = %" PRI64d ", nStakeModifierSelectionInterval = %" PRI64d "\n", 
-                       nStakeModifierTime, pindexFrom->GetBlockTime(), nStakeModifierSelectionInterval);
-                return false;
-            }
-        }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
+    // first modifier generated a selection interval after the block, found
+    // in the table instead of walking pnext
+    const CBlockIndex* pindex = stakeModifierTable.Find(pindexFrom, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+    if (!pindex)
+    {   // reached best block; may happen if node is behind on block chain
+        const CBlockIndex* pindexLast = (pindexFrom->IsInMainChain() ? pindexBest : pindexFrom);
+        if (fPrintProofOfStake || (pindexLast->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
+            return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
+                pindexLast->GetBlockHash().ToString().c_str(), pindexLast->nHeight, hashBlockFrom.ToString().c_str());
+        else
         {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
+            if(fDebug && fPrintProofOfStake)
+                printf(">> nStakeModifierTime = %" PRI64d ", pindexFrom->GetBlockTime() = %" PRI64d ", nStakeModifierSelectionInterval = %" PRI64d "\n", 
+                   nStakeModifierTime, pindexFrom->GetBlockTime(), nStakeModifierSelectionInterval);
+            return false;
         }
     }
+    nStakeModifierHeight = pindex->nHeight;
+    nStakeModifierTime = pindex->GetBlockTime();
     nStakeModifier = pindex->nStakeModifier;
+    if (ppindexModifier)
+        *ppindexModifier = pindex;
     return true;
 }
 
@@ -360,6 +416,293 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+CStakeKernelCache stakeKernelCache;
+
+bool CStakeKernelCache::Get(const CTransaction& txPrev, const COutPoint& prevout, CStakeKernelPrefix& prefixRet)
+{
+    map<COutPoint, CStakeKernelPrefix>::iterator mi = mapPrefix.find(prevout);
+    if (mi != mapPrefix.end())
+    {
+        CStakeKernelPrefix& prefix = (*mi).second;
+
+        // A reorg may have moved the coin or the block the modifier came from
+        if (prefix.pindexFrom->IsInMainChain() &&
+            (prefix.pindexModifier == NULL || prefix.pindexModifier->IsInMainChain()))
+        {
+            // Modifier not settled yet; the chain may have grown far enough by now
+            if (prefix.pindexModifier == NULL)
+            {
+                int nStakeModifierHeight = 0;
+                int64 nStakeModifierTime = 0;
+                if (!GetKernelStakeModifier(prefix.pindexFrom->GetBlockHash(), prefix.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false, &prefix.pindexModifier))
+                    return false;
+            }
+            prefixRet = prefix;
+            return true;
+        }
+        mapPrefix.erase(mi);
+    }
+
+    CTxDB txdb("r");
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(prevout.hash, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+    map<uint256, CBlockIndex*>::iterator mib = mapBlockIndex.find(block.GetHash());
+    if (mib == mapBlockIndex.end() || !(*mib).second->IsInMainChain())
+        return false;
+
+    CStakeKernelPrefix prefix;
+    prefix.pindexFrom = (*mib).second;
+    prefix.nTimeBlockFrom = block.GetBlockTime();
+    prefix.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    prefix.nTimeTxPrev = txPrev.nTime;
+    prefix.nPrevout = prevout.n;
+    prefix.nValueIn = txPrev.vout[prevout.n].nValue;
+
+    int nStakeModifierHeight = 0;
+    int64 nStakeModifierTime = 0;
+    bool fModifier = GetKernelStakeModifier(block.GetHash(), prefix.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false, &prefix.pindexModifier);
+
+    mapPrefix[prevout] = prefix;
+    if (!fModifier)
+        return false;
+    prefixRet = prefix;
+    return true;
+}
+
+void CStakeKernelCache::Prune(const set<COutPoint>& setKeep)
+{
+    for (map<COutPoint, CStakeKernelPrefix>::iterator mi = mapPrefix.begin(); mi != mapPrefix.end(); )
+    {
+        if (setKeep.count((*mi).first))
+            ++mi;
+        else
+            mapPrefix.erase(mi++);
+    }
+}
+
+// Same rule as CheckStakeKernelHash for a range of timestamps, newest first.
+// Only the timestamp changes between attempts, so the kernel is serialized
+// once and the time weight target is only computed for hashes that pass the
+// loosest target of the range.
+bool SearchStakeKernel(const CStakeKernelPrefix& prefix, unsigned int nBits, unsigned int nTimeTxFrom, unsigned int nSearch, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet)
+{
+    if (nSearch == 0 || nTimeTxFrom < prefix.nTimeTxPrev || prefix.nTimeBlockFrom + nStakeMinAge > nTimeTxFrom)
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    // The time weight only grows with nTimeTx, so nTimeTxFrom has the loosest target
+    int64 nTimeWeightMax = min((int64)nTimeTxFrom - prefix.nTimeTxPrev, (int64)nStakeMaxAge) - nStakeMinAge;
+    CBigNum bnTargetMax = CBigNum(prefix.nValueIn) * nTimeWeightMax / COIN / (24 * 60 * 60) * bnTargetPerCoinDay;
+    uint256 hashTargetMax = (bnTargetMax > CBigNum(~uint256(0)) ? ~uint256(0) : bnTargetMax.getuint256());
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << prefix.nStakeModifier << prefix.nTimeBlockFrom << prefix.nTxPrevOffset << prefix.nTimeTxPrev << prefix.nPrevout << nTimeTxFrom;
+    std::vector<unsigned char> vchKernel(ss.begin(), ss.end());
+    unsigned char* pchTime = &vchKernel[vchKernel.size() - sizeof(unsigned int)];
+
+    for (unsigned int n = 0; n < nSearch; n++)
+    {
+        unsigned int nTimeTx = nTimeTxFrom - n;
+        if (nTimeTx < prefix.nTimeTxPrev || prefix.nTimeBlockFrom + nStakeMinAge > nTimeTx)
+            break;
+
+        memcpy(pchTime, &nTimeTx, sizeof(nTimeTx));
+        uint256 hashProofOfStake = Hash(vchKernel.begin(), vchKernel.end());
+        if (hashProofOfStake > hashTargetMax)
+            continue;
+
+        int64 nTimeWeight = min((int64)nTimeTx - prefix.nTimeTxPrev, (int64)nStakeMaxAge) - nStakeMinAge;
+        CBigNum bnCoinDayWeight = CBigNum(prefix.nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
+        if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+            continue;
+
+        nTimeTxRet = nTimeTx;
+        hashProofOfStakeRet = hashProofOfStake;
+        return true;
+    }
+    return false;
+}
+
+CStakeSearchStats stakeSearchStats;
+
+/** State shared by the threads of one SearchStakeKernels call */
+class CStakeSearchJob
+{
+public:
+    CCriticalSection cs;
+    const vector<CStakeKernelPrefix>& vPrefix;
+    unsigned int nBits;
+    unsigned int nTimeTxFrom;
+    unsigned int nSearch;
+    unsigned int nNext;
+    unsigned int nSearched;
+    int nFound;
+    unsigned int nTimeTx;
+    uint256 hashProofOfStake;
+
+    CStakeSearchJob(const vector<CStakeKernelPrefix>& vPrefixIn, unsigned int nBitsIn, unsigned int nTimeTxFromIn, unsigned int nSearchIn) :
+        vPrefix(vPrefixIn), nBits(nBitsIn), nTimeTxFrom(nTimeTxFromIn), nSearch(nSearchIn)
+    {
+        nNext = 0;
+        nSearched = 0;
+        nFound = -1;
+        nTimeTx = 0;
+        hashProofOfStake = 0;
+    }
+};
+
+static void StakeSearchWorker(CStakeSearchJob* job)
+{
+    unsigned int nDone = 0;
+    LOOP
+    {
+        // Take the next batch of coins unless somebody found a kernel
+        unsigned int nBegin, nEnd;
+        {
+            LOCK(job->cs);
+            job->nSearched += nDone;
+            nDone = 0;
+            if (job->nFound >= 0 || job->nNext >= job->vPrefix.size() || fShutdown)
+                return;
+            nBegin = job->nNext;
+            nEnd = min(nBegin + STAKE_SEARCH_BATCH, (unsigned int)job->vPrefix.size());
+            job->nNext = nEnd;
+        }
+
+        for (unsigned int i = nBegin; i < nEnd; i++)
+        {
+            unsigned int nTimeTx = 0;
+            uint256 hashProofOfStake = 0;
+            nDone++;
+            if (SearchStakeKernel(job->vPrefix[i], job->nBits, job->nTimeTxFrom, job->nSearch, nTimeTx, hashProofOfStake))
+            {
+                LOCK(job->cs);
+                job->nSearched += nDone;
+                if (job->nFound < 0)
+                {
+                    job->nFound = i;
+                    job->nTimeTx = nTimeTx;
+                    job->hashProofOfStake = hashProofOfStake;
+                }
+                return;
+            }
+        }
+    }
+}
+
+/** Search threads kept from one SearchStakeKernels call to the next. The
+ * calling thread searches too, so a job with nThreads uses nThreads - 1 of
+ * them. Idle threads wait for a job and exit on shutdown.
+ */
+class CStakeSearchThreads
+{
+private:
+    CCriticalSection csRun;
+    boost::mutex mutex;
+    boost::condition_variable condJob;
+    boost::condition_variable condDone;
+    CStakeSearchJob* pjob;
+    int nStarted;
+    int nWanted;
+    int nRunning;
+
+    static void ThreadStakeSearch(void* parg)
+    {
+        RenameThread("scash-stakesearch");
+        ((CStakeSearchThreads*)parg)->Worker();
+    }
+
+    void Worker()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fShutdown)
+        {
+            if (nWanted == 0)
+            {
+                condJob.timed_wait(lock, boost::posix_time::seconds(1));
+                continue;
+            }
+            nWanted--;
+            nRunning++;
+            CStakeSearchJob* job = pjob;
+            lock.unlock();
+            StakeSearchWorker(job);
+            lock.lock();
+            if (--nRunning == 0)
+                condDone.notify_all();
+        }
+        nStarted--;
+    }
+
+public:
+    CStakeSearchThreads()
+    {
+        pjob = NULL;
+        nStarted = 0;
+        nWanted = 0;
+        nRunning = 0;
+    }
+
+    void Run(CStakeSearchJob* job, int nThreads)
+    {
+        LOCK(csRun);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (; nStarted < nThreads - 1; nStarted++)
+                if (!NewThread(ThreadStakeSearch, this))
+                    break;
+            pjob = job;
+            nWanted = min(nThreads - 1, nStarted);
+        }
+        condJob.notify_all();
+        StakeSearchWorker(job);
+
+        // The job is done once this thread's search returns; wait for the
+        // threads still finishing their batch
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWanted = 0;
+        while (nRunning > 0)
+            condDone.wait(lock);
+        pjob = NULL;
+    }
+};
+
+int SearchStakeKernels(const vector<CStakeKernelPrefix>& vPrefix, unsigned int nBits, unsigned int nTimeTxFrom, unsigned int nSearch, int nThreads, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet, unsigned int& nSearchedRet)
+{
+    // Never destroyed: idle search threads may still be waiting on it at exit
+    static CStakeSearchThreads* pthreads = new CStakeSearchThreads();
+    CStakeSearchJob job(vPrefix, nBits, nTimeTxFrom, nSearch);
+
+    // No point in more threads than batches
+    nThreads = min(nThreads, (int)((vPrefix.size() + STAKE_SEARCH_BATCH - 1) / STAKE_SEARCH_BATCH));
+    if (nThreads <= 1)
+        StakeSearchWorker(&job);
+    else
+        pthreads->Run(&job, nThreads);
+
+    nSearchedRet = job.nSearched;
+    if (job.nFound >= 0)
+    {
+        nTimeTxRet = job.nTimeTx;
+        hashProofOfStakeRet = job.hashProofOfStake;
+    }
+    return job.nFound;
+}
+
+int GetStakeThreads()
+{
+    int nCores = max(1, (int)boost::thread::hardware_concurrency());
+    return max(1, min((int)GetArg("-stakethreads", 1), nCores));
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake)
 {
@@ -14,6 +14,33 @@ extern unsigned int nModifierInterval;
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+/** Main chain blocks that generated a stake modifier, in height order.
+ * Kept in step with the best chain on use: a reorg drops the entries above
+ * the fork and new blocks are appended, so finding the modifier for a
+ * kernel is a binary search instead of a walk along pnext.
+ */
+class CStakeModifierTable
+{
+private:
+    CCriticalSection cs;
+    std::vector<const CBlockIndex*> vGenerated;
+    const CBlockIndex* pindexScanned;
+
+    void Sync();
+
+public:
+    CStakeModifierTable()
+    {
+        pindexScanned = NULL;
+    }
+
+    // First main chain block above pindexFrom that generated a modifier at or after nTime,
+    // NULL if the chain is not that far yet. Caller holds cs_main.
+    const CBlockIndex* Find(const CBlockIndex* pindexFrom, int64 nTime);
+};
+
+extern CStakeModifierTable stakeModifierTable;
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
@@ -21,6 +48,120 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fPrintProofOfStake=false);
 
+/** The part of a stake kernel that does not depend on the coinstake timestamp */
+class CStakeKernelPrefix
+{
+public:
+    const CBlockIndex* pindexFrom;
+    const CBlockIndex* pindexModifier; // NULL until the chain is a selection interval past pindexFrom
+    uint64 nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    unsigned int nPrevout;
+    int64 nValueIn;
+
+    CStakeKernelPrefix()
+    {
+        pindexFrom = NULL;
+        pindexModifier = NULL;
+        nStakeModifier = 0;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nPrevout = 0;
+        nValueIn = 0;
+    }
+};
+
+/** Kernel prefixes of the coins a wallet stakes with.
+ * Tx index lookup, block header read and the stake modifier walk are done
+ * once per coin; an entry is only rebuilt when a reorg takes its block or
+ * the block its modifier came from out of the main chain.
+ */
+class CStakeKernelCache
+{
+private:
+    std::map<COutPoint, CStakeKernelPrefix> mapPrefix;
+
+public:
+    // Caller holds cs_main. False if the coin can not stake (yet).
+    bool Get(const CTransaction& txPrev, const COutPoint& prevout, CStakeKernelPrefix& prefixRet);
+
+    // Forget coins that are no longer staked
+    void Prune(const std::set<COutPoint>& setKeep);
+
+    unsigned int size() const
+    {
+        return mapPrefix.size();
+    }
+};
+
+extern CStakeKernelCache stakeKernelCache;
+
+// Search timestamps nTimeTxFrom down to nTimeTxFrom - nSearch + 1 for a kernel meeting the target
+bool SearchStakeKernel(const CStakeKernelPrefix& prefix, unsigned int nBits, unsigned int nTimeTxFrom, unsigned int nSearch, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet);
+
+// Coins handed to a search thread at a time
+static const unsigned int STAKE_SEARCH_BATCH = 16;
+
+// SearchStakeKernel over all of vPrefix with nThreads threads, which are kept
+// for the next call; the first kernel found stops the others. Returns its index
+// in vPrefix, or -1, and the number of coins searched in nSearchedRet.
+int SearchStakeKernels(const std::vector<CStakeKernelPrefix>& vPrefix, unsigned int nBits, unsigned int nTimeTxFrom, unsigned int nSearch, int nThreads, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet, unsigned int& nSearchedRet);
+
+// -stakethreads, kept between 1 and the number of cores
+int GetStakeThreads();
+
+/** Kernel search statistics for getmininginfo */
+class CStakeSearchStats
+{
+private:
+    mutable CCriticalSection cs;
+    uint64 nPasses;
+    uint64 nCoinsSearched;
+    uint64 nMissedWindows;
+    uint64 nMissedSeconds;
+    double dCoinsPerSecond;
+
+public:
+    CStakeSearchStats()
+    {
+        nPasses = 0;
+        nCoinsSearched = 0;
+        nMissedWindows = 0;
+        nMissedSeconds = 0;
+        dCoinsPerSecond = 0;
+    }
+
+    // nMissed: seconds since the previous pass that were too far back to search
+    void AddPass(unsigned int nCoins, int64 nMillis, int64 nMissed)
+    {
+        LOCK(cs);
+        nPasses++;
+        nCoinsSearched += nCoins;
+        if (nMissed > 0)
+        {
+            nMissedWindows++;
+            nMissedSeconds += nMissed;
+        }
+        if (nCoins > 0)
+            dCoinsPerSecond = nCoins * 1000.0 / std::max(nMillis, (int64)1);
+    }
+
+    void Get(uint64& nPassesRet, uint64& nCoinsSearchedRet, uint64& nMissedWindowsRet, uint64& nMissedSecondsRet, double& dCoinsPerSecondRet) const
+    {
+        LOCK(cs);
+        nPassesRet = nPasses;
+        nCoinsSearchedRet = nCoinsSearched;
+        nMissedWindowsRet = nMissedWindows;
+        nMissedSecondsRet = nMissedSeconds;
+        dCoinsPerSecondRet = dCoinsPerSecond;
+    }
+};
+
+extern CStakeSearchStats stakeSearchStats;
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake);
@@ -188,7 +188,7 @@ void CKey::MakeNewKey(bool fCompressed)
     fSet = true;
 }
 
-bool CKey::SetPrivKey(const CPrivKey& vchPrivKey)
+bool CKey::SetPrivKey(const CPrivKey& vchPrivKey, bool fSkipCheck)
 {
     const unsigned char* pbegin = &vchPrivKey[0];
     if (d2i_ECPrivateKey(&pkey, &pbegin, vchPrivKey.size()))
@@ -196,7 +196,7 @@ bool CKey::SetPrivKey(const CPrivKey& vchPrivKey)
         // In testing, d2i_ECPrivateKey can return true
         // but fill in pkey with a key that fails
         // EC_KEY_check_key, so:
-        if (EC_KEY_check_key(pkey))
+        if (fSkipCheck || EC_KEY_check_key(pkey))
         {
             fSet = true;
             return true;
@@ -134,7 +134,8 @@ public:
     bool IsCompressed() const;
 
     void MakeNewKey(bool fCompressed);
-    bool SetPrivKey(const CPrivKey& vchPrivKey);
+    // fSkipCheck leaves out the EC consistency check, for callers that run IsValid() later
+    bool SetPrivKey(const CPrivKey& vchPrivKey, bool fSkipCheck = false);
     bool SetSecret(const CSecret& vchSecret, bool fCompressed = false);
     CSecret GetSecret(bool &fCompressed) const;
     CPrivKey GetPrivKey() const;
@@ -12,16 +12,22 @@
 #include "ui_interface.h"
 #include "kernel.h"
 #include "blockexplorer.h"
+#include "addressindex.h"
+#include "compactblock.h"
+#include "blockdownload.h"
 
 #ifndef WIN32
 #include <sys/time.h>
 #endif
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 using namespace boost;
@@ -74,6 +80,23 @@ map<uint256, uint256> mapProofOfStake;
 map<uint256, CDataStream*> mapOrphanTransactions;
 map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
 
+/** A transaction waiting for ProcessTransactionBatch */
+class CQueuedTx
+{
+public:
+    CTransaction tx;
+    CDataStream vMsg;
+    CNode* pfrom; // holds a reference; NULL for orphans being retried
+
+    CQueuedTx(const CTransaction& txIn, const CDataStream& vMsgIn, CNode* pfromIn) : tx(txIn), vMsg(vMsgIn), pfrom(pfromIn)
+    {
+    }
+};
+
+static vector<CQueuedTx> vTxQueue;
+static set<uint256> setTxQueued;
+static CCriticalSection cs_vTxQueue;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -161,6 +184,26 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
         pwallet->AddToWalletIfInvolvingMe(tx, pblock, fUpdate);
 }
 
+// SyncWithWallets for every transaction of a block, with each wallet's writes in one batch
+void static SyncBlockWithWallets(const CBlock& block, bool fUpdate, bool fConnect)
+{
+    boost::ptr_vector<CWalletDBBatch> vBatch;
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        vBatch.push_back(new CWalletDBBatch(pwallet));
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        SyncWithWallets(tx, &block, fUpdate, fConnect);
+
+    // The block is valid either way, but the wallet in memory is now ahead of wallet.dat
+    BOOST_FOREACH(CWalletDBBatch& batch, vBatch)
+    {
+        if (!batch.Commit())
+        {
+            error("SyncBlockWithWallets() : writing wallet transactions of block %s failed", block.GetHash().ToString().c_str());
+            strMiscWarning = _("Warning: writing wallet.dat failed! Check the disk and restart with -rescan.");
+        }
+    }
+}
+
 // notify wallets about a new best chain
 void static SetBestChain(const CBlockLocator& loc)
 {
@@ -559,6 +602,10 @@ int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
         nMinFee *= MAX_BLOCK_SIZE_GEN / (MAX_BLOCK_SIZE_GEN - nNewBlockSize);
     }
 
+    // A memory pool that had to evict raises the floor for relaying and sending
+    if (mode != GMF_BLOCK)
+        nMinFee = max(nMinFee, mempool.GetMinFee(nBytes));
+
     if (!MoneyRange(nMinFee))
         nMinFee = MAX_MONEY;
 
@@ -568,6 +615,15 @@ int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
 
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                         bool* pfMissingInputs)
+{
+    CTxMemPoolPrepared prepared;
+    if (!prepare(txdb, tx, fCheckInputs, true, pfMissingInputs, prepared))
+        return false;
+    return commit(txdb, tx, prepared);
+}
+
+bool CTxMemPool::prepare(CTxDB& txdb, CTransaction &tx, bool fCheckInputs, bool fScriptChecks,
+                         bool* pfMissingInputs, CTxMemPoolPrepared& prepared)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -626,13 +682,18 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                 if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
                     return false;
             }
+            prepared.hashOld = ptxOld->GetHash();
             break;
         }
     }
 
+    CTxMemPoolEntry& entry = prepared.entry;
+    entry = CTxMemPoolEntry(tx);
+    prepared.fCheckInputs = fCheckInputs;
+    prepared.hashBestChainInputs = hashBestChain;
     if (fCheckInputs)
     {
-        MapPrevTx mapInputs;
+        MapPrevTx& mapInputs = prepared.mapInputs;
         map<uint256, CTxIndex> mapUnused;
         bool fInvalid = false;
         if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
@@ -643,6 +704,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                 *pfMissingInputs = true;
             return false;
         }
+        entry.SetInputs(tx, mapInputs);
 
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(mapInputs) && !fTestNet)
@@ -691,27 +753,90 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, fScriptChecks))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
     }
+    else
+    {
+        // Not checked (resurrected from a disconnected block), but block
+        // assembly still wants its fee and priority
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapUnused;
+        bool fInvalid = false;
+        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+            entry.SetInputs(tx, mapInputs);
+    }
+    return true;
+}
+
+bool CTxMemPool::commit(CTxDB& txdb, CTransaction &tx, CTxMemPoolPrepared& prepared)
+{
+    uint256 hash = tx.GetHash();
+
+    // cs_main was let go since prepare(): inputs may have been spent or mined
+    if (prepared.fCheckInputs && prepared.hashBestChainInputs != hashBestChain)
+    {
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapUnused;
+        bool fInvalid = false;
+        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+            return error("CTxMemPool::commit() : inputs of %s no longer available", hash.ToString().substr(0,10).c_str());
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, false))
+            return error("CTxMemPool::commit() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
+        prepared.entry.SetInputs(tx, mapInputs);
+        prepared.mapInputs = mapInputs;
+        prepared.hashBestChainInputs = hashBestChain;
+    }
 
     // Store transaction in memory
     {
         LOCK(cs);
+        if (mapTx.count(hash))
+            return false;
+
+        // Other transactions may have entered or left the pool meanwhile
+        CTransaction* ptxOld = NULL;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<COutPoint, CInPoint>::iterator mi = mapNextTx.find(txin.prevout);
+            if (mi != mapNextTx.end())
+            {
+                if (prepared.hashOld == 0 || (*mi).second.ptx->GetHash() != prepared.hashOld)
+                    return false;
+                ptxOld = (*mi).second.ptx;
+            }
+            MapPrevTx::const_iterator it = prepared.mapInputs.find(txin.prevout.hash);
+            if (it != prepared.mapInputs.end() && !mapTx.count(txin.prevout.hash) &&
+                ((*it).second.first.pos.IsNull() || (*it).second.first.pos == CDiskTxPos(1,1,1)))
+                return error("CTxMemPool::commit() : input %s of %s left the memory pool",
+                             txin.prevout.hash.ToString().substr(0,10).c_str(), hash.ToString().substr(0,10).c_str());
+        }
+
         if (ptxOld)
         {
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, prepared.entry);
+
+        // Keep the pool within its budget; the new transaction may be the one to go
+        static int64 nLastExpire;
+        if (GetTime() - nLastExpire >= 60)
+        {
+            Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            nLastExpire = GetTime();
+        }
+        TrimToSize(GetMaxSize());
+        if (!mapTx.count(hash))
+            return error("CTxMemPool::accept() : memory pool full, %s not kept", hash.ToString().substr(0,10).c_str());
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+    if (prepared.hashOld != 0)
+        EraseFromWallets(prepared.hashOld);
 
     printf("CTxMemPool::accept() : accepted %s (poolsz %" PRIszu ")\n",
            hash.ToString().substr(0,10).c_str(),
@@ -724,7 +849,286 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
+// Set once mempool.dat has been read back completely, so an interrupted
+// load does not overwrite it with a partial pool
+static bool fMempoolLoaded = false; // guarded by mempool.cs
+
+void DumpMempool()
+{
+    if (!GetBoolArg("-persistmempool", true))
+        return;
+
+    int64 nStart = GetTimeMillis();
+    vector<pair<CTransaction, int64> > vtx;
+    {
+        LOCK(mempool.cs);
+        if (!fMempoolLoaded)
+        {
+            printf("DumpMempool() : mempool.dat was not loaded completely, leaving it as is\n");
+            return;
+        }
+
+        // Parents before children, so the reload needs few retries
+        vector<pair<unsigned int, uint256> > vOrder;
+        vOrder.reserve(mempool.mapEntry.size());
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+            vOrder.push_back(make_pair((*mi).second.nCountWithAncestors, (*mi).first));
+        sort(vOrder.begin(), vOrder.end());
+
+        vtx.reserve(vOrder.size());
+        for (unsigned int i = 0; i < vOrder.size(); i++)
+            vtx.push_back(make_pair(mempool.mapTx[vOrder[i].second], mempool.mapEntry[vOrder[i].second].nTime));
+    }
+
+    CMempoolDB mdb;
+    if (mdb.Write(vtx))
+        printf("Flushed %" PRIszu " transactions to mempool.dat  %" PRI64d "ms\n",
+               vtx.size(), GetTimeMillis() - nStart);
+}
+
+static void ThreadLoadMempool2(void* parg)
+{
+    int64 nStart = GetTimeMillis();
+    vector<pair<CTransaction, int64> > vtx;
+    {
+        CMempoolDB mdb;
+        if (!mdb.Read(vtx))
+        {
+            printf("Invalid or missing mempool.dat; starting with an empty memory pool\n");
+            LOCK(mempool.cs);
+            fMempoolLoaded = true;
+            return;
+        }
+    }
+
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0;
+    int64 nCutoff = GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    vector<pair<CTransaction, int64> > vPending;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        if (vtx[i].second < nCutoff)
+            nExpired++;
+        else
+            vPending.push_back(vtx[i]);
+    }
+
+    // A child in the same batch as its parent misses inputs until the
+    // parent is committed; retry those as long as there is progress
+    while (!vPending.empty() && !fShutdown)
+    {
+        unsigned int nAcceptedBefore = nAccepted;
+        vector<pair<CTransaction, int64> > vRetry;
+        for (unsigned int nBegin = 0; nBegin < vPending.size() && !fShutdown; nBegin += MEMPOOL_LOAD_BATCH)
+        {
+            unsigned int nEnd = min(nBegin + MEMPOOL_LOAD_BATCH, (unsigned int)vPending.size());
+            vector<CTransaction> vBatch;
+            for (unsigned int i = nBegin; i < nEnd; i++)
+                vBatch.push_back(vPending[i].first);
+
+            vector<bool> vAccepted, vMissingInputs;
+            mempool.acceptBatch(vBatch, vAccepted, vMissingInputs);
+
+            LOCK(mempool.cs);
+            for (unsigned int i = 0; i < vBatch.size(); i++)
+            {
+                if (vAccepted[i])
+                {
+                    // Keep the original receive time for expiry
+                    nAccepted++;
+                    map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapEntry.find(vBatch[i].GetHash());
+                    if (mi != mempool.mapEntry.end())
+                        (*mi).second.nTime = vPending[nBegin + i].second;
+                }
+                else if (vMissingInputs[i])
+                    vRetry.push_back(vPending[nBegin + i]);
+                else
+                    nFailed++;
+            }
+        }
+        if (nAccepted == nAcceptedBefore)
+        {
+            nFailed += vRetry.size();
+            break;
+        }
+        vPending.swap(vRetry);
+    }
+
+    if (!fShutdown)
+    {
+        LOCK(mempool.cs);
+        fMempoolLoaded = true;
+    }
+    printf("Loaded %u transactions from mempool.dat (%u failed, %u expired)  %" PRI64d "ms\n",
+           nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+}
+
+void ThreadLoadMempool(void* parg)
+{
+    // Make this thread recognisable as the mempool loading thread
+    RenameThread("scash-mempool");
+
+    vnThreadsRunning[THREAD_LOADMEMPOOL]++;
+    try
+    {
+        ThreadLoadMempool2(parg);
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadLoadMempool()");
+    }
+    vnThreadsRunning[THREAD_LOADMEMPOOL]--;
+    printf("ThreadLoadMempool exited\n");
+}
+
+/** One input script of a batch, checked by a worker thread */
+class CScriptCheck
+{
+public:
+    const CTransaction* ptxFrom;
+    const CTransaction* ptxTo;
+    const CSignatureHasher* pHasher;
+    unsigned int nIn;
+    unsigned int nTx;
+
+    CScriptCheck(const CTransaction* ptxFromIn, const CTransaction* ptxToIn, const CSignatureHasher* pHasherIn, unsigned int nInIn, unsigned int nTxIn) :
+        ptxFrom(ptxFromIn), ptxTo(ptxToIn), pHasher(pHasherIn), nIn(nInIn), nTx(nTxIn)
+    {
+    }
+};
+
+static void ScriptCheckWorker(const vector<CScriptCheck>* pvChecks, vector<char>* pvResult, unsigned int nStart, unsigned int nStride)
+{
+    for (unsigned int i = nStart; i < pvChecks->size() && !fShutdown; i += nStride)
+    {
+        const CScriptCheck& check = (*pvChecks)[i];
+        (*pvResult)[i] = VerifySignature(*check.ptxFrom, *check.ptxTo, check.nIn, true, 0, check.pHasher);
+    }
+}
+
+void CTxMemPool::acceptBatch(vector<CTransaction>& vtx, vector<bool>& vAccepted, vector<bool>& vMissingInputs)
+{
+    vAccepted.assign(vtx.size(), false);
+    vMissingInputs.assign(vtx.size(), false);
+    vector<CTxMemPoolPrepared> vPrepared(vtx.size());
+    vector<bool> vPrepareOk(vtx.size(), false);
+
+    // Everything but the scripts, in one pass
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            bool fMissingInputs = false;
+            vPrepareOk[i] = prepare(txdb, vtx[i], true, false, &fMissingInputs, vPrepared[i]);
+            vMissingInputs[i] = fMissingInputs;
+        }
+    }
+
+    // Inputs of one transaction share its signature hasher
+    vector<CScriptCheck> vChecks;
+    boost::ptr_vector<CSignatureHasher> vHashers;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        if (!vPrepareOk[i])
+            continue;
+        vHashers.push_back(new CSignatureHasher(vtx[i]));
+        for (unsigned int j = 0; j < vtx[i].vin.size(); j++)
+        {
+            const CTransaction& txPrev = vPrepared[i].mapInputs[vtx[i].vin[j].prevout.hash].second;
+            vChecks.push_back(CScriptCheck(&txPrev, &vtx[i], &vHashers.back(), j, i));
+        }
+    }
+
+    // Scripts, spread over -par threads
+    vector<char> vResult(vChecks.size(), false);
+    int nThreads = GetArg("-par", boost::thread::hardware_concurrency());
+    nThreads = max(1, min(nThreads, (int)(vChecks.size() / 8)));
+    if (nThreads == 1)
+        ScriptCheckWorker(&vChecks, &vResult, 0, 1);
+    else
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ScriptCheckWorker, &vChecks, &vResult, i, nThreads));
+        threadGroup.join_all();
+    }
+
+    for (unsigned int i = 0; i < vChecks.size(); i++)
+    {
+        const CScriptCheck& check = vChecks[i];
+        if (vResult[i] || !vPrepareOk[check.nTx])
+            continue;
+        vPrepareOk[check.nTx] = false;
+
+        // Same distinction ConnectInputs makes for old clients relaying bad P2SH
+        CTransaction& tx = vtx[check.nTx];
+        if (VerifySignature(*check.ptxFrom, tx, check.nIn, false, 0))
+            error("CTxMemPool::acceptBatch() : %s P2SH VerifySignature failed", tx.GetHash().ToString().substr(0,10).c_str());
+        else
+            tx.DoS(100, error("CTxMemPool::acceptBatch() : %s VerifySignature failed", tx.GetHash().ToString().substr(0,10).c_str()));
+    }
+
+    // Commit, in the order the transactions came
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            if (vPrepareOk[i])
+                vAccepted[i] = commit(txdb, vtx[i], vPrepared[i]);
+    }
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& tx)
+{
+    nFee = 0;
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nSigOps = tx.GetLegacySigOpCount();
+    nValueInChain = 0;
+    dValueHeightInChain = 0;
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = 0;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nFeesWithDescendants = 0;
+    nTime = GetTime();
+
+    // The transaction with its scripts, plus the map and index nodes the
+    // pool keeps for it (about 32 bytes of node overhead each)
+    nUsage = sizeof(CTransaction) + sizeof(CTxMemPoolEntry) + 4 * (sizeof(uint256) + 32);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += sizeof(CTxIn) + txin.scriptSig.size() + sizeof(COutPoint) + sizeof(CInPoint) + 32;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += sizeof(CTxOut) + txout.scriptPubKey.size();
+}
+
+void CTxMemPoolEntry::SetInputs(const CTransaction& tx, MapPrevTx& mapInputs)
+{
+    nFee = tx.GetValueIn(mapInputs) - tx.GetValueOut();
+    nSigOps = tx.GetLegacySigOpCount() + tx.GetP2SHSigOpCount(mapInputs);
+
+    // Depth is looked up once here instead of every time a block is assembled
+    nValueInChain = 0;
+    dValueHeightInChain = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+        if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+            continue; // in the memory pool, adds no priority
+        int nConf = txindex.GetDepthInMainChain();
+        if (nConf == 0)
+            continue;
+        int64 nValueIn = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+        nValueInChain += nValueIn;
+        dValueHeightInChain += (double)nValueIn * (nBestHeight + 1 - nConf);
+    }
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+{
+    return addUnchecked(hash, tx, CTxMemPoolEntry(tx));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entryIn)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
@@ -732,13 +1136,140 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+
+        CTxMemPoolEntry& entry = mapEntry[hash];
+        entry = entryIn;
+        entry.setParents.clear();
+        entry.setChildren.clear();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(txin.prevout.hash);
+            if (mi == mapEntry.end())
+                continue;
+            entry.setParents.insert(txin.prevout.hash);
+            (*mi).second.setChildren.insert(hash);
+        }
+
+        // A transaction resurrected by a reorganization may already have children
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator mi = mapNextTx.find(COutPoint(hash, i));
+            if (mi == mapNextTx.end())
+                continue;
+            map<uint256, CTxMemPoolEntry>::iterator miChild = mapEntry.find((*mi).second.ptx->GetHash());
+            if (miChild == mapEntry.end())
+                continue;
+            entry.setChildren.insert((*miChild).first);
+            (*miChild).second.setParents.insert(hash);
+        }
+
+        // Not indexed yet, the Update functions have nothing to unindex
+        entry.nCountWithAncestors = 0;
+        entry.nCountWithDescendants = 0;
+        UpdateAncestorState(hash);
+        UpdateDescendantState(hash);
+
+        set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            UpdateAncestorState(hashDescendant);
+        set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            UpdateDescendantState(hashAncestor);
+
+        nTotalTxSize += entry.nTxSize;
+        nTotalUsage += entry.nUsage;
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::CalculateAncestors(const uint256& hash, set<uint256>& setAncestors) const
+{
+    vector<uint256> vStack(1, hash);
+    while (!vStack.empty())
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(vStack.back());
+        vStack.pop_back();
+        if (mi == mapEntry.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashParent, (*mi).second.setParents)
+            if (setAncestors.insert(hashParent).second)
+                vStack.push_back(hashParent);
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    vector<uint256> vStack(1, hash);
+    while (!vStack.empty())
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(vStack.back());
+        vStack.pop_back();
+        if (mi == mapEntry.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashChild, (*mi).second.setChildren)
+            if (setDescendants.insert(hashChild).second)
+                vStack.push_back(hashChild);
+    }
+}
+
+void CTxMemPool::UpdateAncestorState(const uint256& hash)
+{
+    map<uint256, CTxMemPoolEntry>::iterator it = mapEntry.find(hash);
+    assert(it != mapEntry.end());
+    CTxMemPoolEntry& entry = (*it).second;
+    if (entry.nCountWithAncestors > 0)
+        setByAncestorFee.erase(make_pair(entry.GetAncestorFeePerKb(), hash));
+
+    set<uint256> setAncestors;
+    CalculateAncestors(hash, setAncestors);
+    entry.nCountWithAncestors = 1;
+    entry.nSizeWithAncestors = entry.nTxSize;
+    entry.nFeesWithAncestors = entry.nFee;
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hashAncestor);
+        if (mi == mapEntry.end())
+            continue;
+        const CTxMemPoolEntry& ancestor = (*mi).second;
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += ancestor.nTxSize;
+        entry.nFeesWithAncestors += ancestor.nFee;
+    }
+
+    setByAncestorFee.insert(make_pair(entry.GetAncestorFeePerKb(), hash));
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash)
+{
+    map<uint256, CTxMemPoolEntry>::iterator it = mapEntry.find(hash);
+    assert(it != mapEntry.end());
+    CTxMemPoolEntry& entry = (*it).second;
+    if (entry.nCountWithDescendants > 0)
+        setByDescendantFee.erase(make_pair(entry.GetDescendantFeePerKb(), hash));
+
+    set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    entry.nCountWithDescendants = 1;
+    entry.nSizeWithDescendants = entry.nTxSize;
+    entry.nFeesWithDescendants = entry.nFee;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hashDescendant);
+        if (mi == mapEntry.end())
+            continue;
+        const CTxMemPoolEntry& descendant = (*mi).second;
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += descendant.nTxSize;
+        entry.nFeesWithDescendants += descendant.nFee;
+    }
+
+    setByDescendantFee.insert(make_pair(entry.GetDescendantFeePerKb(), hash));
+}
 
-bool CTxMemPool::remove(CTransaction &tx)
+bool CTxMemPool::remove(CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
@@ -746,9 +1277,65 @@ bool CTxMemPool::remove(CTransaction &tx)
         uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
         {
+            set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+
+            if (fRecursive && !setDescendants.empty())
+            {
+                // Deepest first, so every removal leaves a consistent pool
+                vector<pair<unsigned int, uint256> > vDescendants;
+                BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                {
+                    map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hashDescendant);
+                    if (mi != mapEntry.end())
+                        vDescendants.push_back(make_pair((*mi).second.nCountWithAncestors, hashDescendant));
+                }
+                sort(vDescendants.begin(), vDescendants.end(), greater<pair<unsigned int, uint256> >());
+                for (unsigned int i = 0; i < vDescendants.size(); i++)
+                {
+                    map<uint256, CTransaction>::iterator mi = mapTx.find(vDescendants[i].second);
+                    if (mi == mapTx.end())
+                        continue;
+                    CTransaction txDescendant = (*mi).second;
+                    remove(txDescendant);
+                }
+                setDescendants.clear();
+            }
+
+            set<uint256> setAncestors;
+            CalculateAncestors(hash, setAncestors);
+
+            map<uint256, CTxMemPoolEntry>::iterator it = mapEntry.find(hash);
+            assert(it != mapEntry.end());
+            const CTxMemPoolEntry& entry = (*it).second;
+            nTotalTxSize -= entry.nTxSize;
+            nTotalUsage -= entry.nUsage;
+            setByAncestorFee.erase(make_pair(entry.GetAncestorFeePerKb(), hash));
+            setByDescendantFee.erase(make_pair(entry.GetDescendantFeePerKb(), hash));
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+            {
+                map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashParent);
+                if (mi != mapEntry.end())
+                    (*mi).second.setChildren.erase(hash);
+            }
+            BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+            {
+                map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashChild);
+                if (mi != mapEntry.end())
+                    (*mi).second.setParents.erase(hash);
+            }
+            mapEntry.erase(it);
+
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
+
+            // Usually mined, so its descendants stop paying for it
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                UpdateAncestorState(hashDescendant);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                UpdateDescendantState(hashAncestor);
+
             nTransactionsUpdated++;
         }
     }
@@ -760,9 +1347,94 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setByAncestorFee.clear();
+    setByDescendantFee.clear();
+    nTotalTxSize = 0;
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
 }
 
+int CTxMemPool::Expire(int64 nCutoff)
+{
+    LOCK(cs);
+    vector<uint256> vExpired;
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.begin(); mi != mapEntry.end(); ++mi)
+        if ((*mi).second.nTime < nCutoff)
+            vExpired.push_back((*mi).first);
+
+    unsigned int nSizeBefore = mapTx.size();
+    BOOST_FOREACH(const uint256& hash, vExpired)
+    {
+        // May have gone already with an expired ancestor
+        map<uint256, CTransaction>::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+            continue;
+        CTransaction tx = (*mi).second;
+        remove(tx, true);
+    }
+
+    int nRemoved = nSizeBefore - mapTx.size();
+    if (nRemoved > 0)
+    {
+        nExpired += nRemoved;
+        printf("CTxMemPool::Expire() : removed %d transactions\n", nRemoved);
+    }
+    return nRemoved;
+}
+
+int CTxMemPool::TrimToSize(uint64 nLimit)
+{
+    LOCK(cs);
+    unsigned int nSizeBefore = mapTx.size();
+    double dMaxFeeRemoved = 0;
+    while (nTotalUsage > nLimit && !setByDescendantFee.empty())
+    {
+        // The package paying the least per kB, with everything depending on it
+        pair<double, uint256> worst = *setByDescendantFee.begin();
+        dMaxFeeRemoved = max(dMaxFeeRemoved, worst.first);
+        CTransaction tx = mapTx[worst.second];
+        remove(tx, true);
+    }
+
+    int nRemoved = nSizeBefore - mapTx.size();
+    if (nRemoved > 0)
+    {
+        // Transactions paying no more than what was just evicted would only
+        // be evicted again; raise the floor one relay fee above it
+        GetMinFeePerKb();
+        dRollingMinFee = max(dRollingMinFee, dMaxFeeRemoved + MIN_RELAY_TX_FEE);
+        nLastRollingFeeUpdate = GetTime();
+        nEvicted += nRemoved;
+        printf("CTxMemPool::TrimToSize() : evicted %d transactions, min fee now %s/kB\n", nRemoved, FormatMoney((int64)dRollingMinFee).c_str());
+    }
+    return nRemoved;
+}
+
+int64 CTxMemPool::GetMinFeePerKb()
+{
+    LOCK(cs);
+    if (dRollingMinFee == 0)
+        return 0;
+
+    int64 nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate)
+    {
+        // Fall faster once the pool has room again
+        double dHalflife = MEMPOOL_ROLLING_FEE_HALFLIFE;
+        if (nTotalUsage < GetMaxSize() / 4)
+            dHalflife /= 4;
+        else if (nTotalUsage < GetMaxSize() / 2)
+            dHalflife /= 2;
+
+        dRollingMinFee /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalflife);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinFee < MIN_RELAY_TX_FEE / 2)
+            dRollingMinFee = 0;
+    }
+    return (int64)dRollingMinFee;
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -877,6 +1549,57 @@ int CTxIndex::GetDepthInMainChain() const
 }
 
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
+CTxLookupCache txLookupCache;
+
+bool CTxLookupCache::Get(const uint256& hash, CTransaction& tx, uint256& hashBlock)
+{
+    LOCK(cs);
+    map<uint256, pair<CTransaction, uint256> >::iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return false;
+    tx = (*mi).second.first;
+    hashBlock = (*mi).second.second;
+    return true;
+}
+
+void CTxLookupCache::Add(const uint256& hash, const CTransaction& tx, const uint256& hashBlock)
+{
+    LOCK(cs);
+    while (!vOrder.empty() && mapTx.size() >= TX_LOOKUP_CACHE_SIZE)
+    {
+        mapTx.erase(vOrder.front());
+        vOrder.pop_front();
+    }
+    if (mapTx.insert(make_pair(hash, make_pair(tx, hashBlock))).second)
+        vOrder.push_back(hash);
+}
+
+void CTxLookupCache::Erase(const uint256& hash)
+{
+    // Also from vOrder, or a later Add of the same hash would be evicted by the stale entry
+    LOCK(cs);
+    if (mapTx.erase(hash))
+        vOrder.erase(find(vOrder.begin(), vOrder.end(), hash));
+}
+
+// Read a transaction in the tx index, and the hash of its block, through the cache.
+// The tx index itself is always read, so its spent flags are current.
+bool ReadConfirmedTransaction(CTxDB& txdb, const uint256& hash, CTransaction& tx, uint256& hashBlock, CTxIndex& txindexRet)
+{
+    if (!txdb.ReadTxIndex(hash, txindexRet))
+        return false;
+    if (txLookupCache.Get(hash, tx, hashBlock))
+        return true;
+    if (!tx.ReadFromDisk(txindexRet.pos))
+        return false;
+    CBlock block;
+    if (!block.ReadFromDisk(txindexRet.pos.nFile, txindexRet.pos.nBlockPos, false))
+        return false;
+    hashBlock = block.GetHash();
+    txLookupCache.Add(hash, tx, hashBlock);
+    return true;
+}
+
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
     {
@@ -891,13 +1614,8 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
         }
         CTxDB txdb("r");
         CTxIndex txindex;
-        if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
-        {
-            CBlock block;
-            if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                hashBlock = block.GetHash();
+        if (ReadConfirmedTransaction(txdb, hash, tx, hashBlock, txindex))
             return true;
-        }
     }
     return false;
 }
@@ -1343,7 +2061,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 bool fScriptChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1382,6 +2101,8 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        // The signature hasher is built when the first input needs it, for the rest to share.
+        boost::scoped_ptr<CSignatureHasher> pHasher;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1398,14 +2119,16 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             // Skip ECDSA signature verification when connecting blocks (fBlock=true)
             // before the last blockchain checkpoint. This is safe because block merkle hashes are
             // still computed and checked, and any change will be caught at the next checkpoint.
-            if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            if (fScriptChecks && !(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                if (!pHasher)
+                    pHasher.reset(new CSignatureHasher(*this));
+                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0, pHasher.get()))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0, pHasher.get()))
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1509,6 +2232,26 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!vtx[i].DisconnectInputs(txdb))
             return false;
 
+    // Its transactions may come back in another block or the memory pool
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        txLookupCache.Erase(tx.GetHash());
+
+    if (fAddressIndex || fSpentIndex)
+    {
+        // DisconnectInputs erased the tx index of the block's own transactions,
+        // so parents in this block are taken from vtx rather than read back
+        MapPrevTx mapBlockTx;
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            mapBlockTx[tx.GetHash()].second = tx;
+
+        CAddressIndexUpdate addressUpdate(false, pindex->nHeight, fAddressIndex, fSpentIndex);
+        for (int i = vtx.size()-1; i >= 0; i--)
+            if (!addressUpdate.DisconnectTx(txdb, vtx[i], mapBlockTx))
+                return error("DisconnectBlock() : index update failed");
+        if (!addressUpdate.Write(txdb, pindex->pprev ? pindex->pprev->GetBlockHash() : 0))
+            return error("DisconnectBlock() : index write failed");
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1520,8 +2263,7 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     }
 
     // Scash: clean up wallet after disconnecting coinstake
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, false, false);
+    SyncBlockWithWallets(*this, false, false);
 
     return true;
 }
@@ -1557,6 +2299,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    CAddressIndexUpdate addressUpdate(true, pindex->nHeight, fAddressIndex, fSpentIndex);
     int64 nFees = 0;
     int64 nValueIn = 0;
     int64 nValueOut = 0;
@@ -1612,6 +2355,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 return false;
         }
 
+        if ((fAddressIndex || fSpentIndex) && !fJustCheck)
+            addressUpdate.ConnectTx(tx, mapInputs);
+
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
@@ -1636,6 +2382,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    if (fAddressIndex || fSpentIndex)
+    {
+        if (!addressUpdate.Write(txdb, pindex->GetBlockHash()))
+            return error("ConnectBlock() : index write failed");
+    }
+
 	uint256 prevHash = 0;
 	if(pindex->pprev)
 	{
@@ -1660,8 +2412,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     }
 
     // Watch for transactions paying to me
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, true);
+    SyncBlockWithWallets(*this, true, true);
 
     return true;
 }
@@ -2224,10 +2975,28 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Scash: peers that asked for it get the compact block right away instead of an inv
+        bool fIsInitialDownload = IsInitialBlockDownload();
+        CCompactBlock cmpctblock;
+        if (!fIsInitialDownload)
+            cmpctblock = CCompactBlock(*this);
+        CInv inv(MSG_BLOCK, hash);
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
             if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+            {
+                if (pnode->fPreferCompactBlocks && !fIsInitialDownload)
+                {
+                    {
+                        LOCK(pnode->cs_inventory);
+                        if (!pnode->setInventoryKnown.insert(inv).second)
+                            continue;
+                    }
+                    pnode->PushMessage("cmpctblock", cmpctblock);
+                }
+                else
+                    pnode->PushInventory(inv);
+            }
     }
 
     // Scash: check pending sync-checkpoint
@@ -2377,8 +3146,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless the download scheduler already has it queued
+        if (pfrom && !blockDownloader.IsQueued(WantedByOrphan(pblock2)))
         {
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
             // Scash: getblocks may not obtain the ancestor block rejected
@@ -2972,12 +3741,18 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
             LOCK(mempool.cs);
             txInMap = (mempool.exists(inv.hash));
             }
-        return txInMap ||
+        bool txQueued = false;
+            {
+            LOCK(cs_vTxQueue);
+            txQueued = setTxQueued.count(inv.hash);
+            }
+        return txInMap || txQueued ||
                mapOrphanTransactions.count(inv.hash) ||
                txdb.ContainsTx(inv.hash);
         }
 
     case MSG_BLOCK:
+    case MSG_CMPCT_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
                mapOrphanBlocks.count(inv.hash);
     }
@@ -2988,13 +3763,168 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 
 
-// The message start string is designed to be unlikely to occur in normal data.
-// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
-// a large 4-byte int at any alignment.
-unsigned char pchMessageStart[4] = { 0x70, 0x35, 0x22, 0x05 };
+// The message start string is designed to be unlikely to occur in normal data.
+// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
+// a large 4-byte int at any alignment.
+unsigned char pchMessageStart[4] = { 0x70, 0x35, 0x22, 0x05 };
+
+
+int nAskedForBlocks = 0;
+
+// Compact blocks waiting for "blocktxn" from the peer that sent them
+static map<uint256, CPartialBlock> mapPartialBlocks;
+
+// The checks of CheckBlock and ProcessBlock that need no more than the header
+// and the prefilled coinbase and coinstake, so a bogus compact block is turned
+// away before the memory pool is searched for its transactions
+bool static CheckCompactBlockHeader(CNode* pfrom, const CCompactBlock& cmpctblock)
+{
+    CBlock block = cmpctblock.header;
+    uint256 hash = block.GetHash();
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTx)
+    {
+        if (prefilled.nIndex != block.vtx.size() || block.vtx.size() >= 2)
+            break;
+        block.vtx.push_back(prefilled.tx);
+    }
+
+    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    {
+        pfrom->Misbehaving(100);
+        return error("CheckCompactBlockHeader() : first prefilled tx is not coinbase");
+    }
+    if (block.IsProofOfWork() && !CheckProofOfWork(hash, block.nBits))
+    {
+        pfrom->Misbehaving(50);
+        return error("CheckCompactBlockHeader() : proof of work failed");
+    }
+    if (block.GetBlockTime() > GetAdjustedTime() + nMaxClockDrift)
+        return error("CheckCompactBlockHeader() : block timestamp too far in the future");
+    if (block.IsProofOfStake() && !CheckCoinStakeTimestamp(block.GetBlockTime(), (int64)block.vtx[1].nTime))
+    {
+        pfrom->Misbehaving(50);
+        return error("CheckCompactBlockHeader() : coinstake timestamp violation");
+    }
+    if (!block.CheckBlockSignature())
+    {
+        pfrom->Misbehaving(100);
+        return error("CheckCompactBlockHeader() : bad block signature");
+    }
+
+    // Scash: same duplicate stake and kernel checks as ProcessBlock
+    if (block.IsProofOfStake())
+    {
+        if (setStakeSeen.count(block.GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+            return error("CheckCompactBlockHeader() : duplicate proof-of-stake for block %s", hash.ToString().c_str());
+        uint256 hashProofOfStake = 0;
+        if (!CheckProofOfStake(block.vtx[1], block.nBits, hashProofOfStake))
+            return error("CheckCompactBlockHeader() : check proof-of-stake failed for block %s", hash.ToString().c_str());
+    }
+
+    // Checkpoints, when the block connects to one we know
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi != mapBlockIndex.end())
+    {
+        CBlockIndex* pindexPrev = (*mi).second;
+        if (!Checkpoints::CheckHardened(pindexPrev->nHeight + 1, hash))
+        {
+            pfrom->Misbehaving(100);
+            return error("CheckCompactBlockHeader() : rejected by hardened checkpoint lock-in at %d", pindexPrev->nHeight + 1);
+        }
+        if (!Checkpoints::CheckSync(hash, pindexPrev) && !GetBoolArg("-nosynccheckpoints", false))
+            return error("CheckCompactBlockHeader() : rejected by synchronized checkpoint");
+    }
+    return true;
+}
+
+// Hand a block received from a peer, as "block" or rebuilt from "cmpctblock", to ProcessBlock
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    std::string blockHash = block.GetHash().ToString();
+
+    printf("Received block %s\n", blockHash.c_str());
+
+    if (fDebug && fDumpAll)
+    {
+        block.print();
+    }
+
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    blockDownloader.Received(inv.hash, pfrom, ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+    try
+    {
+        if (ProcessBlock(pfrom, &block))
+        {
+            mapAlreadyAskedFor.erase(inv);
+            mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, inv.hash));
+
+            if (BlockExplorer::fBlockExplorerEnabled)
+            {
+                try
+                {
+                    BlockExplorer::BlocksContainer::WriteBlockInfo(pindexBest->nHeight, block);
+                    BlockExplorer::BlocksContainer::UpdateIndex();
+                }
+                catch (std::exception& ex)
+                {
+                    printf("Exception %s while add block to block explorer\n", ex.what());
+                }
+            }
+        }
+
+        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    }
+    catch (std::exception& ex)
+    {
+        printf("Exception %s while ProcessBlock\n", ex.what());
+    }
+}
+
+// Blocks near the tip are relay traffic; older ones are history served to syncing peers
+bool static IsHistoryBlock(const CInv& inv)
+{
+    if (inv.type != MSG_BLOCK && inv.type != MSG_CMPCT_BLOCK)
+        return false;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+    return (mi != mapBlockIndex.end() && (*mi).second->nHeight < nBestHeight - HISTORY_BLOCK_DEPTH);
+}
+
+// History is held back while relay traffic is queued or its bandwidth share is used up
+bool static CanSendHistory(CNode* pto)
+{
+    return pto->vSend.size() < HISTORY_SEND_BUFFER && bucketHistory.Available(1) > 0;
+}
+
+void static SendBlock(CNode* pfrom, const CInv& inv)
+{
+    // Send block from disk
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+    if (mi == mapBlockIndex.end())
+        return;
 
+    CBlock block;
+    block.ReadFromDisk((*mi).second);
+    if (inv.type == MSG_CMPCT_BLOCK && (*mi).second->nHeight >= nBestHeight - MAX_CMPCTBLOCK_DEPTH)
+        pfrom->PushMessage("cmpctblock", CCompactBlock(block));
+    else
+        pfrom->PushMessage("block", block);
+    if (IsHistoryBlock(inv))
+        bucketHistory.Consume(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
 
-int nAskedForBlocks = 0;
+    // Trigger them to send a getblocks request for the next batch of inventory
+    if (inv.hash == pfrom->hashContinue)
+    {
+        // Scash: send latest proof-of-work block to allow the
+        // download node to accept as orphan (proof-of-stake 
+        // block might be rejected by stake connection check)
+        vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
+        pfrom->PushMessage("inv", vInv);
+        pfrom->hashContinue = 0;
+    }
+}
 
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
@@ -3070,8 +4000,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->PushMessage("verack");
         pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Scash: offer compact block relay, asking outbound peers to push new blocks unannounced
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION && GetBoolArg("-compactblocks", true))
+        {
+            pfrom->PushMessage("sendcmpct", !pfrom->fInbound, (uint64)1);
+            pfrom->fOfferedCompactBlocks = true;
+        }
+
         if (!pfrom->fInbound)
         {
+            addrman.Good(pfrom->addr);
+            if (pfrom->nHandshakeStart)
+                addrman.SetLatency(pfrom->addr, GetTimeMillis() - pfrom->nHandshakeStart);
+
+            // A feeler has done its job once the peer answered
+            if (pfrom->fFeeler)
+            {
+                printf("feeler %s done, disconnecting\n", pfrom->addr.ToString().c_str());
+                pfrom->fDisconnect = true;
+                return true;
+            }
+
             // Advertise our address
             if (!fNoListen && !IsInitialBlockDownload())
             {
@@ -3086,7 +4035,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 pfrom->PushMessage("getaddr");
                 pfrom->fGetAddr = true;
             }
-            addrman.Good(pfrom->addr);
         } else {
             if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom)
             {
@@ -3147,6 +4095,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce = false;
+        uint64 nCompactVersion = 0;
+        vRecv >> fAnnounce >> nCompactVersion;
+
+        if (nCompactVersion == 1 && GetBoolArg("-compactblocks", true))
+        {
+            pfrom->fSupportsCompactBlocks = true;
+            pfrom->fPreferCompactBlocks = fAnnounce;
+        }
+    }
+
+
     else if (strCommand == "addr")
     {
         vector<CAddress> vAddr;
@@ -3246,7 +4208,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave)
-                pfrom->AskFor(inv);
+            {
+                // Scash: fetch new blocks as compact blocks once synced
+                if (inv.type == MSG_BLOCK && pfrom->fSupportsCompactBlocks && !IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else if (inv.type == MSG_BLOCK)
+                    blockDownloader.Announce(inv.hash, pfrom);
+                else
+                    pfrom->AskFor(inv);
+            }
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
@@ -3286,28 +4256,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             {
             }
 
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Old blocks wait in order until SendMessages finds bandwidth for them
+                if (IsHistoryBlock(inv) && (!pfrom->vGetDataDeferred.empty() || !CanSendHistory(pfrom)))
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Scash: send latest proof-of-work block to allow the
-                        // download node to accept as orphan (proof-of-stake 
-                        // block might be rejected by stake connection check)
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
+                    if (pfrom->vGetDataDeferred.size() < MAX_INV_SZ)
+                        pfrom->vGetDataDeferred.push_back(inv);
                 }
+                else
+                    SendBlock(pfrom, inv);
             }
             else if (inv.IsKnownType())
             {
@@ -3447,70 +4405,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CDataStream vMsg(vRecv);
-        CTxDB txdb("r");
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        // Accepted together with the other transactions received in this
+        // round, see ProcessTransactionBatch
         {
-            SyncWithWallets(tx, NULL, true);
-            RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            LOCK(cs_vTxQueue);
+            if (setTxQueued.insert(inv.hash).second)
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (map<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
-                    bool fMissingInputs2 = false;
-
-                    if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
-                        vWorkQueue.push_back(inv.hash);
-                        vEraseQueue.push_back(inv.hash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(inv.hash);
-                        printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                    }
-                }
+                pfrom->AddRef();
+                vTxQueue.push_back(CQueuedTx(tx, vMsg, pfrom));
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(vMsg);
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
         }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
     }
 
 
@@ -3519,47 +4430,137 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CBlock block;
         vRecv >> block;
 
-        std::string blockHash = block.GetHash().ToString();
+        ProcessReceivedBlock(pfrom, block);
+    }
 
-        printf("Received block %s\n", blockHash.c_str());
 
-        if (fDebug && fDumpAll)
-        {
-            block.print();
-        }
+    else if (strCommand == "cmpctblock")
+    {
+        // Only from peers we offered compact block relay to
+        if (!pfrom->fOfferedCompactBlocks)
+            return true;
+
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
 
-        CInv inv(MSG_BLOCK, block.GetHash());
+        uint256 hash = cmpctblock.GetHash();
+        CInv inv(MSG_BLOCK, hash);
         pfrom->AddInventoryKnown(inv);
 
-        try
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            return true;
+
+        // Forget reconstructions whose "blocktxn" never came
+        int64 nNow = GetTime();
+        unsigned int nFromPeer = 0;
+        for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
         {
-            if (ProcessBlock(pfrom, &block))
+            if ((*mi).second.nTimeReceived + COMPACT_BLOCK_TIMEOUT < nNow)
+                mapPartialBlocks.erase(mi++);
+            else
             {
-                mapAlreadyAskedFor.erase(inv);
+                if ((*mi).second.nNodeId == pfrom->id)
+                    nFromPeer++;
+                ++mi;
+            }
+        }
 
-                if (BlockExplorer::fBlockExplorerEnabled)
-                {
-                    try
-                    {
-                        BlockExplorer::BlocksContainer::WriteBlockInfo(pindexBest->nHeight, block);
-                        BlockExplorer::BlocksContainer::UpdateIndex();
-                    }
-                    catch (std::exception& ex)
-                    {
-                        printf("Exception %s while add block to block explorer\n", ex.what());
-                    }
-                }
+        // Already being rebuilt from another peer, which may never answer:
+        // fetch the whole block from this one instead of waiting out the timeout
+        map<uint256, CPartialBlock>::const_iterator mi = mapPartialBlocks.find(hash);
+        if (mi != mapPartialBlocks.end())
+        {
+            if ((*mi).second.nNodeId != pfrom->id)
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
+
+        if (!CheckCompactBlockHeader(pfrom, cmpctblock))
+            return error("message cmpctblock : header of %s rejected", hash.ToString().c_str());
+
+        CPartialBlock partial;
+        if (!partial.Init(cmpctblock, mempool))
+        {
+            pfrom->Misbehaving(10);
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return error("message cmpctblock malformed, requesting full block %s", hash.ToString().c_str());
+        }
+
+        if (partial.IsComplete())
+        {
+            CBlock block;
+            if (partial.GetBlock(block))
+                ProcessReceivedBlock(pfrom, block);
+            else
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        }
+        else
+        {
+            CBlockTransactionsRequest req;
+            req.hashBlock = hash;
+            partial.GetMissing(req.vIndexes);
+            if (fDebugNet)
+                printf("cmpctblock %s missing %" PRIszu " of %u transactions\n", hash.ToString().c_str(), req.vIndexes.size(), cmpctblock.GetTxCount());
+
+            // Too many reconstructions pending: fetch the whole block instead
+            if (nFromPeer >= MAX_PARTIAL_BLOCKS_PER_PEER || mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+            {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
             }
+            partial.nNodeId = pfrom->id;
+            mapPartialBlocks[hash] = partial;
+            pfrom->PushMessage("getblocktxn", req);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("message getblocktxn : ReadFromDisk failed for %s", req.hashBlock.ToString().c_str());
 
-            if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        try
+        {
+            pfrom->PushMessage("blocktxn", CBlockTransactions(block, req));
         }
-        catch (std::exception& ex)
+        catch (std::out_of_range& e)
         {
-            printf("Exception %s while ProcessBlock\n", ex.what());
+            pfrom->Misbehaving(100);
+            return error("message getblocktxn : %s", e.what());
         }
     }
 
 
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        // Only the peer the transactions were asked from can complete the block
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.hashBlock);
+        if (mi == mapPartialBlocks.end() || (*mi).second.nNodeId != pfrom->id)
+            return true;
+
+        CBlock block;
+        bool fComplete = (*mi).second.Fill(resp.vtx) && (*mi).second.GetBlock(block);
+        mapPartialBlocks.erase(mi);
+
+        if (fComplete)
+            ProcessReceivedBlock(pfrom, block);
+        else
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.hashBlock)));
+    }
+
+
     else if (strCommand == "getaddr")
     {
         pfrom->vAddrToSend.clear();
@@ -3778,6 +4779,7 @@ bool ProcessMessages(CNode* pfrom)
         // Copy message to its own buffer
         CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
         vRecv.ignore(nMessageSize);
+        pfrom->RecordRecvMessage(strCommand, nHeaderSize + nMessageSize);
 
         // Process message
         bool fRet = false;
@@ -3822,6 +4824,109 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
+void ProcessTransactionBatch()
+{
+    vector<CQueuedTx> vQueue;
+    {
+        LOCK(cs_vTxQueue);
+        vQueue.swap(vTxQueue);
+    }
+    if (vQueue.empty())
+        return;
+
+    vector<CNode*> vRelease;
+    BOOST_FOREACH(const CQueuedTx& queued, vQueue)
+        vRelease.push_back(queued.pfrom);
+
+    // Each round retries the orphans whose parents the previous round accepted
+    while (!vQueue.empty() && !fShutdown)
+    {
+        vector<CTransaction> vtx;
+        BOOST_FOREACH(const CQueuedTx& queued, vQueue)
+            vtx.push_back(queued.tx);
+        vector<bool> vAccepted, vMissingInputs;
+        mempool.acceptBatch(vtx, vAccepted, vMissingInputs);
+
+        vector<CQueuedTx> vNext;
+        {
+            LOCK(cs_main);
+            vector<uint256> vEraseQueue;
+            for (unsigned int i = 0; i < vQueue.size(); i++)
+            {
+                const CQueuedTx& queued = vQueue[i];
+                CInv inv(MSG_TX, vtx[i].GetHash());
+                if (vAccepted[i])
+                {
+                    if (!queued.pfrom)
+                        printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
+                    SyncWithWallets(vtx[i], NULL, true);
+                    RelayMessage(inv, queued.vMsg);
+                    mapAlreadyAskedFor.erase(inv);
+                    vEraseQueue.push_back(inv.hash);
+                }
+                else if (vMissingInputs[i])
+                {
+                    if (queued.pfrom)
+                    {
+                        AddOrphanTx(queued.vMsg);
+
+                        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+                        unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+                        if (nEvicted > 0)
+                            printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+                    }
+                }
+                else if (!queued.pfrom)
+                {
+                    // invalid orphan
+                    vEraseQueue.push_back(inv.hash);
+                    printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
+                }
+                if (queued.pfrom && vtx[i].nDoS)
+                    queued.pfrom->Misbehaving(vtx[i].nDoS);
+            }
+
+            // Orphans that may now connect, each once per round
+            set<uint256> setRetry;
+            for (unsigned int i = 0; i < vQueue.size(); i++)
+            {
+                if (!vAccepted[i])
+                    continue;
+                map<uint256, map<uint256, CDataStream*> >::iterator mi = mapOrphanTransactionsByPrev.find(vtx[i].GetHash());
+                if (mi == mapOrphanTransactionsByPrev.end())
+                    continue;
+                for (map<uint256, CDataStream*>::iterator it = (*mi).second.begin(); it != (*mi).second.end(); ++it)
+                {
+                    if (!setRetry.insert((*it).first).second)
+                        continue;
+                    const CDataStream& vMsg = *((*it).second);
+                    CTransaction tx;
+                    CDataStream(vMsg) >> tx;
+                    vNext.push_back(CQueuedTx(tx, vMsg, NULL));
+                }
+            }
+
+            BOOST_FOREACH(uint256 hash, vEraseQueue)
+                EraseOrphanTx(hash);
+        }
+
+        {
+            LOCK(cs_vTxQueue);
+            BOOST_FOREACH(const CQueuedTx& queued, vQueue)
+                if (queued.pfrom)
+                    setTxQueued.erase(queued.tx.GetHash());
+        }
+        vQueue.swap(vNext);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vRelease)
+            pnode->Release();
+    }
+}
+
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     TRY_LOCK(cs_main, lockMain);
@@ -3978,6 +5083,18 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        // Blocks are spread over all peers by the download scheduler
+        blockDownloader.SendRequests(pto);
+
+        //
+        // Deferred history blocks
+        //
+        while (!pto->vGetDataDeferred.empty() && CanSendHistory(pto))
+        {
+            CInv inv = pto->vGetDataDeferred.front();
+            pto->vGetDataDeferred.pop_front();
+            SendBlock(pto, inv);
+        }
     }
     return true;
 }
@@ -4027,59 +5144,115 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+/** Block being filled with memory pool transactions by CreateNewBlock */
+class CBlockAssembler
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    CBlock* pblock;
+    CBlockIndex* pindexPrev;
+    CTxDB& txdb;
+    unsigned int nBlockMaxSize;
+    std::map<uint256, CTxIndex> mapTestPool;
+    std::set<uint256> setInBlock;
+    uint64 nBlockSize;
+    uint64 nBlockTx;
+    int nBlockSigOps;
+    int64 nFees;
+
+    CBlockAssembler(CBlock* pblockIn, CBlockIndex* pindexPrevIn, CTxDB& txdbIn, unsigned int nBlockMaxSizeIn) :
+        pblock(pblockIn), pindexPrev(pindexPrevIn), txdb(txdbIn), nBlockMaxSize(nBlockMaxSizeIn)
+    {
+        nBlockSize = 1000;
+        nBlockTx = 0;
+        nBlockSigOps = 100;
+        nFees = 0;
+    }
+
+    // Add the memory pool transaction if it fits and connects; requires mempool.cs
+    bool AddTx(const uint256& hash);
+};
+
+bool CBlockAssembler::AddTx(const uint256& hash)
+{
+    map<uint256, CTransaction>::iterator mi = mempool.mapTx.find(hash);
+    map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapEntry.find(hash);
+    if (mi == mempool.mapTx.end() || it == mempool.mapEntry.end())
+        return false;
+    CTransaction& tx = (*mi).second;
+    const CTxMemPoolEntry& entry = (*it).second;
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
+        return false;
+
+    // Size and sigop limits, from the numbers cached at accept time
+    if (nBlockSize + entry.nTxSize >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + entry.nSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-    COrphan(CTransaction* ptxIn)
+    // Timestamp limit
+    if (tx.nTime > GetAdjustedTime() || (pblock->IsProofOfStake() && tx.nTime > pblock->vtx[1].nTime))
+        return false;
+
+    // Scash: simplify transaction fee - allow free = false
+    int64 nMinFee = tx.GetMinFee(nBlockSize, false, GMF_BLOCK);
+
+    // Parents not in the block yet make FetchInputs fail
+    MapPrevTx mapInputs;
+    bool fInvalid;
+    if (!tx.FetchInputs(txdb, mapTestPool, false, true, mapInputs, fInvalid))
+        return false;
+
+    int64 nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+    if (nTxFees < nMinFee)
+        return false;
+
+    unsigned int nTxSigOps = tx.GetLegacySigOpCount() + tx.GetP2SHSigOpCount(mapInputs);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // ConnectInputs may have written some inputs back before failing; undo
+    // just those instead of working on a copy of the whole test pool
+    vector<pair<uint256, CTxIndex> > vUndo;
+    vector<uint256> vNew;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTestPool.find(txin.prevout.hash);
+        if (mi != mapTestPool.end())
+            vUndo.push_back(*mi);
+        else
+            vNew.push_back(txin.prevout.hash);
+    }
+    if (!tx.ConnectInputs(txdb, mapInputs, mapTestPool, CDiskTxPos(1,1,1), pindexPrev, false, true))
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        BOOST_FOREACH(const uint256& hashPrev, vNew)
+            mapTestPool.erase(hashPrev);
+        for (unsigned int i = 0; i < vUndo.size(); i++)
+            mapTestPool[vUndo[i].first] = vUndo[i].second;
+        return false;
     }
+    mapTestPool[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
 
-    void print() const
+    // Added
+    pblock->vtx.push_back(tx);
+    setInBlock.insert(hash);
+    nBlockSize += entry.nTxSize;
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+
+    if (fDebug && (GetBoolArg("-printpriority") || fDumpAll))
     {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
+        printf("priority %.1f feeperkb %.1f txid %s\n",
+               entry.GetPriority(pindexPrev->nHeight), entry.GetFeePerKb(), hash.ToString().c_str());
     }
-};
+    return true;
+}
 
 
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 int64 nLastCoinStakeSearchInterval = 0;
  
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
-    }
-};
-
 // CreateNewBlock:
 //   fProofOfStake: try (best effort) to make a proof-of-stake block
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
@@ -4159,186 +5332,70 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = pindexBest;
         CTxDB txdb("r");
+        CBlockAssembler assembler(pblock.get(), pindexPrev, txdb, nBlockMaxSize);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        // High-priority transactions first, included regardless of the fees they pay
+        if (nBlockPrioritySize > 0)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vector<pair<double, uint256> > vecPriority;
+            vecPriority.reserve(mempool.mapEntry.size());
+            for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-//                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
+                double dPriority = (*mi).second.GetPriority(pindexPrev->nHeight);
+                if (dPriority >= COIN * 144 / 250)
+                    vecPriority.push_back(make_pair(dPriority, (*mi).first));
             }
-            if (fMissingInputs) continue;
+            sort(vecPriority.begin(), vecPriority.end(), greater<pair<double, uint256> >());
 
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
+            for (unsigned int i = 0; i < vecPriority.size(); i++)
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                const CTxMemPoolEntry& entry = mempool.mapEntry[vecPriority[i].second];
+                if (assembler.nBlockSize + entry.nTxSize >= nBlockPrioritySize)
+                    break;
+                assembler.AddTx(vecPriority[i].second);
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
         }
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        // Then by fee per kB of each transaction together with the ancestors it needs
+        for (set<pair<double, uint256> >::reverse_iterator it = mempool.setByAncestorFee.rbegin(); it != mempool.setByAncestorFee.rend(); ++it)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (pblock->IsProofOfStake() && tx.nTime > pblock->vtx[1].nTime))
+            const uint256& hash = (*it).second;
+            if (assembler.setInBlock.count(hash))
                 continue;
-
-            // Scash: simplify transaction fee - allow free = false
-            int64 nMinFee = tx.GetMinFee(nBlockSize, false, GMF_BLOCK);
+            const CTxMemPoolEntry& entry = mempool.mapEntry[hash];
 
             // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            if ((*it).first < nMinTxFee && (assembler.nBlockSize + entry.nSizeWithAncestors >= nBlockMinSize))
                 continue;
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+            // Ancestors not in the block yet, parents before children
+            set<uint256> setAncestors;
+            mempool.CalculateAncestors(hash, setAncestors);
+            vector<pair<unsigned int, uint256> > vPackage;
+            unsigned int nPackageSize = 0;
+            setAncestors.insert(hash);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.find(hashAncestor);
+                if (assembler.setInBlock.count(hashAncestor) || mi == mempool.mapEntry.end())
+                    continue;
+                const CTxMemPoolEntry& ancestor = (*mi).second;
+                vPackage.push_back(make_pair(ancestor.nCountWithAncestors, hashAncestor));
+                nPackageSize += ancestor.nTxSize;
             }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64 nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            if (assembler.nBlockSize + nPackageSize >= nBlockMaxSize)
                 continue;
+            sort(vPackage.begin(), vPackage.end());
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && (GetBoolArg("-printpriority") || fDumpAll))
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+            for (unsigned int i = 0; i < vPackage.size(); i++)
+                if (!assembler.AddTx(vPackage[i].second))
+                    break;
         }
 
+        uint64 nBlockTx = assembler.nBlockTx;
+        uint64 nBlockSize = assembler.nBlockSize;
+        nFees = assembler.nFees;
+
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
 
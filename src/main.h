@@ -31,9 +31,21 @@ static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE / 2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE / 50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE / 100;
 static const unsigned int MAX_INV_SZ = 50000;
+// Blocks deeper than this are served at the lower priority of -maxhistoryrate
+static const int HISTORY_BLOCK_DEPTH = 144;
 
 static const int64 MIN_TX_FEE = CENT / 10;
 static const int64 MIN_RELAY_TX_FEE = MIN_TX_FEE;
+// Default memory pool budget in megabytes (-maxmempool)
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 100;
+// Default hours a transaction may stay in the memory pool (-mempoolexpiry)
+static const int64 DEFAULT_MEMPOOL_EXPIRY = 72;
+// Seconds for the fee floor raised by evictions to drop by half
+static const int64 MEMPOOL_ROLLING_FEE_HALFLIFE = 12 * 60 * 60;
+// Transactions revalidated per acceptBatch call when reloading mempool.dat
+static const unsigned int MEMPOOL_LOAD_BATCH = 500;
+// Confirmed transactions kept by the transaction lookup cache
+static const unsigned int TX_LOOKUP_CACHE_SIZE = 20000;
 static const int64 MIN_NONDUST_PAYMENT = MIN_TX_FEE + 1;
 static const int64 MAX_MONEY = 476918 * COIN; // Max PoW supply
 static const int64 CIRCULATION_MONEY = MAX_MONEY;
@@ -132,6 +144,9 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void ProcessTransactionBatch();
+void ThreadLoadMempool(void* parg);
+void DumpMempool();
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false);
@@ -147,6 +162,7 @@ int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+bool ReadConfirmedTransaction(CTxDB& txdb, const uint256& hash, CTransaction& tx, uint256& hashBlock, CTxIndex& txindexRet);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void BitcoinMiner(CWallet *pwallet, bool fProofOfStake);
@@ -756,11 +772,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[in] fScriptChecks	false if the caller verifies the input scripts itself
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       bool fScriptChecks=true);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -881,6 +899,26 @@ public:
 };
 
 
+/** Recently read confirmed transactions and the hash of their block, so
+ * repeated lookups skip the block file. The oldest entries are dropped
+ * first, and the transactions of a disconnected block right away.
+ */
+class CTxLookupCache
+{
+private:
+    CCriticalSection cs;
+    std::map<uint256, std::pair<CTransaction, uint256> > mapTx;
+    std::deque<uint256> vOrder;
+
+public:
+    bool Get(const uint256& hash, CTransaction& tx, uint256& hashBlock);
+    void Add(const uint256& hash, const CTransaction& tx, const uint256& hashBlock);
+    void Erase(const uint256& hash);
+};
+
+extern CTxLookupCache txLookupCache;
+
+
 unsigned int getTicksCountToMeasure();
 
 
@@ -1554,6 +1592,12 @@ public:
         vHave = vHaveIn;
     }
 
+    // Scash: start the locator at a block we have been announced but not received yet
+    void Prepend(const uint256& hash)
+    {
+        vHave.insert(vHave.begin(), hash);
+    }
+
     IMPLEMENT_SERIALIZE
     (
         if (!(nType & SER_GETHASH))
@@ -1657,20 +1701,183 @@ public:
 
 
 
+/** What block assembly needs to know about a memory pool transaction,
+ * computed once when it enters the pool, and the totals of the package
+ * formed by the transaction and its in-pool ancestors.
+ */
+class CTxMemPoolEntry
+{
+public:
+    int64 nFee;
+    unsigned int nTxSize;
+    unsigned int nSigOps;
+
+    // Inputs confirmed in the chain: sum(value) and sum(value * height)
+    int64 nValueInChain;
+    double dValueHeightInChain;
+
+    std::set<uint256> setParents;
+    std::set<uint256> setChildren;
+
+    unsigned int nCountWithAncestors;
+    unsigned int nSizeWithAncestors;
+    int64 nFeesWithAncestors;
+
+    // Same for the transaction and its in-pool descendants, used for eviction
+    unsigned int nCountWithDescendants;
+    unsigned int nSizeWithDescendants;
+    int64 nFeesWithDescendants;
+
+    int64 nTime;
+    // Estimated bytes of memory the pool spends on this transaction
+    unsigned int nUsage;
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nSigOps = 0;
+        nValueInChain = 0;
+        dValueHeightInChain = 0;
+        nCountWithAncestors = 0;
+        nSizeWithAncestors = 0;
+        nFeesWithAncestors = 0;
+        nCountWithDescendants = 0;
+        nSizeWithDescendants = 0;
+        nFeesWithDescendants = 0;
+        nTime = 0;
+        nUsage = 0;
+    }
+
+    explicit CTxMemPoolEntry(const CTransaction& tx);
+
+    // Fill fee, sigops and priority inputs from the fetched inputs
+    void SetInputs(const CTransaction& tx, MapPrevTx& mapInputs);
+
+    // sum(valuein * age) / txsize for a block on top of nHeight
+    double GetPriority(int nHeight) const
+    {
+        return ((double)(nHeight + 1) * nValueInChain - dValueHeightInChain) / nTxSize;
+    }
+
+    double GetFeePerKb() const
+    {
+        return nFee * 1000.0 / nTxSize;
+    }
+
+    double GetAncestorFeePerKb() const
+    {
+        return nFeesWithAncestors * 1000.0 / nSizeWithAncestors;
+    }
+
+    double GetDescendantFeePerKb() const
+    {
+        return nFeesWithDescendants * 1000.0 / nSizeWithDescendants;
+    }
+};
+
+/** What CTxMemPool::prepare found out about a transaction, for CTxMemPool::commit */
+class CTxMemPoolPrepared
+{
+public:
+    CTxMemPoolEntry entry;
+    MapPrevTx mapInputs;
+    bool fCheckInputs;
+    // Chain tip the inputs were fetched against
+    uint256 hashBestChainInputs;
+    // Transaction being replaced, if any
+    uint256 hashOld;
+
+    CTxMemPoolPrepared()
+    {
+        fCheckInputs = false;
+        hashBestChainInputs = 0;
+        hashOld = 0;
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+
+    // (package fee per kB, hash) of every transaction, for block assembly
+    std::set<std::pair<double, uint256> > setByAncestorFee;
+    // (fee per kB with descendants, hash), lowest is evicted first
+    std::set<std::pair<double, uint256> > setByDescendantFee;
+
+    uint64 nTotalTxSize;
+    uint64 nTotalUsage;
+    uint64 nEvicted;
+    uint64 nExpired;
+
+private:
+    // Fee per kB floor raised by evictions, decaying back to zero
+    double dRollingMinFee;
+    int64 nLastRollingFeeUpdate;
+
+public:
+    CTxMemPool()
+    {
+        nTotalTxSize = 0;
+        nTotalUsage = 0;
+        nEvicted = 0;
+        nExpired = 0;
+        dRollingMinFee = 0;
+        nLastRollingFeeUpdate = 0;
+    }
 
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
+
+    // accept() in two steps, so the input scripts can be checked in between
+    // without holding cs_main. commit() revalidates the inputs if the chain
+    // moved since prepare().
+    bool prepare(CTxDB& txdb, CTransaction &tx, bool fCheckInputs, bool fScriptChecks,
+                 bool* pfMissingInputs, CTxMemPoolPrepared& prepared);
+    bool commit(CTxDB& txdb, CTransaction &tx, CTxMemPoolPrepared& prepared);
+
+    // Accept several transactions at once: inputs are fetched in one pass under
+    // cs_main, scripts are checked on -par threads without it, then everything
+    // is committed under cs_main. Call without holding cs_main.
+    void acceptBatch(std::vector<CTransaction>& vtx, std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs);
     bool addUnchecked(const uint256& hash, CTransaction &tx);
-    bool remove(CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry);
+    // fRecursive also removes the transactions spending it
+    bool remove(CTransaction &tx, bool fRecursive = false);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
 
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
+    // Remove transactions that entered the pool before nCutoff, and their descendants
+    int Expire(int64 nCutoff);
+    // Evict the lowest fee packages until usage is within nLimit bytes
+    int TrimToSize(uint64 nLimit);
+
+    // Fee per kB below which transactions are not accepted because the pool has been full
+    int64 GetMinFeePerKb();
+    int64 GetMinFee(unsigned int nBytes)
+    {
+        return GetMinFeePerKb() * (1 + nBytes / 1000);
+    }
+
+    static uint64 GetMaxSize()
+    {
+        return (uint64)GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    }
+
+private:
+    // Recompute the package totals of hash and re-index it
+    void UpdateAncestorState(const uint256& hash);
+    void UpdateDescendantState(const uint256& hash);
+
+public:
+
     unsigned long size()
     {
         LOCK(cs);
@@ -12,6 +12,7 @@
 #include "ui_interface.h"
 #include "chartdata.h"
 #include "blockexplorerserver.h"
+#include "blockdownload.h"
 
 #ifdef WIN32
 #include <string.h>
@@ -30,17 +31,21 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 12;
+
+// Seconds between feeler connections
+static const int FEELER_INTERVAL = 2 * 60;
 static const int MAX_TOTAL_CONNECTIONS = 125;
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
 void ThreadOpenConnections2(void* parg);
+void ThreadProbeAddresses2(void* parg);
 void ThreadOpenAddedConnections2(void* parg);
 #ifdef USE_UPNP
 void ThreadMapPort2(void* parg);
 #endif
 void ThreadDNSAddressSeed2(void* parg);
-bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false, bool fFeeler = false);
 
 
 struct LocalServiceInfo {
@@ -72,6 +77,11 @@ map<CInv, CDataStream> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
+int nLastNodeId = 0;
+CCriticalSection cs_nLastNodeId;
+CTokenBucket bucketSend;
+CTokenBucket bucketRecv;
+CTokenBucket bucketHistory;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -588,14 +598,24 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
         pszDest ? pszDest : addrConnect.ToString().c_str(),
         pszDest ? 0 : (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0);
 
-    // Connect
+    // Connect; direct connections are finished by the socket thread so an
+    // unreachable address does not hold up the others
     SOCKET hSocket;
-    if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort()) : ConnectSocket(addrConnect, hSocket))
+    bool fInProgress = false;
+    proxyType proxy;
+    bool fConnected;
+    if (pszDest)
+        fConnected = ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort());
+    else if (!GetProxy(addrConnect.GetNetwork(), proxy))
+        fConnected = StartConnectSocket(addrConnect, hSocket, fInProgress);
+    else
+        fConnected = ConnectSocket(addrConnect, hSocket);
+    if (fConnected)
     {
         addrman.Attempt(addrConnect);
 
         /// debug print
-        printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
+        printf("%s %s\n", fInProgress ? "connecting" : "connected", pszDest ? pszDest : addrConnect.ToString().c_str());
 
         // Set to non-blocking
 #ifdef WIN32
@@ -609,6 +629,10 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
 
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+        pnode->fConnecting = fInProgress;
+        pnode->nConnectStart = GetTimeMillis();
+        if (!fInProgress)
+            pnode->nHandshakeStart = pnode->nConnectStart;
         if (nTimeout != 0)
             pnode->AddRef(nTimeout);
         else
@@ -646,6 +670,13 @@ void CNode::CloseSocketDisconnect(int errCode)
 
 void CNode::Cleanup()
 {
+    // Remember how fast this peer served blocks
+    CPeerDownloadState state;
+    if (!fInbound && blockDownloader.GetPeerState(id, state) && state.nBlocksReceived > 0)
+        addrman.SetThroughput(addr, state.dBytesPerSecond);
+
+    // Blocks requested from this peer go to the others
+    blockDownloader.RemovePeer(id);
 }
 
 
@@ -723,6 +754,7 @@ bool CNode::Misbehaving(int howmuch)
 #define X(name) stats.name = name
 void CNode::copyStats(CNodeStats &stats)
 {
+    X(id);
     X(nServices);
     X(nLastSend);
     X(nLastRecv);
@@ -734,6 +766,13 @@ void CNode::copyStats(CNodeStats &stats)
     X(nReleaseTime);
     X(nStartingHeight);
     X(nMisbehavior);
+    X(fSupportsCompactBlocks);
+
+    LOCK(cs_stats);
+    X(nSendBytes);
+    X(nRecvBytes);
+    X(mapSendPerCmd);
+    X(mapRecvPerCmd);
 }
 #undef X
 
@@ -781,6 +820,20 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exited\n");
 }
 
+void static FinishConnectNode(CNode* pnode)
+{
+    if (!FinishConnectSocket(pnode->hSocket))
+    {
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+
+    printf("connected %s (%" PRI64d "ms)\n", pnode->addr.ToString().c_str(), GetTimeMillis() - pnode->nConnectStart);
+    pnode->fConnecting = false;
+    pnode->nTimeConnected = GetTime();
+    pnode->nHandshakeStart = GetTimeMillis();
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
@@ -886,13 +939,24 @@ void ThreadSocketHandler2(void* parg)
             {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
+                if (pnode->fConnecting)
+                {
+                    // writable once connect() completes, or failed
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+                    continue;
+                }
+                // Over its download limit: leave the data in the kernel, TCP slows the sender down
+                if (bucketRecv.Available(1) > 0 && pnode->recvBucket.Available(1) > 0)
+                    FD_SET(pnode->hSocket, &fdsetRecv);
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 have_fds = true;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (lockSend && !pnode->vSend.empty() && bucketSend.Available(1) > 0 && pnode->sendBucket.Available(1) > 0)
                         FD_SET(pnode->hSocket, &fdsetSend);
                 }
             }
@@ -995,10 +1059,25 @@ void ThreadSocketHandler2(void* parg)
                 return;
 
             //
-            // Receive
+            // Finish outbound connect
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
+            if (pnode->fConnecting)
+            {
+                if (FD_ISSET(pnode->hSocket, &fdsetSend) || FD_ISSET(pnode->hSocket, &fdsetError))
+                    FinishConnectNode(pnode);
+                else if (GetTimeMillis() - pnode->nConnectStart > nConnectTimeout)
+                {
+                    printf("connection timeout %s\n", pnode->addr.ToString().c_str());
+                    pnode->CloseSocketDisconnect();
+                }
+                continue;
+            }
+
+            //
+            // Receive
+            //
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
@@ -1007,20 +1086,26 @@ void ThreadSocketHandler2(void* parg)
                     CDataStream& vRecv = pnode->vRecv;
                     unsigned int nPos = vRecv.size();
 
+                    // typical socket buffer is 8K-64K
+                    char pchBuf[0x10000];
+                    unsigned int nAllowed = pnode->recvBucket.Available(bucketRecv.Available(sizeof(pchBuf)));
+
                     if (nPos > ReceiveBufferSize()) {
                         if (!pnode->fDisconnect)
                             printf("socket recv flood control disconnect (%" PRIszu " bytes)\n", vRecv.size());
                         pnode->CloseSocketDisconnect();
                     }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                    else if (nAllowed > 0) {
+                        int nBytes = recv(pnode->hSocket, pchBuf, nAllowed, MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
                             vRecv.resize(nPos + nBytes);
                             memcpy(&vRecv[nPos], pchBuf, nBytes);
                             pnode->nLastRecv = GetTime();
+                            bucketRecv.Consume(nBytes);
+                            pnode->recvBucket.Consume(nBytes);
+                            LOCK(pnode->cs_stats);
+                            pnode->nRecvBytes += nBytes;
                         }
                         else if (nBytes == 0)
                         {
@@ -1061,13 +1146,18 @@ void ThreadSocketHandler2(void* parg)
                 if (lockSend)
                 {
                     CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    unsigned int nAllowed = pnode->sendBucket.Available(bucketSend.Available(vSend.size()));
+                    if (nAllowed > 0)
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                        int nBytes = send(pnode->hSocket, &vSend[0], nAllowed, MSG_NOSIGNAL | MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
                             vSend.erase(vSend.begin(), vSend.begin() + nBytes);
                             pnode->nLastSend = GetTime();
+                            bucketSend.Consume(nBytes);
+                            pnode->sendBucket.Consume(nBytes);
+                            LOCK(pnode->cs_stats);
+                            pnode->nSendBytes += nBytes;
                         }
                         else if (nBytes < 0)
                         {
@@ -1440,6 +1530,41 @@ void static ThreadStakeMinter(void* parg)
     printf("ThreadStakeMinter exiting, %d threads remaining\n", vnThreadsRunning[THREAD_CLOAKER]);
 }
 
+CAddress static SelectAddressToConnect(const set<vector<unsigned char> >& setConnected, int nOutbound, int64 nANow)
+{
+    int nTries = 0;
+    LOOP
+    {
+        // use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
+        CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
+
+        // if we selected an invalid address, restart
+        if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
+            break;
+
+        // If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
+        // stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
+        // already-connected network ranges, ...) before trying new addrman addresses.
+        nTries++;
+        if (nTries > 100)
+            break;
+
+        if (IsLimited(addr))
+            continue;
+
+        // only consider very recently tried nodes after 30 failed attempts
+        if (nANow - addr.nLastTry < 600 && nTries < 30)
+            continue;
+
+        // do not allow non-default ports, unless after 50 invalid addresses selected already
+        if (addr.GetPort() != GetDefaultPort() && nTries < 50)
+            continue;
+
+        return addr;
+    }
+    return CAddress();
+}
+
 void ThreadOpenConnections2(void* parg)
 {
     printf("ThreadOpenConnections started\n");
@@ -1514,9 +1639,8 @@ void ThreadOpenConnections2(void* parg)
         }
 
         //
-        // Choose an address to connect to based on most recently seen
+        // Choose addresses to connect to based on most recently seen
         //
-        CAddress addrConnect;
 
         // Only connect out to one peer per network group (/16 for IPv4).
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
@@ -1525,7 +1649,7 @@ void ThreadOpenConnections2(void* parg)
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes) {
-                if (!pnode->fInbound) {
+                if (!pnode->fInbound && !pnode->fFeeler) {
                     setConnected.insert(pnode->addr.GetGroup());
                     nOutbound++;
                 }
@@ -1536,44 +1660,23 @@ void ThreadOpenConnections2(void* parg)
 
         std::vector<std::string> usedAddresses;
 
-        static unsigned int maxConnectionsBurst = GetArg("-burstconnect", 3);
+        static unsigned int maxConnectionsBurst = GetArg("-burstconnect", MAX_OUTBOUND_CONNECTIONS);
         if (maxConnectionsBurst > MAX_OUTBOUND_CONNECTIONS)
             maxConnectionsBurst = MAX_OUTBOUND_CONNECTIONS;
 
+        // Connects complete in the socket thread, so one is started for every free outbound slot
         for (size_t connectionNumber = 0; connectionNumber < maxConnectionsBurst; connectionNumber++)
         {
-            int nTries = 0;
-            LOOP
+            if (!grant)
             {
-                // use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
-                CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
-
-                // if we selected an invalid address, restart
-                if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
+                CSemaphoreGrant grantNext(*semOutbound, true);
+                if (!grantNext)
                     break;
-
-                // If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
-                // stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
-                // already-connected network ranges, ...) before trying new addrman addresses.
-                nTries++;
-                if (nTries > 100)
-                    break;
-
-                if (IsLimited(addr))
-                    continue;
-
-                // only consider very recently tried nodes after 30 failed attempts
-                if (nANow - addr.nLastTry < 600 && nTries < 30)
-                    continue;
-
-                // do not allow non-default ports, unless after 50 invalid addresses selected already
-                if (addr.GetPort() != GetDefaultPort() && nTries < 50)
-                    continue;
-
-                addrConnect = addr;
-                break;
+                grantNext.MoveTo(grant);
             }
 
+            CAddress addrConnect = SelectAddressToConnect(setConnected, nOutbound, nANow);
+
             if (std::find(usedAddresses.begin(), usedAddresses.end(), addrConnect.ToString())
                     != usedAddresses.end())
             {
@@ -1582,13 +1685,71 @@ void ThreadOpenConnections2(void* parg)
 
             if (addrConnect.IsValid())
             {
-                OpenNetworkConnection(addrConnect, &grant);
+                if (OpenNetworkConnection(addrConnect, &grant))
+                {
+                    setConnected.insert(addrConnect.GetGroup());
+                    nOutbound++;
+                }
                 usedAddresses.push_back(addrConnect.ToString());
             }
         }
     }
 }
 
+void ThreadProbeAddresses2(void* parg)
+{
+    printf("ThreadProbeAddresses started\n");
+
+    LOOP
+    {
+        vnThreadsRunning[THREAD_PROBEADDRESS]--;
+        Sleep(FEELER_INTERVAL * 1000);
+        vnThreadsRunning[THREAD_PROBEADDRESS]++;
+        if (fShutdown)
+            return;
+
+        if (addrman.size() == 0)
+            continue;
+
+        // Probe a group we are not connected to; half new, half tried addresses
+        set<vector<unsigned char> > setConnected;
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (!pnode->fInbound)
+                    setConnected.insert(pnode->addr.GetGroup());
+        }
+        CAddress addr = SelectAddressToConnect(setConnected, 4, GetAdjustedTime());
+        if (addr.IsValid())
+        {
+            if (fDebugNet)
+                printf("feeler connection to %s\n", addr.ToString().c_str());
+            OpenNetworkConnection(addr, NULL, NULL, false, true);
+        }
+    }
+}
+
+void ThreadProbeAddresses(void* parg)
+{
+    // Make this thread recognisable as the address probing thread
+    RenameThread("scash-feeler");
+
+    try
+    {
+        vnThreadsRunning[THREAD_PROBEADDRESS]++;
+        ThreadProbeAddresses2(parg);
+        vnThreadsRunning[THREAD_PROBEADDRESS]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_PROBEADDRESS]--;
+        PrintException(&e, "ThreadProbeAddresses()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_PROBEADDRESS]--;
+        PrintException(NULL, "ThreadProbeAddresses()");
+    }
+    printf("ThreadProbeAddresses exited\n");
+}
+
 void ThreadOpenAddedConnections(void* parg)
 {
     // Make this thread recognisable as the connection opening thread
@@ -1682,7 +1843,7 @@ void ThreadOpenAddedConnections2(void* parg)
 }
 
 // if successful, this moves the passed grant to the constructed node
-bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, const char *strDest, bool fOneShot)
+bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, const char *strDest, bool fOneShot, bool fFeeler)
 {
     //
     // Initiate outbound network connection
@@ -1709,6 +1870,8 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
     pnode->fNetworkNode = true;
     if (fOneShot)
         pnode->fOneShot = true;
+    if (fFeeler)
+        pnode->fFeeler = true;
 
     return true;
 }
@@ -1780,6 +1943,11 @@ void ThreadMessageHandler2(void* parg)
                 return;
         }
 
+        // Transactions received above are accepted as one batch
+        ProcessTransactionBatch();
+        if (fShutdown)
+            return;
+
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
@@ -1985,6 +2153,11 @@ void StartNode(void* parg)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+    // Global bandwidth limits, in KB/s
+    bucketSend.SetRate(1000*GetArg("-maxuploadrate", 0));
+    bucketRecv.SetRate(1000*GetArg("-maxdownloadrate", 0));
+    bucketHistory.SetRate(1000*GetArg("-maxhistoryrate", 0));
+
     Discover();
 
     //
@@ -2013,6 +2186,11 @@ void StartNode(void* parg)
     if (!NewThread(ThreadOpenConnections, NULL))
         printf("Error: NewThread(ThreadOpenConnections) failed\n");
 
+    // Measure addresses with short lived feeler connections
+    if (!mapArgs.count("-connect") && GetBoolArg("-feelers", true))
+        if (!NewThread(ThreadProbeAddresses, NULL))
+            printf("Error: NewThread(ThreadProbeAddresses) failed\n");
+
     // Process messages
     if (!NewThread(ThreadMessageHandler, NULL))
         printf("Error: NewThread(ThreadMessageHandler) failed\n");
@@ -2021,6 +2199,11 @@ void StartNode(void* parg)
     if (!NewThread(ThreadDumpAddress, NULL))
         printf("Error; NewThread(ThreadDumpAddress) failed\n");
 
+    // Reload the memory pool saved at the last shutdown while serving peers
+    if (GetBoolArg("-persistmempool", true))
+        if (!NewThread(ThreadLoadMempool, NULL))
+            printf("Error: NewThread(ThreadLoadMempool) failed\n");
+
     // Block explorer/balance checker server
     if ((BlockExplorerServer::fBlockExplorerServerEnabled ||
          BlockExplorerServer::fBalanceCheckerServerEnabled)
@@ -2079,8 +2262,12 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
+    if (vnThreadsRunning[THREAD_PROBEADDRESS] > 0) printf("ThreadProbeAddresses still running\n");
+    if (vnThreadsRunning[THREAD_LOADMEMPOOL] > 0) printf("ThreadLoadMempool still running\n");
+    if (vnThreadsRunning[THREAD_WALLETCHECK] > 0) printf("ThreadVerifyWallet still running\n");
     if (vnThreadsRunning[THREAD_CLOAKER] > 0) printf("ThreadStakeMinter still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 ||
+           vnThreadsRunning[THREAD_LOADMEMPOOL] > 0 || vnThreadsRunning[THREAD_WALLETCHECK] > 0)
         Sleep(20);
     Sleep(50);
     DumpAddresses();
@@ -28,12 +28,17 @@ class CRequestTracker;
 class CNode;
 class CBlockIndex;
 extern int nBestHeight;
+extern int nLastNodeId;
+extern CCriticalSection cs_nLastNodeId;
 
 
 
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+// Old blocks are only served while the peer's send buffer holds less than this
+static const unsigned int HISTORY_SEND_BUFFER = 256 * 1000;
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -77,6 +82,7 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    MSG_CMPCT_BLOCK,
 };
 
 class CRequestTracker
@@ -114,6 +120,9 @@ enum threadId
     THREAD_CLOAKER,
     THREAD_BESLISTENER,
     THREAD_BESHANDLER,
+    THREAD_PROBEADDRESS,
+    THREAD_LOADMEMPOOL,
+    THREAD_WALLETCHECK,
 
     THREAD_MAX
 };
@@ -135,6 +144,72 @@ extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64> mapAlreadyAskedFor;
 
 
+/** Token bucket rate limiter; a rate of 0 means unlimited */
+class CTokenBucket
+{
+public:
+    int64 nRate;    // bytes per second
+    int64 nBurst;   // bytes
+    double dTokens;
+    int64 nLastRefill;
+
+    explicit CTokenBucket(int64 nRateIn = 0)
+    {
+        SetRate(nRateIn);
+    }
+
+    void SetRate(int64 nRateIn)
+    {
+        nRate = std::max(nRateIn, (int64)0);
+        nBurst = std::max(nRate, (int64)0x10000);
+        dTokens = nBurst;
+        nLastRefill = GetTimeMillis();
+    }
+
+    bool IsLimited() const
+    {
+        return nRate > 0;
+    }
+
+    // How many of nWanted bytes may go now
+    unsigned int Available(unsigned int nWanted)
+    {
+        if (!IsLimited())
+            return nWanted;
+        int64 nNow = GetTimeMillis();
+        dTokens = std::min((double)nBurst, dTokens + (nNow - nLastRefill) * nRate / 1000.0);
+        nLastRefill = nNow;
+        if (dTokens <= 0)
+            return 0;
+        return (unsigned int)std::min((double)nWanted, dTokens);
+    }
+
+    void Consume(unsigned int nBytes)
+    {
+        if (IsLimited())
+            dTokens -= nBytes;
+    }
+};
+
+// Global upload/download limits and the share of upload old blocks may take
+extern CTokenBucket bucketSend;
+extern CTokenBucket bucketRecv;
+extern CTokenBucket bucketHistory;
+
+/** Messages and bytes of one command sent or received */
+class CMessageCounter
+{
+public:
+    uint64 nMessages;
+    uint64 nBytes;
+
+    CMessageCounter()
+    {
+        nMessages = 0;
+        nBytes = 0;
+    }
+};
+
 class CNetStatus
 {
 public:
@@ -144,6 +219,7 @@ public:
 class CNodeStats
 {
 public:
+    int id;
     uint64 nServices;
     int64 nLastSend;
     int64 nLastRecv;
@@ -155,6 +231,11 @@ public:
     int64 nReleaseTime;
     int nStartingHeight;
     int nMisbehavior;
+    bool fSupportsCompactBlocks;
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    std::map<std::string, CMessageCounter> mapSendPerCmd;
+    std::map<std::string, CMessageCounter> mapRecvPerCmd;
 };
 
 
@@ -163,6 +244,7 @@ class CNode
 {
 public:
     // socket
+    int id;
     uint64 nServices;
     SOCKET hSocket;
     CDataStream vSend;
@@ -185,11 +267,33 @@ public:
     bool fInbound;
     bool fNetworkNode;
     bool fSuccessfullyConnected;
+    bool fConnecting; // outbound connect() still in progress
+    int64 nConnectStart;
+    int64 nHandshakeStart; // ms, when our version message could go out
+    bool fFeeler; // short lived probe, disconnected after the handshake
     bool fDisconnect;
     CSemaphoreGrant grantOutbound;
     int nRecv104Erorrs;
     int nInvCountLoaedLast;
 
+    // compact block relay, set by "sendcmpct"
+    bool fSupportsCompactBlocks;
+    bool fPreferCompactBlocks;
+    bool fOfferedCompactBlocks; // we sent "sendcmpct"
+
+    // traffic accounting and per-peer rate limits
+    CCriticalSection cs_stats;
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    std::map<std::string, CMessageCounter> mapSendPerCmd;
+    std::map<std::string, CMessageCounter> mapRecvPerCmd;
+    std::string strSendCommand;
+    CTokenBucket sendBucket;
+    CTokenBucket recvBucket;
+
+    // old blocks waiting for bandwidth left over by relay
+    std::deque<CInv> vGetDataDeferred;
+
 protected:
     int nRefCount;
 
@@ -221,7 +325,8 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION),
+        sendBucket(1000*GetArg("-maxpeeruploadrate", 0)), recvBucket(1000*GetArg("-maxpeerdownloadrate", 0))
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -240,6 +345,10 @@ public:
         fInbound = fInboundIn;
         fNetworkNode = false;
         fSuccessfullyConnected = false;
+        fConnecting = false;
+        nConnectStart = 0;
+        nHandshakeStart = 0;
+        fFeeler = false;
         fDisconnect = false;
         nRefCount = 0;
         nReleaseTime = 0;
@@ -254,6 +363,16 @@ public:
 
         nRecv104Erorrs = 0;
         nInvCountLoaedLast = 0;
+        fSupportsCompactBlocks = false;
+        fPreferCompactBlocks = false;
+        fOfferedCompactBlocks = false;
+        nSendBytes = 0;
+        nRecvBytes = 0;
+
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
 
         // Be shy and don't send version until we hear
         if (!fInbound)
@@ -338,10 +457,20 @@ public:
         nHeaderStart = vSend.size();
         vSend << CMessageHeader(pszCommand, 0);
         nMessageStart = vSend.size();
+        strSendCommand = pszCommand;
         if (fDebug)
             printf("sending: %s ", pszCommand);
     }
 
+    void RecordRecvMessage(const std::string& strCommand, unsigned int nBytes)
+    {
+        // The command comes from the peer: unknown ones share a bucket so the map stays bounded
+        LOCK(cs_stats);
+        CMessageCounter& counter = mapRecvPerCmd[CMessageHeader::IsKnownCommand(strCommand) ? strCommand : "other"];
+        counter.nMessages++;
+        counter.nBytes += nBytes;
+    }
+
     void AbortMessage()
     {
         if (nHeaderStart < 0)
@@ -382,6 +511,13 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        {
+            LOCK(cs_stats);
+            CMessageCounter& counter = mapSendPerCmd[strSendCommand];
+            counter.nMessages++;
+            counter.nBytes += vSend.size() - nHeaderStart;
+        }
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -149,5 +149,9 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
+// Non-blocking connect: returns a non-blocking socket, fInProgressRet is set if the
+// connection is not established yet and FinishConnectSocket must be called once it is writable
+bool StartConnectSocket(const CService &addrConnect, SOCKET& hSocketRet, bool& fInProgressRet);
+bool FinishConnectSocket(SOCKET hSocket);
 
 #endif
@@ -16,6 +16,14 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
+    "cmpctblock",
+};
+
+static const char* ppszCommand[] =
+{
+    "version", "verack", "addr", "inv", "getdata", "getblocks", "getheaders",
+    "tx", "block", "cmpctblock", "getblocktxn", "blocktxn", "sendcmpct",
+    "getaddr", "mempool", "checkorder", "reply", "ping", "alert", "checkpoint",
 };
 
 CMessageHeader::CMessageHeader()
@@ -43,6 +51,14 @@ std::string CMessageHeader::GetCommand() const
         return std::string(pchCommand, pchCommand + COMMAND_SIZE);
 }
 
+bool CMessageHeader::IsKnownCommand(const std::string& strCommand)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(ppszCommand); i++)
+        if (strCommand == ppszCommand[i])
+            return true;
+    return false;
+}
+
 bool CMessageHeader::IsValid() const
 {
     // Check start string
@@ -39,6 +39,9 @@ class CMessageHeader
         std::string GetCommand() const;
         bool IsValid() const;
 
+        // Whether ProcessMessage handles strCommand
+        static bool IsKnownCommand(const std::string& strCommand);
+
         IMPLEMENT_SERIALIZE
             (
              READWRITE(FLATDATA(pchMessageStart));
@@ -6,6 +6,8 @@
 
 #include "main.h"
 #include "bitcoinrpc.h"
+#include "base58.h"
+#include "db.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -174,6 +176,26 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the memory pool: transactions, their serialized size,\n"
+            "estimated memory usage, the budget, the fee floor and eviction counters.");
+
+    LOCK(mempool.cs);
+    Object ret;
+    ret.push_back(Pair("size",          (boost::uint64_t)mempool.mapTx.size()));
+    ret.push_back(Pair("bytes",         (boost::uint64_t)mempool.nTotalTxSize));
+    ret.push_back(Pair("usage",         (boost::uint64_t)mempool.nTotalUsage));
+    ret.push_back(Pair("maxmempool",    (boost::uint64_t)CTxMemPool::GetMaxSize()));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFeePerKb())));
+    ret.push_back(Pair("evicted",       (boost::uint64_t)mempool.nEvicted));
+    ret.push_back(Pair("expired",       (boost::uint64_t)mempool.nExpired));
+    return ret;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -255,3 +277,80 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+static CAddressKey AddressKeyFromValue(const Value& value)
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index is not enabled, restart with -addressindex");
+
+    CBitcoinAddress address(value.get_str());
+    CAddressKey key;
+    if (!address.IsValid() || !GetAddressKey(address.Get(), key))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Scash address");
+    return key;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <Scashaddress>\n"
+            "Returns the balance of any address and the total it has received, from the address index.");
+
+    CAddressKey key = AddressKeyFromValue(params[0]);
+    CAddressBalance balance;
+    CTxDB("r").ReadAddressBalance(key, balance);
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(balance.nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(balance.nReceived)));
+    return result;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids <Scashaddress>\n"
+            "Returns the ids of the transactions that pay or spend from any address, oldest first.");
+
+    CAddressKey key = AddressKeyFromValue(params[0]);
+    vector<pair<int, uint256> > vTx;
+    if (!CTxDB("r").ReadAddressTxs(key, vTx))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Address index read failed");
+    sort(vTx.begin(), vTx.end());
+
+    Array result;
+    for (unsigned int i = 0; i < vTx.size(); i++)
+        result.push_back(vTx[i].second.GetHex());
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <Scashaddress>\n"
+            "Returns the unspent outputs of any address.");
+
+    CAddressKey key = AddressKeyFromValue(params[0]);
+    vector<pair<COutPoint, CAddressUnspent> > vUnspent;
+    if (!CTxDB("r").ReadAddressUnspent(key, vUnspent))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Address index read failed");
+
+    Array result;
+    for (unsigned int i = 0; i < vUnspent.size(); i++)
+    {
+        const COutPoint& outpoint = vUnspent[i].first;
+        const CAddressUnspent& unspent = vUnspent[i].second;
+        Object entry;
+        entry.push_back(Pair("txid", outpoint.hash.GetHex()));
+        entry.push_back(Pair("vout", (int)outpoint.n));
+        entry.push_back(Pair("amount", ValueFromAmount(unspent.nValue)));
+        entry.push_back(Pair("height", unspent.nHeight));
+        entry.push_back(Pair("confirmations", nBestHeight - unspent.nHeight + 1));
+        entry.push_back(Pair("scriptPubKey", HexStr(unspent.scriptPubKey.begin(), unspent.scriptPubKey.end())));
+        result.push_back(entry);
+    }
+    return result;
+}
@@ -71,21 +71,35 @@ Value importprivkey(const Array& params, bool fHelp)
 
 Value dorescan(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "rescan\n"
-            "Rescan wallet transactions for all newly added keys.");
+            "rescan [startheight=0]\n"
+            "Rescan wallet transactions for all newly added keys, from block [startheight].\n"
+            "Other wallet calls are served while it runs; getinfo shows its progress.");
 
+    int nStartHeight = 0;
+    if (params.size() > 0)
+        nStartHeight = params[0].get_int();
+
+    CBlockIndex* pindexStart;
     {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
+        LOCK(cs_main);
+        if (nStartHeight < 0 || nStartHeight > nBestHeight)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Start height out of range");
+        pindexStart = FindBlockByHeight(nStartHeight);
+    }
 
-        pwalletMain->MarkDirty();
+    // Claim the rescan for this call; held through the scan below
+    TRY_LOCK(pwalletMain->cs_rescan, lockRescan);
+    if (!lockRescan)
+        throw JSONRPCError(RPC_WALLET_ERROR, "A rescan is already running");
 
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-        pwalletMain->ReacceptWalletTransactions();
-    }
+    // Both take cs_main and cs_wallet themselves, a block or a transaction at a time
+    pwalletMain->MarkDirty();
+    int nFound = pwalletMain->ScanForWalletTransactions(pindexStart, true);
+    pwalletMain->ReacceptWalletTransactions();
 
-    return Value::null;
+    return nFound;
 }
 
 
@@ -8,6 +8,7 @@
 #include "db.h"
 #include "init.h"
 #include "bitcoinrpc.h"
+#include "kernel.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -81,6 +82,16 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
+
+    uint64 nPasses, nCoinsSearched, nMissedWindows, nMissedSeconds;
+    double dCoinsPerSecond;
+    stakeSearchStats.Get(nPasses, nCoinsSearched, nMissedWindows, nMissedSeconds, dCoinsPerSecond);
+    obj.push_back(Pair("stakethreads",         GetStakeThreads()));
+    obj.push_back(Pair("stakesearchpasses",    (uint64_t)nPasses));
+    obj.push_back(Pair("stakecoinssearched",   (uint64_t)nCoinsSearched));
+    obj.push_back(Pair("stakecoinspersec",     dCoinsPerSecond));
+    obj.push_back(Pair("stakemissedwindows",   (uint64_t)nMissedWindows));
+    obj.push_back(Pair("stakemissedseconds",   (uint64_t)nMissedSeconds));
     return obj;
 }
 
@@ -9,6 +9,7 @@
 #include "wallet.h"
 #include "db.h"
 #include "walletdb.h"
+#include "blockdownload.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -37,6 +38,19 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static Object MessageCountersToJSON(const map<string, CMessageCounter>& mapCounters)
+{
+    Object obj;
+    for (map<string, CMessageCounter>::const_iterator mi = mapCounters.begin(); mi != mapCounters.end(); ++mi)
+    {
+        Object entry;
+        entry.push_back(Pair("msgs", (boost::uint64_t)(*mi).second.nMessages));
+        entry.push_back(Pair("bytes", (boost::uint64_t)(*mi).second.nBytes));
+        obj.push_back(Pair((*mi).first, entry));
+    }
+    return obj;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -52,10 +66,13 @@ Value getpeerinfo(const Array& params, bool fHelp)
     BOOST_FOREACH(const CNodeStats& stats, vstats) {
         Object obj;
 
+        obj.push_back(Pair("id", stats.id));
         obj.push_back(Pair("addr", stats.addrName));
         obj.push_back(Pair("services", strprintf("%08" PRI64x, stats.nServices)));
         obj.push_back(Pair("lastsend", (boost::int64_t)stats.nLastSend));
         obj.push_back(Pair("lastrecv", (boost::int64_t)stats.nLastRecv));
+        obj.push_back(Pair("bytessent", (boost::uint64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv", (boost::uint64_t)stats.nRecvBytes));
         obj.push_back(Pair("conntime", (boost::int64_t)stats.nTimeConnected));
         obj.push_back(Pair("version", stats.nVersion));
         obj.push_back(Pair("subver", stats.strSubVer));
@@ -63,6 +80,17 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("releasetime", (boost::int64_t)stats.nReleaseTime));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("compactblocks", stats.fSupportsCompactBlocks));
+
+        CPeerDownloadState state;
+        if (blockDownloader.GetPeerState(stats.id, state))
+        {
+            obj.push_back(Pair("blocksinflight", state.nBlocksInFlight));
+            obj.push_back(Pair("blockdownloadrate", state.dBytesPerSecond));
+            obj.push_back(Pair("blockdownloadtimeouts", state.nTimeouts));
+        }
+        obj.push_back(Pair("sent_per_msg", MessageCountersToJSON(stats.mapSendPerCmd)));
+        obj.push_back(Pair("recv_per_msg", MessageCountersToJSON(stats.mapRecvPerCmd)));
 
         ret.push_back(obj);
     }
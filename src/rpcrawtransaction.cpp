@@ -68,6 +68,21 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         vin.push_back(in);
     }
     entry.push_back(Pair("vin", vin));
+
+    // Inputs spending the outputs of a confirmed transaction
+    map<unsigned int, CSpentInfo> mapSpent;
+    if (fSpentIndex && hashBlock != 0)
+    {
+        CTxDB txdb("r");
+        uint256 hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            CSpentInfo info;
+            if (txdb.ReadSpentInfo(COutPoint(hash, i), info))
+                mapSpent[i] = info;
+        }
+    }
+
     Array vout;
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
@@ -78,6 +93,13 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         Object o;
         ScriptPubKeyToJSON(txout.scriptPubKey, o);
         out.push_back(Pair("scriptPubKey", o));
+        map<unsigned int, CSpentInfo>::iterator mi = mapSpent.find(i);
+        if (mi != mapSpent.end())
+        {
+            out.push_back(Pair("spentTxId", (*mi).second.hashTx.GetHex()));
+            out.push_back(Pair("spentIndex", (boost::int64_t)(*mi).second.nIn));
+            out.push_back(Pair("spentHeight", (*mi).second.nHeight));
+        }
         vout.push_back(out);
     }
     entry.push_back(Pair("vout", vout));
@@ -136,6 +158,131 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
+/** A transaction looked up for gettxout, from the memory pool or the tx index */
+class CTxOutLookup
+{
+public:
+    bool fFound;
+    bool fMempool;
+    CTransaction tx;
+    uint256 hashBlock;
+    CTxIndex txindex;
+
+    CTxOutLookup()
+    {
+        fFound = false;
+        fMempool = false;
+        hashBlock = 0;
+    }
+};
+
+// Looks up a batch of outputs with one database handle, each transaction
+// once and in txid order; returns the unspent ones, null for the others
+static Array GetTxOuts(const vector<COutPoint>& vOutPoints, bool fIncludeMempool)
+{
+    map<uint256, CTxOutLookup> mapLookup;
+    BOOST_FOREACH(const COutPoint& outpoint, vOutPoints)
+        mapLookup[outpoint.hash];
+
+    Array ret;
+    CTxDB txdb("r");
+    LOCK(mempool.cs);
+    for (map<uint256, CTxOutLookup>::iterator mi = mapLookup.begin(); mi != mapLookup.end(); ++mi)
+    {
+        CTxOutLookup& lookup = (*mi).second;
+        if (fIncludeMempool && mempool.exists((*mi).first))
+        {
+            lookup.tx = mempool.lookup((*mi).first);
+            lookup.fFound = lookup.fMempool = true;
+        }
+        else
+            lookup.fFound = ReadConfirmedTransaction(txdb, (*mi).first, lookup.tx, lookup.hashBlock, lookup.txindex);
+    }
+
+    BOOST_FOREACH(const COutPoint& outpoint, vOutPoints)
+    {
+        const CTxOutLookup& lookup = mapLookup[outpoint.hash];
+        if (!lookup.fFound || outpoint.n >= lookup.tx.vout.size() ||
+            (!lookup.fMempool && (outpoint.n >= lookup.txindex.vSpent.size() || !lookup.txindex.vSpent[outpoint.n].IsNull())) ||
+            (fIncludeMempool && mempool.mapNextTx.count(outpoint)))
+        {
+            ret.push_back(Value::null);
+            continue;
+        }
+
+        int nConfirmations = 0;
+        if (!lookup.fMempool)
+        {
+            map<uint256, CBlockIndex*>::iterator miBlock = mapBlockIndex.find(lookup.hashBlock);
+            if (miBlock != mapBlockIndex.end() && (*miBlock).second->IsInMainChain())
+                nConfirmations = 1 + nBestHeight - (*miBlock).second->nHeight;
+        }
+
+        const CTxOut& txout = lookup.tx.vout[outpoint.n];
+        Object entry;
+        entry.push_back(Pair("bestblock", hashBestChain.GetHex()));
+        entry.push_back(Pair("confirmations", nConfirmations));
+        entry.push_back(Pair("value", ValueFromAmount(txout.nValue)));
+        Object o;
+        ScriptPubKeyToJSON(txout.scriptPubKey, o);
+        entry.push_back(Pair("scriptPubKey", o));
+        entry.push_back(Pair("coinbase", lookup.tx.IsCoinBase()));
+        entry.push_back(Pair("coinstake", lookup.tx.IsCoinStake()));
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
+Value gettxout(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+            "gettxout <txid> <n> [includemempool=true]\n"
+            "Returns details about an unspent transaction output, or null if it is spent or unknown.");
+
+    uint256 hash;
+    hash.SetHex(params[0].get_str());
+    int n = params[1].get_int();
+    if (n < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, vout must be positive");
+    bool fIncludeMempool = true;
+    if (params.size() > 2)
+        fIncludeMempool = params[2].get_bool();
+
+    vector<COutPoint> vOutPoints;
+    vOutPoints.push_back(COutPoint(hash, n));
+    return GetTxOuts(vOutPoints, fIncludeMempool)[0];
+}
+
+Value gettxouts(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "gettxouts [{\"txid\":txid,\"vout\":n},...] [includemempool=true]\n"
+            "Returns gettxout's result for each of the outputs, in the same order.");
+
+    RPCTypeCheck(params, list_of(array_type)(bool_type));
+
+    vector<COutPoint> vOutPoints;
+    BOOST_FOREACH(const Value& output, params[0].get_array())
+    {
+        const Object& o = output.get_obj();
+        RPCTypeCheck(o, map_list_of("txid", str_type)("vout", int_type));
+
+        uint256 hash;
+        hash.SetHex(find_value(o, "txid").get_str());
+        int n = find_value(o, "vout").get_int();
+        if (n < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, vout must be positive");
+        vOutPoints.push_back(COutPoint(hash, n));
+    }
+    bool fIncludeMempool = true;
+    if (params.size() > 1)
+        fIncludeMempool = params[1].get_bool();
+
+    return GetTxOuts(vOutPoints, fIncludeMempool);
+}
+
 Value listunspent(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 3)
@@ -450,7 +597,21 @@ Value signrawtransaction(const Array& params, bool fHelp)
 
     bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
 
-    // Sign what we can:
+    // Sign what we can, all inputs at once:
+    vector<CScript> vFromPubKey(mergedTx.vin.size());
+    for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
+    {
+        CTxIn& txin = mergedTx.vin[i];
+        if (mapPrevOut.count(txin.prevout) == 0)
+            continue;
+        txin.scriptSig.clear();
+        // Only sign SIGHASH_SINGLE if there's a corresponding output:
+        if (!fHashSingle || (i < mergedTx.vout.size()))
+            vFromPubKey[i] = mapPrevOut[txin.prevout];
+    }
+    SignSignatures(keystore, vFromPubKey, mergedTx, nHashType);
+
+    CSignatureHasher hasher(mergedTx);
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
     {
         CTxIn& txin = mergedTx.vin[i];
@@ -461,17 +622,12 @@ Value signrawtransaction(const Array& params, bool fHelp)
         }
         const CScript& prevPubKey = mapPrevOut[txin.prevout];
 
-        txin.scriptSig.clear();
-        // Only sign SIGHASH_SINGLE if there's a corresponding output:
-        if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
-
         // ... and merge in other signatures:
         BOOST_FOREACH(const CTransaction& txv, txVariants)
         {
             txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
         }
-        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, true, 0))
+        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, true, 0, &hasher))
             fComplete = false;
     }
 
@@ -84,6 +84,9 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("testnet",       fTestNet));
     obj.push_back(Pair("keypoololdest", (boost::int64_t)pwalletMain->GetOldestKeyPoolTime()));
     obj.push_back(Pair("keypoolsize",   pwalletMain->GetKeyPoolSize()));
+    int nRescanHeight = pwalletMain->GetRescanHeight();
+    if (nRescanHeight != -1)
+        obj.push_back(Pair("rescanheight", nRescanHeight));
     obj.push_back(Pair("paytxfee",      ValueFromAmount(nTransactionFee)));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", (boost::int64_t)nWalletUnlockTime / 1000));
@@ -414,6 +417,52 @@ Value verifymessage(const Array& params, bool fHelp)
 }
 
 
+struct tallyitem
+{
+    int64 nAmount;
+    int nConf;
+    tallyitem()
+    {
+        nAmount = 0;
+        nConf = std::numeric_limits<int>::max();
+    }
+};
+
+// Adds up the outputs paying address in the transactions that have at least nMinDepth
+// confirmations; only the transactions indexed under address are looked at
+static bool TallyAddress(const CTxDestination& address, int nMinDepth, tallyitem& item)
+{
+    map<CTxDestination, set<uint256> >::const_iterator mi = pwalletMain->mapAddressTx.find(address);
+    if (mi == pwalletMain->mapAddressTx.end())
+        return false;
+
+    bool fFound = false;
+    BOOST_FOREACH(const uint256& hash, (*mi).second)
+    {
+        map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.find(hash);
+        if (it == pwalletMain->mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*it).second;
+        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
+            continue;
+
+        int nDepth = wtx.GetDepthInMainChain();
+        if (nDepth < nMinDepth)
+            continue;
+
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        {
+            CTxDestination dest;
+            if (!ExtractDestination(txout.scriptPubKey, dest) || !(dest == address))
+                continue;
+            item.nAmount += txout.nValue;
+            item.nConf = min(item.nConf, nDepth);
+            fFound = true;
+        }
+    }
+    return fFound;
+}
+
 Value getreceivedbyaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -437,16 +486,23 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    map<CTxDestination, set<uint256> >::const_iterator mi = pwalletMain->mapAddressTx.find(address.Get());
+    if (mi != pwalletMain->mapAddressTx.end())
     {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
-            continue;
+        BOOST_FOREACH(const uint256& hash, (*mi).second)
+        {
+            map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.find(hash);
+            if (it == pwalletMain->mapWallet.end())
+                continue;
+            const CWalletTx& wtx = (*it).second;
+            if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
+                continue;
 
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+                if (txout.scriptPubKey == scriptPubKey)
+                    if (wtx.GetDepthInMainChain() >= nMinDepth)
+                        nAmount += txout.nValue;
+        }
     }
 
     return  ValueFromAmount(nAmount);
@@ -483,19 +539,13 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const CTxDestination& address, setAddress)
     {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
+        if (!IsMine(*pwalletMain, address))
             continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-        }
+        tallyitem item;
+        if (TallyAddress(address, nMinDepth, item))
+            nAmount += item.nAmount;
     }
 
     return (double)nAmount / (double)COIN;
@@ -835,17 +885,6 @@ Value addmultisigaddress(const Array& params, bool fHelp)
 }
 
 
-struct tallyitem
-{
-    int64 nAmount;
-    int nConf;
-    tallyitem()
-    {
-        nAmount = 0;
-        nConf = std::numeric_limits<int>::max();
-    }
-};
-
 Value ListReceived(const Array& params, bool fByAccounts)
 {
     // Minimum confirmations
@@ -858,29 +897,15 @@ Value ListReceived(const Array& params, bool fByAccounts)
     if (params.size() > 1)
         fIncludeEmpty = params[1].get_bool();
 
-    // Tally
+    // Tally the address book entries, which are the only ones reported
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, string)& item, pwalletMain->mapAddressBook)
     {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !wtx.IsFinal())
-            continue;
-
-        int nDepth = wtx.GetDepthInMainChain();
-        if (nDepth < nMinDepth)
+        if (!IsMine(*pwalletMain, item.first))
             continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address) || !IsMine(*pwalletMain, address))
-                continue;
-
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
-        }
+        tallyitem tally;
+        if (TallyAddress(item.first, nMinDepth, tally))
+            mapTally[item.first] = tally;
     }
 
     // Reply
@@ -1090,17 +1115,27 @@ Value listtransactions(const Array& params, bool fHelp)
     Array ret;
 
     std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit(strAccount, acentries);
+    CWallet::TxItems acOrdered;
+    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+        acOrdered.insert(make_pair(entry.nOrderPos, CWallet::TxPair((CWalletTx*)0, &entry)));
+
+    // iterate the wallet's order index and the accounting entries backwards
+    // together until we have nCount items to return:
+    CWallet::TxItems::reverse_iterator itTx = pwalletMain->wtxOrdered.rbegin();
+    CWallet::TxItems::reverse_iterator itAc = acOrdered.rbegin();
+    while (itTx != pwalletMain->wtxOrdered.rend() || itAc != acOrdered.rend())
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+        if (itAc == acOrdered.rend() || (itTx != pwalletMain->wtxOrdered.rend() && (*itTx).first > (*itAc).first))
+        {
+            ListTransactions(*(*itTx).second.first, strAccount, 0, true, ret);
+            ++itTx;
+        }
+        else
+        {
+            AcentryToJSON(*(*itAc).second.second, strAccount, ret);
+            ++itAc;
+        }
 
         if ((int)ret.size() >= (nCount+nFrom)) break;
     }
@@ -1215,12 +1250,38 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
+    {
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
+    }
+    else
     {
-        CWalletTx tx = (*it).second;
+        // Transactions in the blocks after pindex, then the ones with no confirmations:
+        // not in a block, or in a block that is not in the main chain
+        set<uint256> setSince;
+        for (CBlockIndex* pblock = pindexBest; pblock && pblock->nHeight > pindex->nHeight; pblock = pblock->pprev)
+        {
+            map<uint256, set<uint256> >::const_iterator mi = pwalletMain->mapBlockTx.find(pblock->GetBlockHash());
+            if (mi != pwalletMain->mapBlockTx.end())
+                setSince.insert((*mi).second.begin(), (*mi).second.end());
+        }
+        for (map<uint256, set<uint256> >::const_iterator mi = pwalletMain->mapBlockTx.begin(); mi != pwalletMain->mapBlockTx.end(); ++mi)
+        {
+            map<uint256, CBlockIndex*>::iterator miBlock = mapBlockIndex.find((*mi).first);
+            if (miBlock == mapBlockIndex.end() || !(*miBlock).second->IsInMainChain())
+                setSince.insert((*mi).second.begin(), (*mi).second.end());
+        }
 
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        BOOST_FOREACH(const uint256& hash, setSince)
+        {
+            map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.find(hash);
+            if (it == pwalletMain->mapWallet.end())
+                continue;
+            const CWalletTx& wtx = (*it).second;
+            if (wtx.GetDepthInMainChain() < depth)
+                ListTransactions(wtx, "*", 0, true, transactions);
+        }
     }
 
     uint256 lastblock;
@@ -1260,9 +1321,10 @@ Value gettransaction(const Array& params, bool fHelp)
 
     Object entry;
 
-    if (pwalletMain->mapWallet.count(hash))
+    map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(hash);
+    if (mi != pwalletMain->mapWallet.end())
     {
-        const CWalletTx& wtx = pwalletMain->mapWallet[hash];
+        const CWalletTx& wtx = (*mi).second;
 
         TxToJSON(wtx, 0, entry);
 
@@ -1278,7 +1340,7 @@ Value gettransaction(const Array& params, bool fHelp)
         WalletTxToJSON(wtx, entry);
 
         Array details;
-        ListTransactions(pwalletMain->mapWallet[hash], "*", 0, false, details);
+        ListTransactions(wtx, "*", 0, false, details);
         entry.push_back(Pair("details", details));
     }
     else
@@ -1342,8 +1404,10 @@ Value keypoolrefill(const Array& params, bool fHelp)
 
     EnsureWalletIsUnlocked();
 
+    // Runs without the RPC locks; the keys are generated outside cs_wallet
     pwalletMain->TopUpKeyPool();
 
+    LOCK(pwalletMain->cs_wallet);
     if (pwalletMain->GetKeyPoolSize() < GetArg("-keypool", 100))
         throw JSONRPCError(RPC_WALLET_ERROR, "Error refreshing keypool.");
 
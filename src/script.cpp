@@ -3,7 +3,11 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -16,25 +20,12 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(const valtype& vchSig, const valtype& vchPubKey, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType,
+              const CSignatureHasher* pHasher);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
-
-
-CBigNum CastToBigNum(const valtype& vch)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
 
 bool CastToBool(const valtype& vch)
 {
@@ -250,9 +241,9 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHasher* pHasher)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
@@ -325,7 +316,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -501,7 +492,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
+                    CScriptNum bn(stack.size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -551,7 +542,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CScriptNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
@@ -617,8 +608,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 3)
                         return false;
                     valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    int nBegin = CScriptNum(stacktop(-2)).getint();
+                    int nEnd = nBegin + CScriptNum(stacktop(-1)).getint();
                     if (nBegin < 0 || nEnd < nBegin)
                         return false;
                     if (nBegin > (int)vch.size())
@@ -639,7 +630,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
                     valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    int nSize = CScriptNum(stacktop(-1)).getint();
                     if (nSize < 0)
                         return false;
                     if (nSize > (int)vch.size())
@@ -657,7 +648,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
+                    CScriptNum bn(stacktop(-1).size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -755,21 +746,20 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    int64 n = CScriptNum(stacktop(-1)).GetInt64();
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
-                    case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_2MUL:       n *= 2; break;
+                    case OP_2DIV:       n = (n < 0 ? -(-n >> 1) : n >> 1); break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stacktop(-1) = CScriptNum(n).getvch();
                 }
                 break;
 
@@ -795,62 +785,51 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    int64 n1 = CScriptNum(stacktop(-2)).GetInt64();
+                    int64 n2 = CScriptNum(stacktop(-1)).GetInt64();
+                    int64 n = 0;
                     switch (opcode)
                     {
                     case OP_ADD:
-                        bn = bn1 + bn2;
+                        n = n1 + n2;
                         break;
 
                     case OP_SUB:
-                        bn = bn1 - bn2;
+                        n = n1 - n2;
                         break;
 
                     case OP_MUL:
-                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                            return false;
+                        n = n1 * n2;
                         break;
 
                     case OP_DIV:
-                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
                     case OP_MOD:
-                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
+                        if (n2 == 0)
                             return false;
+                        // Truncating, as BN_div and BN_mod
+                        n = (opcode == OP_DIV ? n1 / n2 : n1 % n2);
                         break;
 
                     case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 << bn2.getulong();
-                        break;
-
                     case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 >> bn2.getulong();
-                        break;
+                        // Disabled above; results would not fit in an int64
+                        return false;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stacktop(-1) = CScriptNum(n).getvch();
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -867,10 +846,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
-                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    int64 n1 = CScriptNum(stacktop(-3)).GetInt64();
+                    int64 n2 = CScriptNum(stacktop(-2)).GetInt64();
+                    int64 n3 = CScriptNum(stacktop(-1)).GetInt64();
+                    bool fValue = (n2 <= n1 && n1 < n3);
                     popstack(stack);
                     popstack(stack);
                     popstack(stack);
@@ -909,8 +888,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         uint256 hash = Hash(vch.begin(), vch.end());
                         memcpy(&vchHash[0], &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    // Replace the input in place rather than popping and pushing a copy
+                    vch.swap(vchHash);
                 }
                 break;
 
@@ -941,7 +920,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signature, since there's no way for a signature to sign itself
                     scriptCode.FindAndDelete(CScript(vchSig));
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, pHasher);
 
                     popstack(stack);
                     popstack(stack);
@@ -965,7 +944,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CScriptNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -976,7 +955,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CScriptNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -1001,7 +980,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         valtype& vchPubKey = stacktop(-ikey);
 
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, pHasher))
                         {
                             isig++;
                             nSigsCount--;
@@ -1120,67 +1099,126 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return Hash(ss.begin(), ss.end());
 }
 
+CSignatureHasher::CSignatureHasher(const CTransaction& txToIn) : txTo(txToIn)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersionCompat << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+
+    CDataStream ssInputs(SER_GETHASH, 0);
+    vPrefix.reserve(txTo.vin.size());
+    vInputPos.reserve(txTo.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        vPrefix.push_back(ss);
+        vInputPos.push_back(ssInputs.size());
+        CTxIn txinBlank(txin.prevout, CScript(), txin.nSequence);
+        ss << txinBlank;
+        ssInputs << txinBlank;
+    }
+    vInputPos.push_back(ssInputs.size());
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
 
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
 
-class CSignatureCache
+uint256 CSignatureHasher::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    // These blank outputs, sequence numbers or other inputs depending on nIn
+    if (nIn >= txTo.vin.size() || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE ||
+        (nHashType & SIGHASH_ANYONECANPAY))
+        return ::SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
-    {
-        LOCK(cs_sigcache);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    // Same bytes SignatureHash() serializes from its blanked copy
+    CHashWriter ss(vPrefix[nIn]);
+    const CTxIn& txin = txTo.vin[nIn];
+    ss << txin.prevout << scriptCode << txin.nSequence;
+    if (vInputPos[nIn + 1] < vchInputs.size())
+        ss.write(&vchInputs[vInputPos[nIn + 1]], vchInputs.size() - vInputPos[nIn + 1]);
+    ss.write(&vchOutputs[0], vchOutputs.size());
+    ss << nHashType;
+    return ss.GetHash();
+}
+
+
+// The salt keeps others from predicting where an entry goes
+uint256 CSignatureCache::GetKey(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const
+{
+    uint256 key;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &hashSalt, sizeof(hashSalt));
+    SHA256_Update(&ctx, &hash, sizeof(hash));
+    if (!vchSig.empty())
+        SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+    if (!pubKey.empty())
+        SHA256_Update(&ctx, &pubKey[0], pubKey.size());
+    SHA256_Final((unsigned char*)&key, &ctx);
+    return key;
+}
+
+CSignatureCache::CSignatureCache(int64 nMaxEntries)
+{
+    hashSalt = GetRandHash();
+    nBucketsPerShard = std::max(nMaxEntries, (int64)0) / (SHARDS * BUCKET_SIZE);
+    for (unsigned int i = 0; i < SHARDS; i++)
+        shards[i].vEntries.resize(nBucketsPerShard * BUCKET_SIZE);
+}
+
+bool CSignatureCache::Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+{
+    if (nBucketsPerShard == 0)
         return false;
-    }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+    uint256 key = GetKey(hash, vchSig, pubKey);
+    CShard& shard = shards[key.Get64(0) % SHARDS];
+    unsigned int nBucket = (key.Get64(1) % nBucketsPerShard) * BUCKET_SIZE;
+
+    boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++)
+        if (shard.vEntries[nBucket + i] == key)
+            return true;
+    return false;
+}
+
+void CSignatureCache::Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+{
+    if (nBucketsPerShard == 0)
+        return;
 
-        LOCK(cs_sigcache);
+    uint256 key = GetKey(hash, vchSig, pubKey);
+    CShard& shard = shards[key.Get64(0) % SHARDS];
+    unsigned int nBucket = (key.Get64(1) % nBucketsPerShard) * BUCKET_SIZE;
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++)
+    {
+        uint256& entry = shard.vEntries[nBucket + i];
+        if (entry == key)
+            return;
+        if (entry == 0)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            entry = key;
+            return;
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
     }
-};
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+    // Bucket full: overwrite one of its entries. Which one depends on the
+    // salted key, so it is as good as random to an attacker.
+    shard.vEntries[nBucket + key.Get64(2) % BUCKET_SIZE] = key;
+}
+
+bool CheckSig(const valtype& vchSig, const valtype& vchPubKey, const CScript& scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHasher* pHasher)
 {
-    static CSignatureCache signatureCache;
+    // DoS prevention: limit cache size to 32 bytes times -maxsigcachesize entries
+    // (6.4MB by default). Since there are a maximum of 20,000 signature operations
+    // per block, 200,000 entries cover the memory pool and several blocks.
+    static CSignatureCache signatureCache(GetArg("-maxsigcachesize", 200000));
 
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
@@ -1189,10 +1227,11 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         nHashType = vchSig.back();
     else if (nHashType != vchSig.back())
         return false;
-    vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = pHasher ? pHasher->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
+    // Cache entries cover the signature with its hash type byte, which
+    // saves copying it out on a hit
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
@@ -1200,7 +1239,8 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
     if (!key.SetPubKey(vchPubKey))
         return false;
 
-    if (!key.Verify(sighash, vchSig))
+    valtype vchSigDER(vchSig.begin(), vchSig.end() - 1);
+    if (!key.Verify(sighash, vchSigDER))
         return false;
 
     signatureCache.Set(sighash, vchSig, vchPubKey);
@@ -1570,16 +1610,22 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   bool fValidatePayToScriptHash, int nHashType)
+{
+    return VerifyScript(scriptSig, scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, NULL);
+}
+
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHasher* pHasher)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType, pHasher))
     {
         if (fDebug && fDumpAll) printf("ERROR: !EvalScript(stack, scriptSig, txTo, nIn, nHashType)\n");
         return false;
     }
     if (fValidatePayToScriptHash)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType, pHasher))
     {
         if (fDebug && fDumpAll) printf("ERROR: !EvalScript(stack, scriptPubKey, txTo, nIn, nHashType)\n");
         return false;
@@ -1609,7 +1655,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType, pHasher))
         {
             if (fDebug && fDumpAll) printf("ERROR: !EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType)\n");
             return false;
@@ -1631,14 +1677,15 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHasher* pHasher)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = pHasher ? pHasher->SignatureHash(fromPubKey, nIn, nHashType) : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1652,7 +1699,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = pHasher ? pHasher->SignatureHash(subscript, nIn, nHashType) : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -1663,10 +1710,11 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, true, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, true, 0, pHasher);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHasher* pHasher)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1674,10 +1722,60 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     assert(txin.prevout.hash == txFrom.GetHash());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pHasher);
+}
+
+// Each worker signs its share of the inputs in its own copy of the transaction,
+// with its own hasher: SignSignature writes the scriptSig of the input it signs,
+// and SignatureHash() for hash types other than SIGHASH_ALL copies all of them
+static void SignSignaturesWorker(const CKeyStore* pkeystore, const vector<CScript>* pvFromPubKey, const CTransaction* ptxTo, int nHashType,
+                                 vector<CScript>* pvScriptSig, vector<char>* pvfSigned, unsigned int nStart, unsigned int nStride)
+{
+    CTransaction txTo(*ptxTo);
+    CSignatureHasher hasher(txTo);
+    for (unsigned int i = nStart; i < pvFromPubKey->size(); i += nStride)
+    {
+        if ((*pvFromPubKey)[i].empty())
+            continue;
+        (*pvfSigned)[i] = SignSignature(*pkeystore, (*pvFromPubKey)[i], txTo, i, nHashType, &hasher);
+        (*pvScriptSig)[i] = txTo.vin[i].scriptSig;
+    }
+}
+
+bool SignSignatures(const CKeyStore& keystore, const vector<CScript>& vFromPubKey, CTransaction& txTo, int nHashType, int nThreads)
+{
+    assert(vFromPubKey.size() == txTo.vin.size());
+    if (nThreads <= 0)
+        nThreads = GetArg("-par", boost::thread::hardware_concurrency());
+    nThreads = max(1, min(nThreads, (int)(vFromPubKey.size() / 4)));
+
+    vector<CScript> vScriptSig(txTo.vin.size());
+    vector<char> vfSigned(txTo.vin.size(), false);
+    if (nThreads == 1)
+        SignSignaturesWorker(&keystore, &vFromPubKey, &txTo, nHashType, &vScriptSig, &vfSigned, 0, 1);
+    else
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&SignSignaturesWorker, &keystore, &vFromPubKey, &txTo, nHashType, &vScriptSig, &vfSigned, i, nThreads));
+        threadGroup.join_all();
+    }
+
+    // Signatures go in by input index, whichever thread made them
+    bool fAllSigned = true;
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        if (vFromPubKey[i].empty())
+            continue;
+        txTo.vin[i].scriptSig = vScriptSig[i];
+        if (!vfSigned[i])
+            fAllSigned = false;
+    }
+    return fAllSigned;
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     const CSignatureHasher* pHasher)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1700,7 +1798,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
         return false;
     }
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, pHasher);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -1741,7 +1839,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0))
+            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
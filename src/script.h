@@ -10,12 +10,78 @@
 
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include "keystore.h"
 #include "bignum.h"
 
 typedef std::vector<unsigned char> valtype;
 
+/** Numeric opcode operand, kept in a native integer.
+ * Operands are at most nMaxNumSize bytes, so results of the enabled
+ * arithmetic opcodes always fit in an int64. The byte encoding is the same
+ * as CBigNum's: little endian magnitude, sign in the high bit of the last
+ * byte, no redundant bytes.
+ */
+class CScriptNum
+{
+public:
+    static const size_t nMaxNumSize = 4;
+
+    explicit CScriptNum(int64 n) : nValue(n) { }
+
+    explicit CScriptNum(const valtype& vch)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw std::runtime_error("CScriptNum() : overflow");
+        nValue = 0;
+        if (vch.empty())
+            return;
+        for (size_t i = 0; i < vch.size(); i++)
+            nValue |= (int64)vch[i] << (8 * i);
+        // Negative if the sign bit of the last byte is set
+        if (vch.back() & 0x80)
+            nValue = -(int64)(nValue & ~((int64)0x80 << (8 * (vch.size() - 1))));
+    }
+
+    int64 GetInt64() const { return nValue; }
+
+    // Operands fit in 4 bytes, so this only clamps what CBigNum::getint() would
+    int getint() const
+    {
+        if (nValue > 0x7fffffff)
+            return 0x7fffffff;
+        if (nValue < -(int64)0x7fffffff - 1)
+            return -0x7fffffff - 1;
+        return (int)nValue;
+    }
+
+    valtype getvch() const
+    {
+        valtype vch;
+        if (nValue == 0)
+            return vch;
+
+        bool fNegative = nValue < 0;
+        uint64 n = fNegative ? -(uint64)nValue : nValue;
+        while (n)
+        {
+            vch.push_back(n & 0xff);
+            n >>= 8;
+        }
+
+        // Make room for the sign bit if the top byte uses it
+        if (vch.back() & 0x80)
+            vch.push_back(fNegative ? 0x80 : 0);
+        else if (fNegative)
+            vch.back() |= 0x80;
+        return vch;
+    }
+
+private:
+    int64 nValue;
+};
+
 class CTransaction;
 
 /** Signature hash types/flags */
@@ -583,9 +649,66 @@ public:
 
 
 
+/** Signature hashes of the inputs of one transaction.
+ * A signature hash covers the whole transaction, with every other input's
+ * scriptSig blanked. The blanked inputs and the outputs are serialized once
+ * here, and the hash state after the inputs before each one is kept, so a
+ * SIGHASH_ALL hash needs no copy of the transaction and skips hashing the
+ * inputs before nIn. Other hash types fall back to SignatureHash().
+ * Only scriptSigs of txTo may change while this is in use.
+ */
+class CSignatureHasher
+{
+private:
+    const CTransaction& txTo;
+    std::vector<CHashWriter> vPrefix;
+    std::vector<unsigned int> vInputPos;
+    std::vector<char> vchInputs;
+    std::vector<char> vchOutputs;
+
+public:
+    explicit CSignatureHasher(const CTransaction& txToIn);
+
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
 
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain).
+ * Entries are 32 byte salted hashes of (signature hash, signature, public key)
+ * in fixed-size tables, split into shards with their own lock so parallel
+ * script checks rarely contend. Lookups only take the lock shared.
+ */
+class CSignatureCache
+{
+private:
+    static const unsigned int SHARDS = 16;
+    static const unsigned int BUCKET_SIZE = 4;
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+    class CShard
+    {
+    public:
+        boost::shared_mutex mutex;
+        std::vector<uint256> vEntries;
+    };
+
+    uint256 hashSalt;
+    unsigned int nBucketsPerShard;
+    CShard shards[SHARDS];
+
+    uint256 GetKey(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const;
+
+public:
+    // Room for nMaxEntries, rounded down to whole buckets in every shard
+    explicit CSignatureCache(int64 nMaxEntries);
+
+    bool Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey);
+    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey);
+};
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHasher* pHasher=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -593,11 +716,20 @@ bool IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHasher* pHasher=NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHasher* pHasher=NULL);
+// Sign every input i of txTo with a non-empty vFromPubKey[i], spread over nThreads threads (0: -par).
+// Returns true if all of them were signed.
+bool SignSignatures(const CKeyStore& keystore, const std::vector<CScript>& vFromPubKey, CTransaction& txTo, int nHashType=SIGHASH_ALL,
+                    int nThreads=0);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   bool fValidatePayToScriptHash, int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHasher* pHasher);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     const CSignatureHasher* pHasher=NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -298,17 +298,51 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     BOOST_CHECK(!VerifySignature(orphans[1], tx, 1, true, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
-    // Generate a new, different signature for vin[0] to trigger cache clear:
-    CScript oldSig = tx.vin[0].scriptSig;
-    BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
-    BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
-    for (unsigned int j = 0; j < tx.vin.size(); j++)
-        BOOST_CHECK(VerifySignature(orphans[j], tx, j, true, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
-
     LimitOrphanTxSize(0);
 }
 
+BOOST_AUTO_TEST_CASE(DoS_sigcache)
+{
+    std::vector<unsigned char> vchSig(72, 0x30), vchPubKey(33, 0x02);
+
+    // No room: nothing is kept
+    CSignatureCache cacheNone(0);
+    uint256 hash = GetRandHash();
+    cacheNone.Set(hash, vchSig, vchPubKey);
+    BOOST_CHECK(!cacheNone.Get(hash, vchSig, vchPubKey));
+
+    // 64 entries make one bucket of 4 in each of the 16 shards
+    CSignatureCache cache(64);
+    std::vector<uint256> vHash;
+    for (int i = 0; i < 1000; i++)
+    {
+        vHash.push_back(GetRandHash());
+        cache.Set(vHash.back(), vchSig, vchPubKey);
+        // The entry just added is always found, whatever it evicted
+        BOOST_CHECK(cache.Get(vHash.back(), vchSig, vchPubKey));
+    }
+
+    // Every shard is full, and the rest were evicted
+    int nFound = 0;
+    BOOST_FOREACH(const uint256& h, vHash)
+        if (cache.Get(h, vchSig, vchPubKey))
+            nFound++;
+    BOOST_CHECK_EQUAL(nFound, 64);
+
+    // Entries cover the signature and the public key, not just the hash
+    uint256 hashLast = vHash.back();
+    std::vector<unsigned char> vchOther(vchSig);
+    vchOther[10] ^= 1;
+    BOOST_CHECK(!cache.Get(hashLast, vchOther, vchPubKey));
+    BOOST_CHECK(!cache.Get(hashLast, vchSig, vchOther));
+
+    // Adding an entry again does not take a second slot
+    cache.Set(hashLast, vchSig, vchPubKey);
+    nFound = 0;
+    BOOST_FOREACH(const uint256& h, vHash)
+        if (cache.Get(h, vchSig, vchPubKey))
+            nFound++;
+    BOOST_CHECK_EQUAL(nFound, 64);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
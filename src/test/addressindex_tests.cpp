@@ -0,0 +1,216 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addressindex.h"
+#include "main.h"
+#include "db.h"
+
+using namespace std;
+
+static void CheckAddress(CTxDB& txdb, const CAddressKey& key, int64 nBalance, int64 nReceived, unsigned int nTxs,
+                         vector<pair<COutPoint, CAddressUnspent> >& vUnspentRet)
+{
+    // No record reads as zero
+    CAddressBalance balance;
+    txdb.ReadAddressBalance(key, balance);
+    BOOST_CHECK_EQUAL(balance.nBalance, nBalance);
+    BOOST_CHECK_EQUAL(balance.nReceived, nReceived);
+
+    vector<pair<int, uint256> > vTx;
+    BOOST_CHECK(txdb.ReadAddressTxs(key, vTx));
+    BOOST_CHECK_EQUAL(vTx.size(), nTxs);
+    BOOST_CHECK(txdb.ReadAddressUnspent(key, vUnspentRet));
+}
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_connect_disconnect)
+{
+    CKey keyA, keyB;
+    keyA.MakeNewKey(true);
+    keyB.MakeNewKey(true);
+    CScript scriptA, scriptB;
+    scriptA.SetDestination(keyA.GetPubKey().GetID());
+    scriptB << keyB.GetPubKey() << OP_CHECKSIG;
+    CAddressKey addrA, addrB;
+    BOOST_CHECK(GetAddressKey(scriptA, addrA));
+    BOOST_CHECK(GetAddressKey(scriptB, addrB));
+
+    // Block 1: a coinbase paying A, and B by pay-to-pubkey
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.SetNull();
+    txFund.vin[0].scriptSig = CScript() << OP_1;
+    txFund.vout.push_back(CTxOut(10 * COIN, scriptA));
+    txFund.vout.push_back(CTxOut(5 * COIN, scriptB));
+    BOOST_CHECK(txFund.IsCoinBase());
+
+    // Block 2: tx1 spends A's coin, tx2 spends tx1's change to A in the same block
+    CTransaction tx1;
+    tx1.vin.push_back(CTxIn(txFund.GetHash(), 0));
+    tx1.vout.push_back(CTxOut(3 * COIN, scriptA));
+    tx1.vout.push_back(CTxOut(7 * COIN, scriptB));
+    CTransaction tx2;
+    tx2.vin.push_back(CTxIn(tx1.GetHash(), 0));
+    tx2.vout.push_back(CTxOut(3 * COIN, scriptB));
+
+    MapPrevTx mapInputs;
+    mapInputs[txFund.GetHash()].second = txFund;
+    mapInputs[tx1.GetHash()].second = tx1;
+
+    CTxDB txdb("r+");
+    vector<pair<COutPoint, CAddressUnspent> > vUnspent;
+
+    CAddressIndexUpdate connect1(true, 1, true, false);
+    connect1.ConnectTx(txFund, mapInputs);
+    BOOST_CHECK(connect1.Write(txdb, GetRandHash()));
+
+    CAddressIndexUpdate connect2(true, 2, true, false);
+    connect2.ConnectTx(tx1, mapInputs);
+    connect2.ConnectTx(tx2, mapInputs);
+    BOOST_CHECK(connect2.Write(txdb, GetRandHash()));
+
+    // A received 10 + 3 and spent both; tx1:0 was created and spent within block 2
+    CheckAddress(txdb, addrA, 0, 13 * COIN, 3, vUnspent);
+    BOOST_CHECK(vUnspent.empty());
+    CheckAddress(txdb, addrB, 15 * COIN, 15 * COIN, 3, vUnspent);
+    BOOST_CHECK_EQUAL(vUnspent.size(), 3U);
+
+    // Disconnecting block 2 brings back block 1's state, heights included
+    CAddressIndexUpdate disconnect2(false, 2, true, false);
+    BOOST_CHECK(disconnect2.DisconnectTx(txdb, tx2, mapInputs));
+    BOOST_CHECK(disconnect2.DisconnectTx(txdb, tx1, mapInputs));
+    BOOST_CHECK(disconnect2.Write(txdb, GetRandHash()));
+
+    CheckAddress(txdb, addrA, 10 * COIN, 10 * COIN, 1, vUnspent);
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    if (vUnspent.size() == 1)
+    {
+        BOOST_CHECK(vUnspent[0].first == COutPoint(txFund.GetHash(), 0));
+        BOOST_CHECK_EQUAL(vUnspent[0].second.nValue, 10 * COIN);
+        BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 1);
+    }
+    CheckAddress(txdb, addrB, 5 * COIN, 5 * COIN, 1, vUnspent);
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+
+    // And block 1 leaves nothing behind
+    CAddressIndexUpdate disconnect1(false, 1, true, false);
+    BOOST_CHECK(disconnect1.DisconnectTx(txdb, txFund, mapInputs));
+    BOOST_CHECK(disconnect1.Write(txdb, 0));
+
+    CheckAddress(txdb, addrA, 0, 0, 0, vUnspent);
+    BOOST_CHECK(vUnspent.empty());
+    CheckAddress(txdb, addrB, 0, 0, 0, vUnspent);
+    BOOST_CHECK(vUnspent.empty());
+    BOOST_CHECK(txdb.EraseAddressIndexBest());
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_disconnect_in_block_parent)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript script;
+    script.SetDestination(key.GetPubKey().GetID());
+    CAddressKey addr;
+    BOOST_CHECK(GetAddressKey(script, addr));
+
+    // Block 1 is written to disk, so its coinbase can only be read back through txdb
+    CBlock block;
+    block.vtx.resize(1);
+    CTransaction& txFund = block.vtx[0];
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.SetNull();
+    txFund.vin[0].scriptSig = CScript() << OP_3;
+    txFund.vout.push_back(CTxOut(10 * COIN, script));
+    unsigned int nFile, nBlockPos;
+    BOOST_CHECK(block.WriteToDisk(nFile, nBlockPos));
+    unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(1);
+
+    CTxDB txdb("r+");
+    BOOST_CHECK(txdb.UpdateTxIndex(txFund.GetHash(), CTxIndex(CDiskTxPos(nFile, nBlockPos, nTxPos), 1)));
+
+    // Block 2: tx2 spends tx1 in the same block
+    CTransaction tx1;
+    tx1.vin.push_back(CTxIn(txFund.GetHash(), 0));
+    tx1.vout.push_back(CTxOut(4 * COIN, script));
+    CTransaction tx2;
+    tx2.vin.push_back(CTxIn(tx1.GetHash(), 0));
+    tx2.vout.push_back(CTxOut(4 * COIN, script));
+
+    MapPrevTx mapInputs;
+    mapInputs[txFund.GetHash()].second = txFund;
+    mapInputs[tx1.GetHash()].second = tx1;
+    CAddressIndexUpdate connect1(true, 1, true, false);
+    connect1.ConnectTx(txFund, mapInputs);
+    BOOST_CHECK(connect1.Write(txdb, GetRandHash()));
+    CAddressIndexUpdate connect2(true, 2, true, false);
+    connect2.ConnectTx(tx1, mapInputs);
+    connect2.ConnectTx(tx2, mapInputs);
+    BOOST_CHECK(connect2.Write(txdb, GetRandHash()));
+
+    // As in DisconnectBlock, block 2's transactions have no tx index any more:
+    // reading tx1 back fails, so it comes from the block
+    CAddressIndexUpdate disconnectRead(false, 2, true, false);
+    BOOST_CHECK(!disconnectRead.DisconnectTx(txdb, tx2));
+
+    MapPrevTx mapBlockTx;
+    mapBlockTx[tx1.GetHash()].second = tx1;
+    mapBlockTx[tx2.GetHash()].second = tx2;
+    CAddressIndexUpdate disconnect2(false, 2, true, false);
+    BOOST_CHECK(disconnect2.DisconnectTx(txdb, tx2, mapBlockTx));
+    BOOST_CHECK(disconnect2.DisconnectTx(txdb, tx1, mapBlockTx));
+    BOOST_CHECK(disconnect2.Write(txdb, GetRandHash()));
+
+    vector<pair<COutPoint, CAddressUnspent> > vUnspent;
+    CheckAddress(txdb, addr, 10 * COIN, 10 * COIN, 1, vUnspent);
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    if (vUnspent.size() == 1)
+    {
+        BOOST_CHECK(vUnspent[0].first == COutPoint(txFund.GetHash(), 0));
+        BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 1);
+    }
+
+    CAddressIndexUpdate disconnect1(false, 1, true, false);
+    BOOST_CHECK(disconnect1.DisconnectTx(txdb, txFund));
+    BOOST_CHECK(disconnect1.Write(txdb, 0));
+    CheckAddress(txdb, addr, 0, 0, 0, vUnspent);
+    BOOST_CHECK(txdb.EraseTxIndex(txFund));
+    BOOST_CHECK(txdb.EraseAddressIndexBest());
+}
+
+BOOST_AUTO_TEST_CASE(spentindex_connect_disconnect)
+{
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.SetNull();
+    txFund.vin[0].scriptSig = CScript() << OP_2;
+    txFund.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    txFund.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(txFund.GetHash(), 1));
+    txSpend.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+
+    CTxDB txdb("r+");
+    MapPrevTx mapInputs;
+    CAddressIndexUpdate connect(true, 7, false, true);
+    connect.ConnectTx(txFund, mapInputs);
+    connect.ConnectTx(txSpend, mapInputs);
+    BOOST_CHECK(connect.Write(txdb, GetRandHash()));
+
+    CSpentInfo info;
+    BOOST_CHECK(!txdb.ReadSpentInfo(COutPoint(txFund.GetHash(), 0), info));
+    BOOST_CHECK(txdb.ReadSpentInfo(COutPoint(txFund.GetHash(), 1), info));
+    BOOST_CHECK(info.hashTx == txSpend.GetHash());
+    BOOST_CHECK_EQUAL(info.nIn, 0U);
+    BOOST_CHECK_EQUAL(info.nHeight, 7);
+
+    // The spent index alone needs no previous transactions to disconnect
+    CAddressIndexUpdate disconnect(false, 7, false, true);
+    BOOST_CHECK(disconnect.DisconnectTx(txdb, txSpend));
+    BOOST_CHECK(disconnect.DisconnectTx(txdb, txFund));
+    BOOST_CHECK(disconnect.Write(txdb, 0));
+    BOOST_CHECK(!txdb.ReadSpentInfo(COutPoint(txFund.GetHash(), 1), info));
+    BOOST_CHECK(txdb.EraseSpentIndexBest());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,98 @@
+#include <boost/test/unit_test.hpp>
+
+#include "compactblock.h"
+
+using namespace std;
+
+static CTransaction MakeTx(int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = n + 1;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n * CENT;
+    return tx;
+}
+
+static CBlock MakeBlock(int nTx)
+{
+    CBlock block;
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    for (int i = 1; i < nTx; i++)
+        block.vtx.push_back(MakeTx(i));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nBits = 0x1d00ffff;
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_from_pool)
+{
+    CBlock block = MakeBlock(4);
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTx.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.GetTxCount(), 4U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CCompactBlock cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.GetHash() == block.GetHash());
+
+    // Pool has every transaction but the last one
+    CTxMemPool pool;
+    for (int i = 1; i < 3; i++)
+        pool.mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock2, pool));
+    BOOST_CHECK(!partial.IsComplete());
+
+    vector<unsigned short> vMissing;
+    partial.GetMissing(vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 3);
+
+    CBlockTransactionsRequest req;
+    req.hashBlock = block.GetHash();
+    req.vIndexes = vMissing;
+    CBlockTransactions resp(block, req);
+    BOOST_CHECK(partial.Fill(resp.vtx));
+
+    CBlock block2;
+    BOOST_CHECK(partial.GetBlock(block2));
+    BOOST_CHECK(block2.hashMerkleRoot == block.hashMerkleRoot);
+    BOOST_CHECK(block2.vtx.size() == block.vtx.size());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_wrong_tx)
+{
+    CBlock block = MakeBlock(3);
+    CCompactBlock cmpctblock(block);
+
+    CTxMemPool pool;
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock, pool));
+
+    // Fill with transactions that are not in the block
+    vector<CTransaction> vtx;
+    vtx.push_back(MakeTx(10));
+    vtx.push_back(MakeTx(11));
+    BOOST_CHECK(partial.Fill(vtx));
+
+    CBlock block2;
+    BOOST_CHECK(!partial.GetBlock(block2));
+
+    // Out of range request
+    CBlockTransactionsRequest req;
+    req.vIndexes.push_back(7);
+    BOOST_CHECK_THROW(CBlockTransactions resp(block, req), std::out_of_range);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,255 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "keystore.h"
+
+using namespace std;
+
+static CTransaction MakeChild(const CTransaction& txParent, int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = txParent.GetHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n * CENT;
+    return tx;
+}
+
+// Spends output n of txFrom, signed with the keys in keystore, paying nValue back to key
+static CTransaction MakeSpend(const CKeyStore& keystore, const CKey& key, const CTransaction& txFrom, unsigned int n, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(txFrom.GetHash(), n));
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[0].nValue = nValue;
+    BOOST_CHECK(SignSignature(keystore, txFrom, tx, 0));
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_package)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout.hash = 1;
+    txParent.vin[0].prevout.n = 0;
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = COIN;
+    CTransaction txChild = MakeChild(txParent, 1);
+    CTransaction txGrandChild = MakeChild(txChild, 2);
+
+    uint256 hashParent = txParent.GetHash();
+    uint256 hashChild = txChild.GetHash();
+    uint256 hashGrandChild = txGrandChild.GetHash();
+
+    CTxMemPoolEntry entryParent(txParent);
+    entryParent.nFee = 1000;
+    CTxMemPoolEntry entryChild(txChild);
+    entryChild.nFee = 50000;
+    CTxMemPoolEntry entryGrandChild(txGrandChild);
+    entryGrandChild.nFee = 3000;
+
+    // Child first, as after a reorganization resurrects the parent
+    pool.addUnchecked(hashChild, txChild, entryChild);
+    pool.addUnchecked(hashGrandChild, txGrandChild, entryGrandChild);
+    BOOST_CHECK_EQUAL(pool.mapEntry[hashGrandChild].nCountWithAncestors, 2U);
+    pool.addUnchecked(hashParent, txParent, entryParent);
+
+    const CTxMemPoolEntry& entry = pool.mapEntry[hashGrandChild];
+    BOOST_CHECK_EQUAL(entry.nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(entry.nFeesWithAncestors, 54000);
+    BOOST_CHECK_EQUAL(entry.nSizeWithAncestors, entryParent.nTxSize + entryChild.nTxSize + entryGrandChild.nTxSize);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFee.size(), 3U);
+
+    // The child's package pays the most per kB
+    BOOST_CHECK(pool.setByAncestorFee.rbegin()->second == hashChild);
+
+    set<uint256> setAncestors;
+    pool.CalculateAncestors(hashGrandChild, setAncestors);
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2U);
+
+    // Mined parent no longer counts towards its descendants
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.mapEntry[hashGrandChild].nCountWithAncestors, 2U);
+    BOOST_CHECK_EQUAL(pool.mapEntry[hashGrandChild].nFeesWithAncestors, 53000);
+    BOOST_CHECK(pool.mapEntry[hashChild].setParents.empty());
+    BOOST_CHECK_EQUAL(pool.setByAncestorFee.size(), 2U);
+
+    pool.clear();
+    BOOST_CHECK(pool.mapEntry.empty());
+    BOOST_CHECK(pool.setByAncestorFee.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+
+    CTransaction txCheap;
+    txCheap.vin.resize(1);
+    txCheap.vin[0].prevout.hash = 1;
+    txCheap.vin[0].prevout.n = 0;
+    txCheap.vout.resize(1);
+    txCheap.vout[0].nValue = COIN;
+    CTransaction txChild = MakeChild(txCheap, 1);
+    CTransaction txRich = txCheap;
+    txRich.vin[0].prevout.hash = 2;
+
+    CTxMemPoolEntry entryCheap(txCheap);
+    entryCheap.nFee = 0;
+    CTxMemPoolEntry entryChild(txChild);
+    entryChild.nFee = 100;
+    CTxMemPoolEntry entryRich(txRich);
+    entryRich.nFee = 100000;
+    pool.addUnchecked(txCheap.GetHash(), txCheap, entryCheap);
+    pool.addUnchecked(txChild.GetHash(), txChild, entryChild);
+    pool.addUnchecked(txRich.GetHash(), txRich, entryRich);
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, (uint64)(entryCheap.nUsage + entryChild.nUsage + entryRich.nUsage));
+    BOOST_CHECK_EQUAL(pool.GetMinFeePerKb(), 0);
+
+    // Evicting the cheap parent takes its child along
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.nTotalUsage - 1), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), 1U);
+    BOOST_CHECK(pool.mapTx.count(txRich.GetHash()));
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, (uint64)entryRich.nUsage);
+    BOOST_CHECK(pool.GetMinFeePerKb() >= MIN_RELAY_TX_FEE);
+    BOOST_CHECK_EQUAL(pool.nEvicted, 2U);
+
+    BOOST_CHECK_EQUAL(pool.Expire(GetTime() + 1), 1);
+    BOOST_CHECK(pool.mapTx.empty());
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_batch)
+{
+    // acceptBatch fetches inputs from the global pool, so the batches go there
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.hash = GetRandHash();
+    txFund.vin[0].prevout.n = 0;
+    txFund.vout.resize(4);
+    for (unsigned int i = 0; i < txFund.vout.size(); i++)
+    {
+        txFund.vout[i].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+        txFund.vout[i].nValue = COIN;
+    }
+    BOOST_CHECK(mempool.addUnchecked(txFund.GetHash(), txFund));
+
+    CTransaction txParent = MakeSpend(keystore, key, txFund, 0, COIN - CENT);
+    CTransaction txChild = MakeSpend(keystore, key, txParent, 0, COIN - 2 * CENT);
+    CTransaction txMissing = txChild;
+    txMissing.vin[0].prevout.hash = GetRandHash();
+    CTransaction txSpend1 = MakeSpend(keystore, key, txFund, 1, COIN - CENT);
+    CTransaction txSpend2 = MakeSpend(keystore, key, txFund, 1, COIN - 2 * CENT);
+    CTransaction txBadSig = MakeSpend(keystore, key, txFund, 2, COIN - CENT);
+    txBadSig.vout[0].nValue -= CENT;
+    CTransaction txGood = MakeSpend(keystore, key, txFund, 3, COIN - CENT);
+
+    vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    vtx.push_back(txChild);
+    vtx.push_back(txMissing);
+    vtx.push_back(txSpend1);
+    vtx.push_back(txSpend2);
+    vtx.push_back(txBadSig);
+    vtx.push_back(txGood);
+    vector<bool> vAccepted, vMissingInputs;
+    mempool.acceptBatch(vtx, vAccepted, vMissingInputs);
+    BOOST_CHECK_EQUAL(vAccepted.size(), vtx.size());
+    BOOST_CHECK_EQUAL(vMissingInputs.size(), vtx.size());
+
+    // The child's parent was not in the pool when the batch was checked
+    BOOST_CHECK(vAccepted[0] && !vMissingInputs[0]);
+    BOOST_CHECK(!vAccepted[1] && vMissingInputs[1]);
+    BOOST_CHECK(!vAccepted[2] && vMissingInputs[2]);
+
+    // The first of two spends of the same output wins
+    BOOST_CHECK(vAccepted[3]);
+    BOOST_CHECK(!vAccepted[4] && !vMissingInputs[4]);
+
+    // A bad signature rejects only its own transaction
+    BOOST_CHECK(!vAccepted[5] && !vMissingInputs[5]);
+    BOOST_CHECK_EQUAL(vtx[5].nDoS, 100);
+    BOOST_CHECK(vAccepted[6]);
+
+    BOOST_CHECK(mempool.exists(txParent.GetHash()));
+    BOOST_CHECK(!mempool.exists(txChild.GetHash()));
+    BOOST_CHECK(mempool.exists(txSpend1.GetHash()));
+    BOOST_CHECK(!mempool.exists(txSpend2.GetHash()));
+    BOOST_CHECK(!mempool.exists(txBadSig.GetHash()));
+    BOOST_CHECK(mempool.exists(txGood.GetHash()));
+
+    // Retried as an orphan would be, the child now connects
+    vtx.assign(1, txChild);
+    mempool.acceptBatch(vtx, vAccepted, vMissingInputs);
+    BOOST_CHECK(vAccepted[0]);
+    BOOST_CHECK(mempool.exists(txChild.GetHash()));
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(mempool_dump_load)
+{
+    // Dumping needs a completed load; there may be no mempool.dat yet
+    mempool.clear();
+    ThreadLoadMempool(NULL);
+    mempool.clear();
+
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.hash = GetRandHash();
+    txFund.vin[0].prevout.n = 0;
+    txFund.vout.resize(2);
+    for (unsigned int i = 0; i < txFund.vout.size(); i++)
+    {
+        txFund.vout[i].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+        txFund.vout[i].nValue = COIN;
+    }
+    CTransaction txParent = MakeSpend(keystore, key, txFund, 0, COIN - CENT);
+    CTransaction txChild = MakeSpend(keystore, key, txParent, 0, COIN - 2 * CENT);
+    CTransaction txExpired = MakeSpend(keystore, key, txFund, 1, COIN - CENT);
+
+    int64 nNow = GetTime();
+    BOOST_CHECK(mempool.addUnchecked(txFund.GetHash(), txFund));
+    BOOST_CHECK(mempool.addUnchecked(txParent.GetHash(), txParent));
+    BOOST_CHECK(mempool.addUnchecked(txChild.GetHash(), txChild));
+    BOOST_CHECK(mempool.addUnchecked(txExpired.GetHash(), txExpired));
+    mempool.mapEntry[txParent.GetHash()].nTime = nNow - 60 * 60;
+    mempool.mapEntry[txChild.GetHash()].nTime = nNow - 30 * 60;
+    mempool.mapEntry[txExpired.GetHash()].nTime = nNow - (DEFAULT_MEMPOOL_EXPIRY + 1) * 60 * 60;
+    DumpMempool();
+
+    // txFund's own input is unknown, so it cannot come back by itself
+    mempool.clear();
+    BOOST_CHECK(mempool.addUnchecked(txFund.GetHash(), txFund));
+    ThreadLoadMempool(NULL);
+
+    BOOST_CHECK(mempool.exists(txParent.GetHash()));
+    BOOST_CHECK(mempool.exists(txChild.GetHash()));
+    BOOST_CHECK(!mempool.exists(txExpired.GetHash()));
+
+    // Receive times survive the reload
+    map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapEntry.find(txParent.GetHash());
+    BOOST_CHECK(mi != mempool.mapEntry.end() && (*mi).second.nTime == nNow - 60 * 60);
+    mi = mempool.mapEntry.find(txChild.GetHash());
+    BOOST_CHECK(mi != mempool.mapEntry.end() && (*mi).second.nTime == nNow - 30 * 60);
+
+    mempool.clear();
+    boost::filesystem::remove(GetDataDir() / "mempool.dat");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
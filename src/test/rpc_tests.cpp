@@ -4,6 +4,7 @@
 #include "base58.h"
 #include "util.h"
 #include "bitcoinrpc.h"
+#include "db.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -59,4 +60,50 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_gettxout_spent)
+{
+    rpcfn_type gettxout = tableRPC["gettxout"]->actor;
+
+    // A confirmed transaction with its first output spent: the tx index is
+    // written to the txdb, the transaction itself is served from the cache
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    tx.vout.push_back(CTxOut(2 * COIN, CScript() << OP_TRUE));
+    uint256 hash = tx.GetHash();
+    CTxIndex txindex(CDiskTxPos(1, 1, 1), tx.vout.size());
+    txindex.vSpent[0] = CDiskTxPos(1, 2, 1);
+    {
+        CTxDB txdb("r+");
+        BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    }
+    txLookupCache.Add(hash, tx, GetRandHash());
+
+    Array params;
+    params.push_back(hash.GetHex());
+    params.push_back(0);
+    BOOST_CHECK(gettxout(params, false).type() == null_type);
+
+    params[1] = 1;
+    Value v = gettxout(params, false);
+    BOOST_CHECK(v.type() == obj_type);
+    if (v.type() == obj_type)
+        BOOST_CHECK_EQUAL(find_value(v.get_obj(), "value").get_real(), 2.0);
+
+    // Spent by a memory pool transaction: null unless the pool is left out
+    CTransaction txChild;
+    txChild.vin.push_back(CTxIn(hash, 1));
+    txChild.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    BOOST_CHECK(mempool.addUnchecked(txChild.GetHash(), txChild));
+    BOOST_CHECK(gettxout(params, false).type() == null_type);
+    params.push_back(false);
+    BOOST_CHECK(gettxout(params, false).type() == obj_type);
+    mempool.remove(txChild);
+
+    txLookupCache.Erase(hash);
+    CTxDB txdb("r+");
+    BOOST_CHECK(txdb.EraseTxIndex(tx));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -442,4 +442,69 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_num)
+{
+    // Same encoding and value as CBigNum around every byte boundary
+    int64 values[] = { 0, 1, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff, 0x10000,
+                       0x7fffff, 0x800000, 0x7fffffff, 0x80000000LL, 0xffffffffLL, 0xffffffffffLL };
+    BOOST_FOREACH(int64 v, values)
+    {
+        for (int nSign = -1; nSign <= 1; nSign += 2)
+        {
+            int64 n = v * nSign;
+            CBigNum bn(n);
+            BOOST_CHECK(CScriptNum(n).getvch() == bn.getvch());
+            if (bn.getvch().size() <= CScriptNum::nMaxNumSize)
+            {
+                BOOST_CHECK_EQUAL(CScriptNum(bn.getvch()).GetInt64(), n);
+                BOOST_CHECK_EQUAL(CScriptNum(bn.getvch()).getint(), bn.getint());
+            }
+        }
+    }
+
+    // Non-minimal encodings and negative zero decode like CBigNum does
+    valtype vchNegZero(1, 0x80);
+    BOOST_CHECK_EQUAL(CScriptNum(vchNegZero).GetInt64(), 0);
+    BOOST_CHECK(CScriptNum(vchNegZero).getvch().empty());
+    valtype vchPadded(3, 0);
+    vchPadded[0] = 5;
+    vchPadded[2] = 0x80;
+    BOOST_CHECK_EQUAL(CScriptNum(vchPadded).GetInt64(), -5);
+
+    BOOST_CHECK_THROW(CScriptNum(valtype(5, 1)), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(script_SignatureHasher)
+{
+    CTransaction txTo;
+    txTo.vin.resize(4);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        txTo.vin[i].prevout.hash = i + 1;
+        txTo.vin[i].prevout.n = i;
+        txTo.vin[i].scriptSig << OP_1 << OP_2;
+        txTo.vin[i].nSequence = i;
+    }
+    txTo.vout.resize(3);
+    for (unsigned int i = 0; i < txTo.vout.size(); i++)
+    {
+        txTo.vout[i].nValue = (i + 1) * CENT;
+        txTo.vout[i].scriptPubKey << OP_TRUE;
+    }
+    txTo.nLockTime = 42;
+
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_CODESEPARATOR << OP_HASH160 << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    CSignatureHasher hasher(txTo);
+    int hashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, SIGHASH_ALL|SIGHASH_ANYONECANPAY, 0, 4 };
+    BOOST_FOREACH(int nHashType, hashTypes)
+        for (unsigned int nIn = 0; nIn <= txTo.vin.size(); nIn++)
+            BOOST_CHECK(hasher.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, txTo, nIn, nHashType));
+
+    // Signatures do not change it
+    txTo.vin[2].scriptSig = CScript() << OP_3;
+    BOOST_CHECK(hasher.SignatureHash(scriptCode, 1, SIGHASH_ALL) == SignatureHash(scriptCode, txTo, 1, SIGHASH_ALL));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,99 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "keystore.h"
+#include "script.h"
+
+using namespace std;
+
+// txTo spends all nInputs outputs of txFrom, which pay the keys in turn
+static void MakeSpend(const vector<CKey>& vKeys, unsigned int nInputs, CTransaction& txFrom, CTransaction& txTo, vector<CScript>& vFromPubKey)
+{
+    txFrom = CTransaction();
+    txFrom.vout.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        txFrom.vout[i].scriptPubKey.SetDestination(vKeys[i % vKeys.size()].GetPubKey().GetID());
+        txFrom.vout[i].nValue = CENT;
+    }
+
+    txTo = CTransaction();
+    txTo.vin.resize(nInputs);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = nInputs * CENT;
+    vFromPubKey.clear();
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+        vFromPubKey.push_back(txFrom.vout[i].scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sign_tests)
+
+BOOST_AUTO_TEST_CASE(sign_parallel)
+{
+    CBasicKeyStore keystore;
+    vector<CKey> vKeys(4);
+    BOOST_FOREACH(CKey& key, vKeys)
+    {
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+    }
+
+    unsigned int nInputs[] = { 1, 100, 1000 };
+    for (unsigned int n = 0; n < sizeof(nInputs) / sizeof(nInputs[0]); n++)
+    {
+        CTransaction txFrom, txTo;
+        vector<CScript> vFromPubKey;
+        MakeSpend(vKeys, nInputs[n], txFrom, txTo, vFromPubKey);
+
+        // One thread or four, every input ends up signed
+        CTransaction txSerial(txTo);
+        int64 nStart = GetTimeMillis();
+        BOOST_CHECK(SignSignatures(keystore, vFromPubKey, txSerial, SIGHASH_ALL, 1));
+        int64 nSerial = GetTimeMillis() - nStart;
+
+        CTransaction txParallel(txTo);
+        nStart = GetTimeMillis();
+        BOOST_CHECK(SignSignatures(keystore, vFromPubKey, txParallel, SIGHASH_ALL, 4));
+        int64 nParallel = GetTimeMillis() - nStart;
+
+        if (getenv("SCASH_BENCH"))
+            printf("signing %u inputs: 1 thread %" PRI64d " ms, 4 threads %" PRI64d " ms\n", nInputs[n], nSerial, nParallel);
+
+        for (unsigned int i = 0; i < nInputs[n]; i++)
+        {
+            BOOST_CHECK(VerifySignature(txFrom, txSerial, i, true, 0));
+            BOOST_CHECK(VerifySignature(txFrom, txParallel, i, true, 0));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sign_missing_key)
+{
+    CBasicKeyStore keystore;
+    vector<CKey> vKeys(2);
+    vKeys[0].MakeNewKey(true);
+    vKeys[1].MakeNewKey(true);
+    keystore.AddKey(vKeys[0]);
+
+    CTransaction txFrom, txTo;
+    vector<CScript> vFromPubKey;
+    MakeSpend(vKeys, 20, txFrom, txTo, vFromPubKey);
+
+    // Inputs paying the key we do not have stay unsigned, the others are signed
+    BOOST_CHECK(!SignSignatures(keystore, vFromPubKey, txTo, SIGHASH_ALL, 4));
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        BOOST_CHECK_EQUAL(VerifySignature(txFrom, txTo, i, true, 0), i % 2 == 0);
+
+    // Inputs without a script are left alone
+    CTransaction txSkip;
+    MakeSpend(vKeys, 20, txFrom, txSkip, vFromPubKey);
+    for (unsigned int i = 1; i < vFromPubKey.size(); i += 2)
+        vFromPubKey[i] = CScript();
+    BOOST_CHECK(SignSignatures(keystore, vFromPubKey, txSkip, SIGHASH_ALL, 4));
+    BOOST_CHECK(txSkip.vin[1].scriptSig.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -261,4 +261,30 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(tx_lookup_cache)
+{
+    CTxLookupCache cache;
+    vector<uint256> vHash;
+    for (unsigned int i = 0; i < TX_LOOKUP_CACHE_SIZE + 1; i++)
+        vHash.push_back(GetRandHash());
+    CTransaction tx, txRet;
+    uint256 hashBlock = GetRandHash(), hashBlockRet;
+
+    // Erased and added again, vHash[0] is newer than vHash[1]
+    cache.Add(vHash[0], tx, hashBlock);
+    cache.Erase(vHash[0]);
+    BOOST_CHECK(!cache.Get(vHash[0], txRet, hashBlockRet));
+    cache.Add(vHash[1], tx, hashBlock);
+    cache.Add(vHash[0], tx, hashBlock);
+    BOOST_CHECK(cache.Get(vHash[0], txRet, hashBlockRet));
+    BOOST_CHECK(hashBlockRet == hashBlock);
+
+    // Filling the cache evicts the oldest entry, vHash[1], only
+    for (unsigned int i = 2; i < vHash.size(); i++)
+        cache.Add(vHash[i], tx, hashBlock);
+    BOOST_CHECK(!cache.Get(vHash[1], txRet, hashBlockRet));
+    BOOST_CHECK(cache.Get(vHash[0], txRet, hashBlockRet));
+    BOOST_CHECK(cache.Get(vHash[vHash.size() - 1], txRet, hashBlockRet));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,15 +1,9 @@
 #include <boost/test/unit_test.hpp>
 
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
-// how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
-#define RUN_TESTS 100
-
-// some tests fail 1% of the time due to bad luck.
-// we repeat those tests this many times and only complain if all iterations of the test fail
-#define RANDOM_REPEATS 5
-
 using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
@@ -24,6 +18,7 @@ static void add_coin(int64 nValue, int nAge = 6*24, bool fIsFromMe = false, int
     static int i;
     CTransaction* tx = new CTransaction;
     tx->nLockTime = i++;        // so all transactions get different hashes
+    tx->nTime = 0;              // and none is timestamped after the spend time
     tx->vout.resize(nInput+1);
     tx->vout[nInput].nValue = nValue;
     CWalletTx* wtx = new CWalletTx(&wallet, *tx);
@@ -58,238 +53,507 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     static CoinSet setCoinsRet, setCoinsRet2;
     static int64 nValueRet;
 
-    // test multiple times to allow for differences in the shuffle order
-    for (int i = 0; i < RUN_TESTS; i++)
-    {
-        empty_wallet();
-
-        // with an empty wallet we can't even pay one cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    empty_wallet();
 
-        add_coin(1*CENT, 4);        // add a new 1 cent coin
+    // with an empty wallet we can't even pay one cent
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+
+    add_coin(1*CENT, 4);        // add a new 1 cent coin
+
+    // with a new 1 cent coin, we still can't find a mature 1 cent
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
 
-        // with a new 1 cent coin, we still can't find a mature 1 cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
-
-        // but we can find a new 1 cent
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
-
-        add_coin(2*CENT);           // add a mature 2 cent coin
+    // but we can find a new 1 cent
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
+
+    add_coin(2*CENT);           // add a mature 2 cent coin
+
+    // we can't make 3 cents of mature coins
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(3 * CENT, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+
+    // we can make 3 cents of new  coins
+    BOOST_CHECK( wallet.SelectCoinsMinConf(3 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 3 * CENT);
+
+    add_coin(5*CENT);           // add a mature 5 cent coin,
+    add_coin(10*CENT, 3, true); // a new 10 cent coin sent from one of our own addresses
+    add_coin(20*CENT);          // and a mature 20 cent coin
+
+    // now we have new: 1+10=11 (of which 10 was self-sent), and mature: 2+5+20=27.  total = 38
+
+    // we can't make 38 cents only if we disallow new coins:
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    // we can't even make 37 cents if we don't allow new coins even if they're from us
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 0, 6, 6, vCoins, setCoinsRet, nValueRet));
+    // but we can make 37 cents if we accept new coins from ourself
+    BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 37 * CENT);
+    // and we can make 38 cents if we accept all new coins
+    BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 38 * CENT);
+
+    // try making 34 cents from 1,2,5,10,20 - we can't do it exactly
+    BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_GT(nValueRet, 34 * CENT);         // but should get more than 34 cents
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);     // the best is 20+10+5
+
+    // when we try making 7 cents, the smaller coins (1,2,5) are enough.  We should see just 2+5
+    BOOST_CHECK( wallet.SelectCoinsMinConf(7 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+
+    // when we try making 8 cents, the smaller coins (1,2,5) are exactly enough.
+    BOOST_CHECK( wallet.SelectCoinsMinConf(8 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK(nValueRet == 8 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
+
+    // when we try making 9 cents, no subset of smaller coins is enough, and we get the next bigger coin (10)
+    BOOST_CHECK( wallet.SelectCoinsMinConf(9 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
+
+    // now clear out the wallet and start again to test choosing between subsets of smaller coins and the next biggest coin
+    empty_wallet();
+
+    add_coin( 6*CENT);
+    add_coin( 7*CENT);
+    add_coin( 8*CENT);
+    add_coin(20*CENT);
+    add_coin(30*CENT); // now we have 6+7+8+20+30 = 71 cents total
+
+    // check that we have 71 and not 72
+    BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+
+    // now try making 16 cents.  the best smaller coins can do is 6+7+8 = 21; not as good at the next biggest coin, 20
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 20 * CENT); // we should get 20 in one coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
+
+    add_coin( 5*CENT); // now we have 5+6+7+8+20+30 = 75 cents total
+
+    // now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, better than the next biggest coin, 20
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 18 * CENT); // we should get 18 in 3 coins
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
+
+    add_coin( 18*CENT); // now we have 5+6+7+8+18+20+30
+
+    // and now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, the same as the next biggest coin, 18
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 18 * CENT);  // we should get 18 in 1 coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1); // because in the event of a tie, the biggest coin wins
+
+    // now try making 11 cents.  we should get 5+6
+    BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+
+    // check that the smallest bigger coin is used
+    add_coin( 1*COIN);
+    add_coin( 2*COIN);
+    add_coin( 3*COIN);
+    add_coin( 4*COIN); // now we have 5+6+7+8+18+20+30+100+200+300+400 = 1094 cents
+    BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);  // we should get 1 BTC in 1 coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
+
+    BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 2 * COIN);  // we should get 2 BTC in 1 coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
+
+    // empty the wallet and start again, now with fractions of a cent, to test sub-cent change avoidance
+    empty_wallet();
+    add_coin(0.1*CENT);
+    add_coin(0.2*CENT);
+    add_coin(0.3*CENT);
+    add_coin(0.4*CENT);
+    add_coin(0.5*CENT);
+
+    // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 = 1.5 cents
+    // we'll get sub-cent change whatever happens, so can expect 1.0 exactly
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
+
+    // but if we add a bigger coin, making it possible to avoid sub-cent change, things change:
+    add_coin(1111*CENT);
+
+    // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 + 1111 = 1112.5 cents
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
+
+    // if we add more sub-cent coins:
+    add_coin(0.6*CENT);
+    add_coin(0.7*CENT);
+
+    // and try again to make 1.0 cents, we can still make 1.0 cents
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
+
+    // run the 'mtgox' test (see http://blockexplorer.com/tx/29a3efd3ef04f9153d47a990bd7b048a4b2d213daaa5fb8ed670fb85f13bdbcf)
+    // they tried to consolidate 10 50k coins into one 500k coin, and ended up with 50k in change
+    empty_wallet();
+    for (int i = 0; i < 20; i++)
+        add_coin(50000 * COIN);
+
+    BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 10); // in ten coins
+
+    // if there's not enough in the smaller coins to make at least 1 cent change (0.5+0.6+0.7 < 1.0+1.0),
+    // we need to try finding an exact subset anyway
+
+    // sometimes it will fail, and so we use the next biggest coin:
+    empty_wallet();
+    add_coin(0.5 * CENT);
+    add_coin(0.6 * CENT);
+    add_coin(0.7 * CENT);
+    add_coin(1111 * CENT);
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1111 * CENT); // we get the bigger coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
+
+    // but sometimes it's possible, and we use an exact subset (0.4 + 0.6 = 1.0)
+    empty_wallet();
+    add_coin(0.4 * CENT);
+    add_coin(0.6 * CENT);
+    add_coin(0.8 * CENT);
+    add_coin(1111 * CENT);
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);   // we should get the exact amount
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2); // in two coins 0.4+0.6
+
+    // test avoiding sub-cent change
+    empty_wallet();
+    add_coin(0.0005 * COIN);
+    add_coin(0.01 * COIN);
+    add_coin(1 * COIN);
+
+    // trying to make 1.0001 from these three coins, 1 + 0.0005 leaves less than MIN_TXOUT_AMOUNT over
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1.0005 * COIN);   // so no change output is needed
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+
+    // but if we try to make 0.999, we should take the bigger of the two small coins to avoid sub-cent change
+    BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+
+    // test that the selection is deterministic
+    {
+        empty_wallet();
+        for (int i2 = 0; i2 < 100; i2++)
+            add_coin(COIN);
+
+        // picking 50 from 100 coins gives the same 50 every time
+        BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 0, 1, 6, vCoins, setCoinsRet , nValueRet));
+        BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 0, 1, 6, vCoins, setCoinsRet2, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 50 * COIN);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 50U);
+        BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+
+        // and so does picking 1 from 100 identical coins
+        BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 0, 1, 6, vCoins, setCoinsRet , nValueRet));
+        BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 0, 1, 6, vCoins, setCoinsRet2, nValueRet));
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+        BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+
+        // add 75 cents in small change.  not enough to make 90 cents,
+        // so one of the competing "smallest bigger" coins is picked, always the same one
+        add_coin( 5*CENT); add_coin(10*CENT); add_coin(15*CENT); add_coin(20*CENT); add_coin(25*CENT);
+
+        BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 0, 1, 6, vCoins, setCoinsRet , nValueRet));
+        BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 0, 1, 6, vCoins, setCoinsRet2, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, COIN);
+        BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+    }
+}
 
-        // we can't make 3 cents of mature coins
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+BOOST_AUTO_TEST_CASE(coin_selection_no_change)
+{
+    CoinSet setCoinsRet, setCoinsRet2;
+    int64 nValueRet;
 
-        // we can make 3 cents of new  coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 3 * CENT);
+    empty_wallet();
+    add_coin(4 * CENT);
+    add_coin(3 * CENT);
+    add_coin(2 * CENT);
 
-        add_coin(5*CENT);           // add a mature 5 cent coin,
-        add_coin(10*CENT, 3, true); // a new 10 cent coin sent from one of our own addresses
-        add_coin(20*CENT);          // and a mature 20 cent coin
+    // 3 + 2 cents leaves less than MIN_TXOUT_AMOUNT over, so no change output is needed
+    BOOST_CHECK(wallet.SelectCoinsMinConf(5 * CENT - MIN_TXOUT_AMOUNT / 2, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
 
-        // now we have new: 1+10=11 (of which 10 was self-sent), and mature: 2+5+20=27.  total = 38
+    // same coins, same selection
+    BOOST_CHECK(wallet.SelectCoinsMinConf(5 * CENT - MIN_TXOUT_AMOUNT / 2, 0, 1, 1, vCoins, setCoinsRet2, nValueRet));
+    BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
 
-        // we can't make 38 cents only if we disallow new coins:
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
-        // we can't even make 37 cents if we don't allow new coins even if they're from us
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 6, 6, vCoins, setCoinsRet, nValueRet));
-        // but we can make 37 cents if we accept new coins from ourself
-        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 37 * CENT);
-        // and we can make 38 cents if we accept all new coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 38 * CENT);
+    // no changeless subset: falls back to the closest total leaving at least a cent of change
+    BOOST_CHECK(wallet.SelectCoinsMinConf(4 * CENT + MIN_TXOUT_AMOUNT * 2, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 6 * CENT);
 
-        // try making 34 cents from 1,2,5,10,20 - we can't do it exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_GT(nValueRet, 34 * CENT);         // but should get more than 34 cents
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);     // the best should be 20+10+5.  it's incredibly unlikely the 1 or 2 got included (but possible)
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(10 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+}
 
-        // when we try making 7 cents, the smaller coins (1,2,5) are enough.  We should see just 2+5
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+BOOST_AUTO_TEST_CASE(coin_selection_large_wallet)
+{
+    CoinSet setCoinsRet;
+    int64 nValueRet;
 
-        // when we try making 8 cents, the smaller coins (1,2,5) are exactly enough.
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK(nValueRet == 8 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
+    empty_wallet();
+    for (int i = 0; i < 100000; i++)
+        add_coin((1 + (i * 7919) % 1000) * CENT);
 
-        // when we try making 9 cents, no subset of smaller coins is enough, and we get the next bigger coin (10)
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
+    // the exact search finds a changeless selection
+    int64 nStart = GetTimeMillis();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(12900 * CENT, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    int64 nExact = GetTimeMillis() - nStart;
+    BOOST_CHECK(nValueRet >= 12900 * CENT && nValueRet < 12900 * CENT + MIN_TXOUT_AMOUNT);
 
-        // now clear out the wallet and start again to test choosing between subsets of smaller coins and the next biggest coin
-        empty_wallet();
+    // half a cent over whole cents cannot be paid without change: the bounded approximation does it
+    nStart = GetTimeMillis();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(12900 * CENT + CENT / 2, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+    int64 nFallback = GetTimeMillis() - nStart;
+    BOOST_CHECK(nValueRet >= 12900 * CENT + CENT / 2);
 
-        add_coin( 6*CENT);
-        add_coin( 7*CENT);
-        add_coin( 8*CENT);
-        add_coin(20*CENT);
-        add_coin(30*CENT); // now we have 6+7+8+20+30 = 71 cents total
-
-        // check that we have 71 and not 72
-        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-
-        // now try making 16 cents.  the best smaller coins can do is 6+7+8 = 21; not as good at the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 20 * CENT); // we should get 20 in one coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        add_coin( 5*CENT); // now we have 5+6+7+8+20+30 = 75 cents total
-
-        // now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, better than the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 18 * CENT); // we should get 18 in 3 coins
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
-
-        add_coin( 18*CENT); // now we have 5+6+7+8+18+20+30
-
-        // and now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, the same as the next biggest coin, 18
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 18 * CENT);  // we should get 18 in 1 coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1); // because in the event of a tie, the biggest coin wins
-
-        // now try making 11 cents.  we should get 5+6
-        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
-
-        // check that the smallest bigger coin is used
-        add_coin( 1*COIN);
-        add_coin( 2*COIN);
-        add_coin( 3*COIN);
-        add_coin( 4*COIN); // now we have 5+6+7+8+18+20+30+100+200+300+400 = 1094 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);  // we should get 1 BTC in 1 coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 2 * COIN);  // we should get 2 BTC in 1 coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        // empty the wallet and start again, now with fractions of a cent, to test sub-cent change avoidance
-        empty_wallet();
-        add_coin(0.1*CENT);
-        add_coin(0.2*CENT);
-        add_coin(0.3*CENT);
-        add_coin(0.4*CENT);
-        add_coin(0.5*CENT);
-
-        // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 = 1.5 cents
-        // we'll get sub-cent change whatever happens, so can expect 1.0 exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
-
-        // but if we add a bigger coin, making it possible to avoid sub-cent change, things change:
-        add_coin(1111*CENT);
-
-        // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 + 1111 = 1112.5 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
-
-        // if we add more sub-cent coins:
-        add_coin(0.6*CENT);
-        add_coin(0.7*CENT);
-
-        // and try again to make 1.0 cents, we can still make 1.0 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
-
-        // run the 'mtgox' test (see http://blockexplorer.com/tx/29a3efd3ef04f9153d47a990bd7b048a4b2d213daaa5fb8ed670fb85f13bdbcf)
-        // they tried to consolidate 10 50k coins into one 500k coin, and ended up with 50k in change
-        empty_wallet();
-        for (int i = 0; i < 20; i++)
-            add_coin(50000 * COIN);
+    if (getenv("SCASH_BENCH"))
+        printf("coin selection over %" PRIszu " coins: exact %" PRI64d " ms, fallback %" PRI64d " ms\n", vCoins.size(), nExact, nFallback);
 
-        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 10); // in ten coins
+    empty_wallet();
+}
 
-        // if there's not enough in the smaller coins to make at least 1 cent change (0.5+0.6+0.7 < 1.0+1.0),
-        // we need to try finding an exact subset anyway
+// Entries of a wallet index under key, without adding an empty one
+template<typename K>
+static unsigned int IndexSize(const map<K, set<uint256> >& mapIndex, const K& key)
+{
+    typename map<K, set<uint256> >::const_iterator mi = mapIndex.find(key);
+    return mi == mapIndex.end() ? 0 : (*mi).second.size();
+}
 
-        // sometimes it will fail, and so we use the next biggest coin:
-        empty_wallet();
-        add_coin(0.5 * CENT);
-        add_coin(0.6 * CENT);
-        add_coin(0.7 * CENT);
-        add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1111 * CENT); // we get the bigger coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        // but sometimes it's possible, and we use an exact subset (0.4 + 0.6 = 1.0)
-        empty_wallet();
-        add_coin(0.4 * CENT);
-        add_coin(0.6 * CENT);
-        add_coin(0.8 * CENT);
-        add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);   // we should get the exact amount
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2); // in two coins 0.4+0.6
-
-        // test avoiding sub-cent change
-        empty_wallet();
-        add_coin(0.0005 * COIN);
-        add_coin(0.01 * COIN);
-        add_coin(1 * COIN);
+template<typename K>
+static bool IsIndexed(const map<K, set<uint256> >& mapIndex, const K& key, const uint256& hash)
+{
+    typename map<K, set<uint256> >::const_iterator mi = mapIndex.find(key);
+    return mi != mapIndex.end() && (*mi).second.count(hash);
+}
 
-        // trying to make 1.0001 from these three coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1.0105 * COIN);   // we should get all coins
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
+static unsigned int CountOrdered(const CWallet& wallet, const uint256& hash)
+{
+    unsigned int n = 0;
+    BOOST_FOREACH(const CWallet::TxItems::value_type& item, wallet.wtxOrdered)
+        if (item.second.first && item.second.first->GetHash() == hash)
+            n++;
+    return n;
+}
 
-        // but if we try to make 0.999, we should take the bigger of the two small coins to avoid sub-cent change
-        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+BOOST_AUTO_TEST_CASE(wallet_tx_index)
+{
+    CKey keyA, keyB;
+    keyA.MakeNewKey(true);
+    keyB.MakeNewKey(true);
+    CTxDestination addressA = keyA.GetPubKey().GetID(), addressB = keyB.GetPubKey().GetID();
+
+    CTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout.hash = GetRandHash();
+    tx1.vout.resize(2);
+    tx1.vout[0].scriptPubKey.SetDestination(addressA);
+    tx1.vout[0].nValue = COIN;
+    tx1.vout[1].scriptPubKey.SetDestination(addressB);
+    tx1.vout[1].nValue = COIN;
+    CTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout.hash = GetRandHash();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey.SetDestination(addressA);
+    tx2.vout[0].nValue = COIN;
+    uint256 hash1 = tx1.GetHash(), hash2 = tx2.GetHash();
+    uint256 hashBlock1 = GetRandHash(), hashBlock2 = GetRandHash();
+
+    CWalletTx wtx1(pwalletMain, tx1);
+    wtx1.hashBlock = hashBlock1;
+    CWalletTx wtx2(pwalletMain, tx2);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx1));
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx2));
+
+    // Indexed by the addresses paid and by block, unconfirmed under 0
+    BOOST_CHECK_EQUAL(IndexSize(pwalletMain->mapAddressTx, addressA), 2U);
+    BOOST_CHECK(IsIndexed(pwalletMain->mapAddressTx, addressB, hash1));
+    BOOST_CHECK(IsIndexed(pwalletMain->mapBlockTx, hashBlock1, hash1));
+    BOOST_CHECK(IsIndexed(pwalletMain->mapBlockTx, uint256(0), hash2));
+    BOOST_CHECK_EQUAL(CountOrdered(*pwalletMain, hash1), 1U);
+    BOOST_CHECK_EQUAL(CountOrdered(*pwalletMain, hash2), 1U);
+
+    // Confirming tx2 moves it to its block, once
+    wtx2.hashBlock = hashBlock2;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx2));
+    BOOST_CHECK(!IsIndexed(pwalletMain->mapBlockTx, uint256(0), hash2));
+    BOOST_CHECK(IsIndexed(pwalletMain->mapBlockTx, hashBlock2, hash2));
+    BOOST_CHECK_EQUAL(CountOrdered(*pwalletMain, hash2), 1U);
+
+    // Erasing drops every index entry, and empty sets with it
+    BOOST_CHECK(pwalletMain->EraseFromWallet(hash1));
+    BOOST_CHECK_EQUAL(IndexSize(pwalletMain->mapAddressTx, addressB), 0U);
+    BOOST_CHECK_EQUAL(IndexSize(pwalletMain->mapAddressTx, addressA), 1U);
+    BOOST_CHECK_EQUAL(IndexSize(pwalletMain->mapBlockTx, hashBlock1), 0U);
+    BOOST_CHECK_EQUAL(CountOrdered(*pwalletMain, hash1), 0U);
+
+    BOOST_CHECK(pwalletMain->EraseFromWallet(hash2));
+    BOOST_CHECK_EQUAL(IndexSize(pwalletMain->mapAddressTx, addressA), 0U);
+    BOOST_CHECK_EQUAL(IndexSize(pwalletMain->mapBlockTx, hashBlock2), 0U);
+    BOOST_CHECK_EQUAL(CountOrdered(*pwalletMain, hash2), 0U);
+}
 
-        // test randomness
+BOOST_AUTO_TEST_CASE(wallet_rescan)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CScript scriptMine, scriptMinePubKey, scriptOther;
+    scriptMine.SetDestination(key.GetPubKey().GetID());
+    scriptMinePubKey << key.GetPubKey() << OP_CHECKSIG;
+    scriptOther.SetDestination(keyOther.GetPubKey().GetID());
+
+    // 150 blocks after the genesis block, more than two batches; every tenth pays
+    // us and block 100 spends what block 0 paid us
+    const int nBlocks = 150;
+    vector<CBlock> vBlock(nBlocks);
+    vector<uint256> vBlockHash(nBlocks);
+    vector<CBlockIndex*> vIndex;
+    CBlockIndex* pindexPrev = pindexGenesisBlock;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBlock& block = vBlock[i];
+        block.hashPrevBlock = pindexPrev->GetBlockHash();
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        tx.vout[0].scriptPubKey = i % 10 ? scriptOther : i % 20 ? scriptMinePubKey : scriptMine;
+        block.vtx.push_back(tx);
+        if (i == 100)
         {
-            empty_wallet();
-            for (int i2 = 0; i2 < 100; i2++)
-                add_coin(COIN);
-
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
-            BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
-
-            int fails = 0;
-            for (int i = 0; i < RANDOM_REPEATS; i++)
-            {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
-                // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
-                if (equal_sets(setCoinsRet, setCoinsRet2))
-                    fails++;
-            }
-            BOOST_CHECK_NE(fails, RANDOM_REPEATS);
-
-            // add 75 cents in small change.  not enough to make 90 cents,
-            // then try making 90 cents.  there are multiple competing "smallest bigger" coins,
-            // one of which should be picked at random
-            add_coin( 5*CENT); add_coin(10*CENT); add_coin(15*CENT); add_coin(20*CENT); add_coin(25*CENT);
-
-            fails = 0;
-            for (int i = 0; i < RANDOM_REPEATS; i++)
-            {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
-                // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet));
-                if (equal_sets(setCoinsRet, setCoinsRet2))
-                    fails++;
-            }
-            BOOST_CHECK_NE(fails, RANDOM_REPEATS);
+            CTransaction txSpend;
+            txSpend.vin.push_back(CTxIn(vBlock[0].vtx[0].GetHash(), 0));
+            txSpend.vout.push_back(CTxOut(COIN, scriptOther));
+            block.vtx.push_back(txSpend);
         }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        unsigned int nFile, nBlockPos;
+        BOOST_CHECK(block.WriteToDisk(nFile, nBlockPos));
+        vBlockHash[i] = block.GetHash();
+        CBlockIndex* pindex = new CBlockIndex(nFile, nBlockPos, block);
+        pindex->phashBlock = &vBlockHash[i];
+        pindex->pprev = pindexPrev;
+        pindex->nHeight = pindexPrev->nHeight + 1;
+        pindexPrev->pnext = pindex;
+        vIndex.push_back(pindex);
+        pindexPrev = pindex;
     }
+    CBlockIndex* pindexBestSave = pindexBest;
+    pindexBest = vIndex.back();
+
+    // From the start: 15 payments and the spend of the first
+    CWallet walletAll;
+    walletAll.AddKey(key);
+    BOOST_CHECK_EQUAL(walletAll.ScanForWalletTransactions(pindexGenesisBlock), 16);
+    BOOST_CHECK_EQUAL(walletAll.mapWallet.size(), 16U);
+    BOOST_CHECK_EQUAL(walletAll.GetRescanHeight(), -1);
+    map<uint256, CWalletTx>::const_iterator mi = walletAll.mapWallet.find(vBlock[0].vtx[0].GetHash());
+    BOOST_CHECK(mi != walletAll.mapWallet.end() && (*mi).second.IsSpent(0));
+    mi = walletAll.mapWallet.find(vBlock[140].vtx[0].GetHash());
+    BOOST_CHECK(mi != walletAll.mapWallet.end() && (*mi).second.hashBlock == vBlockHash[140]);
+
+    // From block 75: the payments from block 80 on; the spend is no longer ours
+    CWallet walletLate;
+    walletLate.AddKey(key);
+    BOOST_CHECK_EQUAL(walletLate.ScanForWalletTransactions(vIndex[75]), 7);
+    BOOST_CHECK(!walletLate.mapWallet.count(vBlock[70].vtx[0].GetHash()));
+    BOOST_CHECK(walletLate.mapWallet.count(vBlock[80].vtx[0].GetHash()));
+    BOOST_CHECK(!walletLate.mapWallet.count(vBlock[100].vtx[1].GetHash()));
+
+    pindexBest = pindexBestSave;
+    pindexGenesisBlock->pnext = NULL;
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        delete pindex;
+}
+
+// The balances summed over every transaction, without the ledger or credit caches
+static void CheckLedger(const CWallet& walletCheck)
+{
+    int64 nBalance = 0, nUnconfirmed = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = walletCheck.mapWallet.begin(); it != walletCheck.mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = (*it).second;
+        if (wtx.IsFinal() && wtx.IsConfirmed())
+            nBalance += wtx.GetAvailableCredit(false);
+        else
+            nUnconfirmed += wtx.GetAvailableCredit(false);
+    }
+    BOOST_CHECK_EQUAL(walletCheck.GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(walletCheck.GetUnconfirmedBalance(), nUnconfirmed);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ledger)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CScript scriptMine, scriptOther;
+    scriptMine.SetDestination(key.GetPubKey().GetID());
+    scriptOther.SetDestination(keyOther.GetPubKey().GetID());
+
+    CWallet walletLedger;
+    walletLedger.AddKey(key);
+    CheckLedger(walletLedger);
+
+    // Receive: unconfirmed
+    CTransaction txReceive;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout.hash = GetRandHash();
+    txReceive.vout.push_back(CTxOut(COIN, scriptMine));
+    CWalletTx wtxReceive(&walletLedger, txReceive);
+    BOOST_CHECK(walletLedger.AddToWallet(wtxReceive));
+    CheckLedger(walletLedger);
+    BOOST_CHECK_EQUAL(walletLedger.GetUnconfirmedBalance(), COIN);
+
+    // A block confirms it; the wallet hears of the block before it is the tip
+    CBlock block;
+    block.hashPrevBlock = pindexGenesisBlock->GetBlockHash();
+    block.vtx.push_back(txReceive);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    uint256 hashBlock = block.GetHash();
+    CBlockIndex* pindex = new CBlockIndex(0, 0, block);
+    pindex->phashBlock = &(*mapBlockIndex.insert(make_pair(hashBlock, pindex)).first).first;
+    pindex->pprev = pindexGenesisBlock;
+    pindex->nHeight = pindexGenesisBlock->nHeight + 1;
+    wtxReceive.SetMerkleBranch(&block);
+    BOOST_CHECK(walletLedger.AddToWallet(wtxReceive));
+    CBlockIndex* pindexBestSave = pindexBest;
+    pindexGenesisBlock->pnext = pindex;
+    pindexBest = pindex;
+    CheckLedger(walletLedger);
+    BOOST_CHECK_EQUAL(walletLedger.GetBalance(), COIN);
+
+    // Spend it, half back to us
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(txReceive.GetHash(), 0));
+    txSpend.vout.push_back(CTxOut(COIN / 2, scriptMine));
+    txSpend.vout.push_back(CTxOut(COIN / 2, scriptOther));
+    BOOST_CHECK(walletLedger.AddToWallet(CWalletTx(&walletLedger, txSpend)));
+    CheckLedger(walletLedger);
+    BOOST_CHECK_EQUAL(walletLedger.GetBalance() + walletLedger.GetUnconfirmedBalance(), COIN / 2);
+
+    // The block is disconnected, which rebuilds the ledger
+    pindexGenesisBlock->pnext = NULL;
+    pindexBest = pindexBestSave;
+    CheckLedger(walletLedger);
+
+    mapBlockIndex.erase(hashBlock);
+    delete pindex;
 }
 
 BOOST_AUTO_TEST_SUITE_END()
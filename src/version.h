@@ -25,7 +25,7 @@ extern const std::string CLIENT_DATE;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 72400;
+static const int PROTOCOL_VERSION = 72500;
 static const int MIN_PROTO_VERSION = 72400;
 
 // nTime field added to CAddress, starting with this version;
@@ -42,6 +42,12 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" start with this version
+static const int COMPACT_BLOCKS_VERSION = 72500;
+
+// peers.dat entries carry measured latency and throughput starting with this client version
+static const int ADDRMAN_QUALITY_VERSION = 1020301;
+
 #define DISPLAY_VERSION_MAJOR       1
 #define DISPLAY_VERSION_MINOR       2
 #define DISPLAY_VERSION_REVISION    3
@@ -15,6 +15,8 @@
 #include "chartdata.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 extern int nStakeMaxAge;
@@ -41,16 +43,45 @@ CPubKey CWallet::GenerateNewKey()
     RandAddSeedPerfmon();
     CKey key;
     key.MakeNewKey(fCompressed);
+    return AddGeneratedKey(key);
+}
 
+CPubKey CWallet::AddGeneratedKey(const CKey& key)
+{
     // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
+    if (key.IsCompressed())
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
     if (!AddKey(key))
-        throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
+        throw std::runtime_error("CWallet::AddGeneratedKey() : AddKey failed");
     return key.GetPubKey();
 }
 
+static void MakeNewKeysWorker(vector<CKey>* pvKeys, bool fCompressed, unsigned int nStart, unsigned int nStride)
+{
+    for (unsigned int i = nStart; i < pvKeys->size(); i += nStride)
+        (*pvKeys)[i].MakeNewKey(fCompressed);
+}
+
+// Make nKeys new keys, spread over -par threads. Takes no lock; the keys
+// are added to the wallet by AddGeneratedKey.
+static void MakeNewKeys(unsigned int nKeys, bool fCompressed, vector<CKey>& vKeys)
+{
+    RandAddSeedPerfmon();
+    vKeys.resize(nKeys);
+    int nThreads = max(1, (int)GetArg("-par", boost::thread::hardware_concurrency()));
+    if (nThreads == 1 || nKeys < 2)
+    {
+        MakeNewKeysWorker(&vKeys, fCompressed, 0, 1);
+        return;
+    }
+
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads && i < (int)nKeys; i++)
+        threadGroup.create_thread(boost::bind(&MakeNewKeysWorker, &vKeys, fCompressed, i, nThreads));
+    threadGroup.join_all();
+}
+
 bool CWallet::AddKey(const CKey& key)
 {
     if (!CCryptoKeyStore::AddKey(key))
@@ -319,15 +350,8 @@ CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries,
     CWalletDB walletdb(strWalletFile);
 
     // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    TxItems txOrdered(wtxOrdered);
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
-    }
     acentries.clear();
     walletdb.ListAccountCreditDebit(strAccount, acentries);
     BOOST_FOREACH(CAccountingEntry& entry, acentries)
@@ -338,6 +362,64 @@ CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries,
     return txOrdered;
 }
 
+void CWallet::IndexWalletTx(const uint256& hash, CWalletTx& wtx)
+{
+    wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+    mapBlockTx[wtx.hashBlock].insert(hash);
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination address;
+        if (ExtractDestination(txout.scriptPubKey, address))
+            mapAddressTx[address].insert(hash);
+    }
+}
+
+static void EraseIndexEntry(map<uint256, set<uint256> >& mapIndex, const uint256& key, const uint256& hash)
+{
+    map<uint256, set<uint256> >::iterator mi = mapIndex.find(key);
+    if (mi == mapIndex.end())
+        return;
+    (*mi).second.erase(hash);
+    if ((*mi).second.empty())
+        mapIndex.erase(mi);
+}
+
+void CWallet::UnindexWalletTx(const uint256& hash, CWalletTx& wtx)
+{
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(wtx.nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+    {
+        if ((*it).second.first == &wtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
+    }
+    EraseIndexEntry(mapBlockTx, wtx.hashBlock, hash);
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination address;
+        if (!ExtractDestination(txout.scriptPubKey, address))
+            continue;
+        map<CTxDestination, set<uint256> >::iterator mi = mapAddressTx.find(address);
+        if (mi == mapAddressTx.end())
+            continue;
+        (*mi).second.erase(hash);
+        if ((*mi).second.empty())
+            mapAddressTx.erase(mi);
+    }
+}
+
+void CWallet::BuildWalletTxIndex()
+{
+    LOCK(cs_wallet);
+    wtxOrdered.clear();
+    mapAddressTx.clear();
+    mapBlockTx.clear();
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        IndexWalletTx((*it).first, (*it).second);
+}
+
 void CWallet::WalletUpdateSpent(const CTransaction &tx)
 {
     // Anytime a signature is successfully verified, it's proof the outpoint is spent.
@@ -358,6 +440,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %s; %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateLedger(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -371,7 +454,98 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        InvalidateLedger();
+    }
+}
+
+void CWallet::InvalidateLedger()
+{
+    LOCK(cs_wallet);
+    pindexLedger = NULL;
+}
+
+void CWallet::GetLedgerEntry(const CWalletTx& wtx, CWalletLedgerEntry& entry) const
+{
+    entry.pwtx = &wtx;
+    entry.balances.SetNull();
+
+    bool fFinal = wtx.IsFinal();
+    if (fFinal && wtx.IsConfirmed())
+        entry.balances.nBalance = wtx.GetAvailableCredit();
+    else
+        entry.balances.nUnconfirmed = wtx.GetAvailableCredit();
+
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fImmature = (wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0;
+    if (fImmature && nDepth > 0)
+    {
+        if (wtx.IsCoinBase())
+        {
+            entry.balances.nImmature = GetCredit(wtx);
+            entry.balances.nNewMint = entry.balances.nImmature;
+        }
+        else
+            entry.balances.nStake = GetCredit(wtx);
     }
+
+    // Anything else only changes when spent, or when a reorganization
+    // takes its block out of the main chain (which rebuilds the ledger)
+    entry.fPending = !fFinal || nDepth <= 0 || fImmature;
+}
+
+// Called under cs_wallet whenever a transaction is added, erased or has
+// outputs marked spent or unspent
+void CWallet::UpdateLedger(const uint256& hash) const
+{
+    if (!pindexLedger)
+        return;
+
+    map<uint256, CWalletLedgerEntry>::iterator mi = mapLedger.find(hash);
+    if (mi != mapLedger.end())
+    {
+        ledgerTotals -= (*mi).second.balances;
+        mapLedger.erase(mi);
+    }
+    setLedgerPending.erase(hash);
+
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    if (it == mapWallet.end())
+        return;
+
+    CWalletLedgerEntry entry;
+    GetLedgerEntry((*it).second, entry);
+    if (entry.fPending)
+        setLedgerPending.insert(hash);
+    if (entry.fPending || !entry.balances.IsNull())
+    {
+        ledgerTotals += entry.balances;
+        mapLedger.insert(make_pair(hash, entry));
+    }
+}
+
+// Bring the ledger up to the current best block. When the chain only grew,
+// just the pending entries are looked at again.
+void CWallet::RefreshLedger() const
+{
+    if (pindexLedger == pindexBest && pindexLedger)
+        return;
+
+    if (pindexLedger && pindexLedger->IsInMainChain())
+    {
+        CBlockIndex* pindexNew = pindexBest;
+        vector<uint256> vPending(setLedgerPending.begin(), setLedgerPending.end());
+        BOOST_FOREACH(const uint256& hash, vPending)
+            UpdateLedger(hash);
+        pindexLedger = pindexNew;
+        return;
+    }
+
+    mapLedger.clear();
+    setLedgerPending.clear();
+    ledgerTotals.SetNull();
+    pindexLedger = pindexBest;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateLedger((*it).first);
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -388,6 +562,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            IndexWalletTx(hash, wtx);
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -442,6 +617,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             // Merge
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
             {
+                EraseIndexEntry(mapBlockTx, wtx.hashBlock, hash);
+                mapBlockTx[wtxIn.hashBlock].insert(hash);
                 wtx.hashBlock = wtxIn.hashBlock;
                 fUpdated = true;
             }
@@ -483,6 +660,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 #endif
+        UpdateLedger(hash);
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx);
 
@@ -531,8 +710,14 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            UnindexWalletTx(hash, (*mi).second);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        UpdateLedger(hash);
     }
     return true;
 }
@@ -794,25 +979,241 @@ bool CWalletTx::WriteToDisk()
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+/** Output filter for rescans: a snapshot of the wallet's key ids, so worker
+ * threads can rule out most transactions without taking the wallet lock.
+ * It may pass outputs that are not the wallet's (multisig with one of our
+ * keys), never the reverse.
+ */
+class CRescanFilter
+{
+private:
+    const CKeyStore* pkeystore;
+    set<CKeyID> setKeys;
+
+public:
+    explicit CRescanFilter(const CKeyStore& keystore) : pkeystore(&keystore)
+    {
+        keystore.GetKeys(setKeys);
+    }
+
+    bool MayBeMine(const CScript& scriptPubKey) const
+    {
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(scriptPubKey, whichType, vSolutions))
+            return false;
+
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            return setKeys.count(CPubKey(vSolutions[0]).GetID()) != 0;
+        case TX_PUBKEYHASH:
+            return setKeys.count(CKeyID(uint160(vSolutions[0]))) != 0;
+        case TX_SCRIPTHASH:
+            return pkeystore->HaveCScript(CScriptID(uint160(vSolutions[0])));
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (setKeys.count(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    bool MayBeMine(const CTransaction& tx) const
+    {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (MayBeMine(txout.scriptPubKey))
+                return true;
+        return false;
+    }
+};
+
+/** A block read and filtered ahead of the wallet during a rescan */
+class CRescanBlock
+{
+public:
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    vector<uint256> vHash;
+    vector<char> vMayBeMine;
+
+    explicit CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fRead(false)
+    {
+    }
+};
+
+static void RescanWorker(const CRescanFilter* pfilter, vector<CRescanBlock>* pvBlocks, unsigned int nStart, unsigned int nStride)
+{
+    for (unsigned int i = nStart; i < pvBlocks->size() && !fShutdown; i += nStride)
+    {
+        CRescanBlock& rescanBlock = (*pvBlocks)[i];
+        rescanBlock.fRead = rescanBlock.block.ReadFromDisk(rescanBlock.pindex, true);
+        BOOST_FOREACH(const CTransaction& tx, rescanBlock.block.vtx)
+        {
+            rescanBlock.vHash.push_back(tx.GetHash());
+            rescanBlock.vMayBeMine.push_back(pfilter->MayBeMine(tx));
+        }
+    }
+}
+
+// Scan the chain from pindexStart for transactions of this wallet. Worker
+// threads (-par) read the next RESCAN_BATCH blocks and filter their outputs
+// while this thread hands the current batch to the wallet, taking cs_wallet
+// only for blocks with something of interest. The block indexes of each
+// batch are read under cs_main; after a reorganization the scan continues
+// from the fork. Progress is logged, shown by GetRescanHeight(), and saved as
+// the wallet's best block so an interrupted rescan resumes from there on
+// the next start.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    if (!pindexStart)
+        return ret;
+
+    LOCK(cs_rescan);
+    int nThreads = max(1, (int)GetArg("-par", boost::thread::hardware_concurrency()));
+    int nStartHeight = pindexStart->nHeight;
+    int nEndHeight = nStartHeight;
+    int nLastProgress = nStartHeight;
+    int64 nStart = GetTimeMillis();
+    int nHeight = nStartHeight;
+    SetRescanHeight(nHeight);
 
-    CBlockIndex* pindex = pindexStart;
+    // Transactions already in the wallet: inputs spending them, and updates of them, matter too
+    set<uint256> setWalletTx;
     {
         LOCK(cs_wallet);
-        while (pindex)
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setWalletTx.insert((*it).first);
+    }
+
+    // The workers filter with filter. Once a block adds to the wallet, its
+    // keys may have changed (keypool top up), so the blocks after it that
+    // were filtered with the old snapshot are filtered again with a new one.
+    CRescanFilter filter(*this);
+    boost::scoped_ptr<CRescanFilter> pfilterFresh;
+    bool fRefreshFilter = false;
+
+    CBlockIndex* pindexQueued = pindexStart->pprev;
+    CBlockIndex* pindexLast = NULL;
+    bool fFailed = false;
+    vector<CRescanBlock> vNext;
+    boost::scoped_ptr<boost::thread_group> pthreads;
+    while (true)
+    {
+        if (pthreads)
+            pthreads->join_all();
+        vector<CRescanBlock> vCurrent;
+        vCurrent.swap(vNext);
+
+        if (pfilterFresh)
+        {
+            filter = *pfilterFresh;
+            pfilterFresh.reset();
+            BOOST_FOREACH(CRescanBlock& rescanBlock, vCurrent)
+                for (unsigned int i = 0; i < rescanBlock.block.vtx.size(); i++)
+                    rescanBlock.vMayBeMine[i] = filter.MayBeMine(rescanBlock.block.vtx[i]);
+        }
+
+        // Queue the next batch, backing up to the fork if the blocks queued
+        // last were disconnected meanwhile
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            LOCK(cs_main);
+            while (pindexQueued && !pindexQueued->IsInMainChain())
+                pindexQueued = pindexQueued->pprev;
+            for (CBlockIndex* pindex = pindexQueued ? pindexQueued->pnext : pindexStart; pindex && vNext.size() < RESCAN_BATCH; pindex = pindex->pnext)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                vNext.push_back(CRescanBlock(pindex));
+                pindexQueued = pindex;
             }
-            pindex = pindex->pnext;
+            nEndHeight = max(nBestHeight, nStartHeight);
+        }
+        pthreads.reset(new boost::thread_group());
+        for (int i = 0; i < nThreads && !vNext.empty(); i++)
+            pthreads->create_thread(boost::bind(&RescanWorker, &filter, &vNext, i, nThreads));
+
+        if (vCurrent.empty() && vNext.empty())
+            break;
+        if (fShutdown || fFailed)
+            break;
+
+        BOOST_FOREACH(CRescanBlock& rescanBlock, vCurrent)
+        {
+            CBlock& block = rescanBlock.block;
+            if (!rescanBlock.fRead)
+                printf("ScanForWalletTransactions() : could not read block at height %d\n", rescanBlock.pindex->nHeight);
+
+            if (fRefreshFilter)
+            {
+                pfilterFresh.reset(new CRescanFilter(*this));
+                fRefreshFilter = false;
+            }
+            if (pfilterFresh)
+                for (unsigned int i = 0; i < block.vtx.size(); i++)
+                    rescanBlock.vMayBeMine[i] = pfilterFresh->MayBeMine(block.vtx[i]);
+
+            vector<unsigned int> vRelevant;
+            for (unsigned int i = 0; i < block.vtx.size(); i++)
+            {
+                bool fRelevant = rescanBlock.vMayBeMine[i] || setWalletTx.count(rescanBlock.vHash[i]);
+                BOOST_FOREACH(const CTxIn& txin, block.vtx[i].vin)
+                    if (!fRelevant && setWalletTx.count(txin.prevout.hash))
+                        fRelevant = true;
+                if (fRelevant)
+                    vRelevant.push_back(i);
+            }
+
+            if (!vRelevant.empty())
+            {
+                CWalletDBBatch batch(this);
+                BOOST_FOREACH(unsigned int i, vRelevant)
+                {
+                    if (AddToWalletIfInvolvingMe(block.vtx[i], &block, fUpdate))
+                    {
+                        ret++;
+                        fRefreshFilter = true;
+                    }
+                    if (mapWallet.count(rescanBlock.vHash[i]))
+                        setWalletTx.insert(rescanBlock.vHash[i]);
+                }
+
+                // Stop before the best block moves past what did not reach wallet.dat
+                if (!batch.Commit())
+                {
+                    error("ScanForWalletTransactions() : writing wallet transactions at height %d failed", rescanBlock.pindex->nHeight);
+                    fFailed = true;
+                    break;
+                }
+            }
+
+            pindexLast = rescanBlock.pindex;
+            nHeight = pindexLast->nHeight;
+            SetRescanHeight(nHeight);
+            if (nHeight - nLastProgress >= RESCAN_PROGRESS_INTERVAL)
+            {
+                nLastProgress = nHeight;
+                printf("ScanForWalletTransactions() : at block %d of %d (%.1f%%), %d transactions found\n", nHeight, nEndHeight,
+                       100.0 * (nHeight - nStartHeight) / max(nEndHeight - nStartHeight, 1), ret);
+                if (fFileBacked)
+                    CWalletDB(strWalletFile).WriteBestBlock(CBlockLocator(pindexLast));
+            }
+        }
+        if (fRefreshFilter)
+        {
+            pfilterFresh.reset(new CRescanFilter(*this));
+            fRefreshFilter = false;
         }
     }
+    pthreads->join_all();
+    if (fFileBacked && pindexLast && !fShutdown && !fFailed)
+        CWalletDB(strWalletFile).WriteBestBlock(CBlockLocator(pindexLast));
+
+    printf("ScanForWalletTransactions() : %s at block %d, %d transactions found in %" PRI64d "ms\n", (fShutdown || fFailed) ? "interrupted" : "done",
+           nHeight, ret, GetTimeMillis() - nStart);
+    SetRescanHeight(-1);
     return ret;
 }
 
@@ -829,20 +1230,40 @@ void CWallet::ReacceptWalletTransactions()
 {
     CTxDB txdb("r");
     bool fRepeat = true;
-    while (fRepeat)
+    while (fRepeat && !fShutdown)
     {
-        LOCK(cs_wallet);
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+
+        // Each transaction is looked up in the txdb without cs_wallet, which
+        // is only taken to act on the result, so the wallet stays usable.
+        // cs_main is taken with it: this runs while blocks are connected,
+        // and the mempool accept reads the chain state
+        vector<uint256> vHash;
         {
-            CWalletTx& wtx = item.second;
+            LOCK(cs_wallet);
+            vHash.reserve(mapWallet.size());
+            for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+                vHash.push_back((*it).first);
+        }
+
+        BOOST_FOREACH(const uint256& hash, vHash)
+        {
+            if (fShutdown)
+                return;
+            CTxIndex txindex;
+            bool fHaveIndex = txdb.ReadTxIndex(hash, txindex);
+
+            LOCK2(cs_main, cs_wallet);
+            map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+            if (mi == mapWallet.end())
+                continue;
+            CWalletTx& wtx = (*mi).second;
             if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
                 continue;
 
-            CTxIndex txindex;
             bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            if (fHaveIndex)
             {
                 // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
                 if (txindex.vSpent.size() != wtx.vout.size())
@@ -866,6 +1287,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %snvc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateLedger(hash);
                 }
             }
             else
@@ -884,6 +1306,58 @@ void CWallet::ReacceptWalletTransactions()
     }
 }
 
+// Full EC check of the keys that LoadWallet took in without one. A corrupt
+// key is reported and raises a warning, but the wallet stays loaded.
+bool CWallet::VerifyKeys()
+{
+    // Encrypted keys are checked when the wallet is unlocked
+    if (IsCrypted())
+        return true;
+
+    set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    int nCorrupt = 0;
+    int64 nStart = GetTimeMillis();
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+    {
+        if (fShutdown)
+            return true;
+        CKey key;
+        if (!GetKey(keyID, key))
+            continue;
+        if (!key.IsValid() || key.GetPubKey().GetID() != keyID)
+        {
+            printf("ERROR: VerifyKeys() : key for %s is corrupt\n", CBitcoinAddress(keyID).ToString().c_str());
+            nCorrupt++;
+        }
+    }
+    printf("VerifyKeys() : %" PRIszu " keys checked, %d corrupt, %" PRI64d "ms\n", setKeys.size(), nCorrupt, GetTimeMillis() - nStart);
+
+    if (nCorrupt)
+        strMiscWarning = _("Warning: wallet.dat contains corrupt keys! Restore it from a backup.");
+    return nCorrupt == 0;
+}
+
+// Checks LoadWallet leaves for after startup: the keys' EC consistency and
+// the wallet transactions against the txdb
+void ThreadVerifyWallet(void* parg)
+{
+    RenameThread("scash-walletcheck");
+    CWallet* pwallet = (CWallet*)parg;
+
+    vnThreadsRunning[THREAD_WALLETCHECK]++;
+    try
+    {
+        pwallet->VerifyKeys();
+        if (!fShutdown)
+            pwallet->ReacceptWalletTransactions();
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadVerifyWallet()");
+    }
+    vnThreadsRunning[THREAD_WALLETCHECK]--;
+}
+
 void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
 {
     BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
@@ -967,50 +1441,26 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsFinal() && pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
+    LOCK(cs_wallet);
+    RefreshLedger();
+    return ledgerTotals;
+}
 
-    return nTotal;
+int64 CWallet::GetBalance() const
+{
+    return GetBalances().nBalance;
 }
 
 int64 CWallet::GetUnconfirmedBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1020,9 +1470,15 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        RefreshLedger();
+
+        // Only transactions with available credit can have spendable outputs
+        for (map<uint256, CWalletLedgerEntry>::const_iterator it = mapLedger.begin(); it != mapLedger.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletLedgerEntry& entry = (*it).second;
+            if (entry.balances.nBalance == 0 && entry.balances.nUnconfirmed == 0)
+                continue;
+            const CWalletTx* pcoin = entry.pwtx;
 
             if (!pcoin->IsFinal())
                 continue;
@@ -1044,7 +1500,81 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
+// Branches tried by the exact search before falling back to the approximation
+static const int BNB_MAX_TRIES = 100000;
+
+// Coin values visited by the approximation over all of its passes
+static const int64 APPROXIMATE_MAX_STEPS = 10000000;
+
+// Depth first search of vValue (sorted by descending value) for the subset with the
+// smallest total in [nTargetValue, nTargetValue + nMaxExcess). Such a subset needs no
+// change output. Branches that can no longer reach the target, or that cannot beat the
+// best total found so far, are cut.
+static bool SelectCoinsBnB(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue, int64 nMaxExcess,
+                           vector<char>& vfBest, int64& nBest)
+{
+    // vRemaining[i] is the sum of the values from position i to the end
+    vector<int64> vRemaining(vValue.size() + 1, 0);
+    for (int i = (int)vValue.size() - 1; i >= 0; i--)
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    bool fFound = false;
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    nBest = nTargetValue + nMaxExcess;
+
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[i] < nTargetValue || nTotal >= nBest)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
+        {
+            nBest = nTotal;
+            vfBest = vfIncluded;
+            fFound = true;
+            if (nTotal == nTargetValue)
+                break;
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Go back to the last included coin and try the branch without it
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0)
+                break;
+            i--;
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            i++;
+        }
+        else if (i > 0 && !vfIncluded[i - 1] && vValue[i].first == vValue[i - 1].first)
+        {
+            // Including a coin equal to one just left out gives a branch already tried
+            i++;
+        }
+        else
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+            i++;
+        }
+    }
+
+    if (!fFound)
+        nBest = 0;
+    return fFound;
+}
+
+// Stochastic approximation of the subset closest above nTargetValue. The passes are driven
+// by a fixed-seed generator so the same coins always give the same selection, and their
+// number shrinks with the size of vValue so large wallets stay bounded.
+static void ApproximateBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTargetValue,
                                   vector<char>& vfBest, int64& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1052,6 +1582,10 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
 
+    if (!vValue.empty())
+        iterations = (int)min((int64)iterations, max((int64)1, APPROXIMATE_MAX_STEPS / (int64)vValue.size()));
+
+    uint64 nRand = 0x9e3779b97f4a7c15ULL;
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
     {
         vfIncluded.assign(vValue.size(), false);
@@ -1061,7 +1595,17 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
         {
             for (unsigned int i = 0; i < vValue.size(); i++)
             {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                bool fInclude;
+                if (nPass == 0)
+                {
+                    nRand ^= nRand << 13;
+                    nRand ^= nRand >> 7;
+                    nRand ^= nRand << 17;
+                    fInclude = nRand & 1;
+                }
+                else
+                    fInclude = !vfIncluded[i];
+                if (fInclude)
                 {
                     nTotal += vValue[i].first;
                     vfIncluded[i] = true;
@@ -1085,31 +1629,15 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
 // Scash: total coins staked (non-spendable until maturity)
 int64 CWallet::GetStake() const
 {
-    int64 nTotal = 0;
-    LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nStake;
 }
 
 int64 CWallet::GetNewMint() const
 {
-    int64 nTotal = 0;
-    LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nNewMint;
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -1121,9 +1649,7 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1175,11 +1701,29 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Candidates from SelectCoins are already sorted by descending value
+    for (unsigned int i = 1; i < vValue.size(); i++)
+        if (vValue[i - 1].first < vValue[i].first)
+        {
+            sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+            break;
+        }
     vector<char> vfBest;
     int64 nBest;
 
+    // Solve subset sum exactly if a selection without change exists
+    if (SelectCoinsBnB(vValue, nTargetValue, MIN_TXOUT_AMOUNT, vfBest, nBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        return true;
+    }
+
+    // Otherwise by stochastic approximation
     ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
         ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
@@ -1214,10 +1758,32 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, in
     return true;
 }
 
+struct CompareOutputValue
+{
+    bool operator()(const COutput& t1, const COutput& t2) const
+    {
+        return t1.tx->vout[t1.i].nValue > t2.tx->vout[t2.i].nValue;
+    }
+};
+
+// Spendable coins, sorted by descending value, for SelectCoins
+void CWallet::AvailableCoinsSorted(vector<COutput>& vCoins, const CCoinControl* coinControl) const
+{
+    AvailableCoins(vCoins, true, coinControl);
+    sort(vCoins.begin(), vCoins.end(), CompareOutputValue());
+}
+
 bool CWallet::SelectCoins(int64 nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
+    AvailableCoinsSorted(vCoins, coinControl);
+    return SelectCoins(nTargetValue, nSpendTime, vCoins, setCoinsRet, nValueRet, coinControl);
+}
+
+bool CWallet::SelectCoins(int64 nTargetValue, unsigned int nSpendTime, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
 
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
@@ -1262,6 +1828,12 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
         // txdb must be opened before the mapWallet lock
         CTxDB txdb("r");
         {
+            // The candidates are gathered once; each fee pass only selects among them
+            vector<COutput> vCoins;
+            AvailableCoinsSorted(vCoins, coinControl);
+            set<pair<const CWalletTx*,unsigned int> > setCoins;
+            int64 nValueIn = 0;
+
             nFeeRet = nTransactionFee;
             LOOP
             {
@@ -1275,11 +1847,10 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                 BOOST_FOREACH (const PAIRTYPE(CScript, int64)& s, vecSend)
                     wtxNew.vout.push_back(CTxOut(s.second, s.first));
 
-                // Choose coins to use
-                set<pair<const CWalletTx*,unsigned int> > setCoins;
-                int64 nValueIn = 0;
-                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl))
-                    return false;
+                // Choose coins to use, keeping the previous pass's coins if they still cover the raised fee
+                if (setCoins.empty() || nValueIn < nTotalValue)
+                    if (!SelectCoins(nTotalValue, wtxNew.nTime, vCoins, setCoins, nValueIn, coinControl))
+                        return false;
                 BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
                 {
                     int64 nCredit = pcoin.first->vout[pcoin.second].nValue;
@@ -1342,10 +1913,11 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
                 // Sign
-                int nIn = 0;
+                vector<CScript> vFromPubKey;
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
-                        return false;
+                    vFromPubKey.push_back(coin.first->vout[coin.second].scriptPubKey);
+                if (!SignSignatures(*this, vFromPubKey, wtxNew))
+                    return false;
 
                 // Limit size
                 unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
@@ -1478,100 +2050,127 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     int64 nCredit = 0;
     CScript scriptPubKeyKernel;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
-    {
-        CTxDB txdb("r");
-        CTxIndex txindex;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-				continue;
-		}
+    static int nMaxStakeSearchInterval = 60;
 
-        // Read block header
-        CBlock block;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-				continue;
-		}
+    // Kernel prefixes of all coins under a single lock, mostly from the cache
+    vector<pair<pair<const CWalletTx*, unsigned int>, CStakeKernelPrefix> > vKernels;
+    {
+        LOCK2(cs_main, cs_wallet);
+        set<COutPoint> setPrevouts;
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        {
+            COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+            setPrevouts.insert(prevout);
+            CStakeKernelPrefix prefix;
+            if (stakeKernelCache.Get(*pcoin.first, prevout, prefix))
+                vKernels.push_back(make_pair(pcoin, prefix));
+        }
+        if (stakeKernelCache.size() > 2 * setPrevouts.size())
+            stakeKernelCache.Prune(setPrevouts);
+    }
 
-        static int nMaxStakeSearchInterval = 60;
+    // Coins that may stake. Their keys are only looked up for the kernel found.
+    vector<CStakeKernelPrefix> vPrefix;
+    vector<pair<const CWalletTx*, unsigned int> > vCandidates;
+    for (unsigned int i = 0; i < vKernels.size(); i++)
+    {
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vKernels[i].first;
+        const CStakeKernelPrefix& prefix = vKernels[i].second;
 
         if (fDebug && fDumpAll)
         {
-            printf(">> block.GetBlockTime() = %" PRI64d ", nStakeMinAge = %d, txNew.nTime = %d\n", block.GetBlockTime(), nStakeMinAge,txNew.nTime); 
+            printf(">> prefix.nTimeBlockFrom = %u, nStakeMinAge = %d, txNew.nTime = %d\n", prefix.nTimeBlockFrom, nStakeMinAge,txNew.nTime); 
         }
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+        if (prefix.nTimeBlockFrom + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
             continue; // only count coins meeting min age requirement
 
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown; n++)
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(pcoin.first->vout[pcoin.second].scriptPubKey, whichType, vSolutions))
         {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake))
+            if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
+                printf("CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
+                printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+
+        vPrefix.push_back(prefix);
+        vCandidates.push_back(pcoin);
+    }
+
+    // Search backward in time from the given txNew timestamp 
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    int nThreads = GetStakeThreads();
+    int64 nSearchStart = GetTimeMillis();
+    unsigned int nTimeTx = 0;
+    unsigned int nSearched = 0;
+    uint256 hashProofOfStake = 0;
+    int nFound = -1;
+    CScript scriptPubKeyOut;
+    while (!vPrefix.empty())
+    {
+        unsigned int nSearchedPass = 0;
+        nFound = SearchStakeKernels(vPrefix, nBits, txNew.nTime, min(nSearchInterval,(int64)nMaxStakeSearchInterval), nThreads, nTimeTx, hashProofOfStake, nSearchedPass);
+        nSearched += nSearchedPass;
+        if (nFound < 0)
+            break;
+
+        const CScript& scriptPubKey = vCandidates[nFound].first->vout[vCandidates[nFound].second].scriptPubKey;
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        Solver(scriptPubKey, whichType, vSolutions);
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            CKey key;
+            if (keystore.GetKey(uint160(vSolutions[0]), key))
             {
-               // Found a kernel
-                if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    CKey key;
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                else
-                    scriptPubKeyOut = scriptPubKeyKernel;
+                scriptPubKeyOut = CScript() << key.GetPubKey() << OP_CHECKSIG;
+                break;
+            }
+            if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
+                printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
 
-                txNew.nTime -= n; 
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
+            // unable to find corresponding public key: search the other coins again
+            vPrefix.erase(vPrefix.begin() + nFound);
+            vCandidates.erase(vCandidates.begin() + nFound);
+            nFound = -1;
+            continue;
+        }
+        scriptPubKeyOut = scriptPubKey;
+        break;
+    }
+    stakeSearchStats.AddPass(nSearched, GetTimeMillis() - nSearchStart, max(nSearchInterval - nMaxStakeSearchInterval, (int64)0));
 
-                if (fDebug && fDumpAll)
-                {
-                    printf(">> Wallet: CreateCoinStake: nCredit = %" PRI64d "\n", nCredit);
-                }
+    if (nFound >= 0)
+    {
+        // Found a kernel
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vCandidates[nFound];
+        if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
+            printf("CreateCoinStake : kernel found\n");
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
 
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                if (block.GetBlockTime() + nStakeSplitAge > txNew.nTime)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        txNew.nTime = nTimeTx;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
 
-                if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            }
+        if (fDebug && fDumpAll)
+        {
+            printf(">> Wallet: CreateCoinStake: nCredit = %" PRI64d "\n", nCredit);
         }
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        if (vPrefix[nFound].nTimeBlockFrom + nStakeSplitAge > txNew.nTime)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+
+        if (fDebug && (GetBoolArg("-printcoinstake") || fDumpAll))
+            printf("CreateCoinStake : added kernel\n");
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
 	{
@@ -1633,12 +2232,11 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             txNew.vout[1].nValue = nCredit - nMinFee;
 
         // Sign
-        int nIn = 0;
-        BOOST_FOREACH(const CWalletTx* pcoin, vwtxPrev)
-        {
-            if (!SignSignature(*this, *pcoin, txNew, nIn++))
-                return error("CreateCoinStake : failed to sign coinstake");
-        }
+        vector<CScript> vFromPubKey;
+        for (unsigned int i = 0; i < vwtxPrev.size(); i++)
+            vFromPubKey.push_back(vwtxPrev[i]->vout[txNew.vin[i].prevout.n].scriptPubKey);
+        if (!SignSignatures(*this, vFromPubKey, txNew))
+            return error("CreateCoinStake : failed to sign coinstake");
 
         // Limit size
         unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
@@ -1671,10 +2269,8 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         printf("CommitTransaction:\n%s", wtxNew.ToString().c_str());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+            // The key, the new transaction and the spent coins are written in one batch
+            CWalletDBBatch batch(this);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -1691,11 +2287,13 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateLedger(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
-            if (fFileBacked)
-                delete pwalletdb;
+            // Not broadcast unless the wallet has it on disk
+            if (!batch.Commit())
+                return error("CommitTransaction() : writing the transaction to wallet.dat failed");
         }
 
         // Track how many getdata requests our transaction gets
@@ -1782,6 +2380,7 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return DB_LOAD_OK;
     fFirstRunRet = false;
     DBErrors nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    BuildWalletTxIndex();
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -1880,23 +2479,30 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
 //
 bool CWallet::NewKeyPool()
 {
+    // The new keys are made before taking cs_wallet
+    int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
+    vector<CKey> vKeys;
+    if (!IsLocked())
+        MakeNewKeys(nKeys, CanSupportFeature(FEATURE_COMPRPUBKEY), vKeys);
+
     {
-        LOCK(cs_wallet);
+        CWalletDBBatch batch(this);
         CWalletDB walletdb(strWalletFile);
         BOOST_FOREACH(int64 nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
         setKeyPool.clear();
 
-        if (IsLocked())
+        if (IsLocked() || (int64)vKeys.size() != nKeys)
             return false;
 
-        int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
         for (int i = 0; i < nKeys; i++)
         {
             int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
+            walletdb.WritePool(nIndex, CKeyPool(AddGeneratedKey(vKeys[i])));
             setKeyPool.insert(nIndex);
         }
+        if (!batch.Commit())
+            return error("CWallet::NewKeyPool() : writing new keys failed");
         printf("CWallet::NewKeyPool wrote %" PRI64d " new keys\n", nKeys);
     }
     return true;
@@ -1904,26 +2510,46 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool()
 {
+    unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+    unsigned int nMissing = 0;
     {
         LOCK(cs_wallet);
+        if (IsLocked())
+            return false;
+        if (setKeyPool.size() < nTargetSize + 1)
+            nMissing = nTargetSize + 1 - setKeyPool.size();
+    }
+    if (nMissing == 0)
+        return true;
+
+    // The keys are made without cs_wallet (unless the caller holds it), then
+    // added, encrypted if the wallet is, and written in one batch
+    vector<CKey> vKeys;
+    MakeNewKeys(nMissing, CanSupportFeature(FEATURE_COMPRPUBKEY), vKeys);
+
+    {
+        CWalletDBBatch batch(this);
 
         if (IsLocked())
             return false;
 
         CWalletDB walletdb(strWalletFile);
 
-        // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+        // Top up key pool; another thread may have topped it up meanwhile
+        BOOST_FOREACH(const CKey& key, vKeys)
         {
+            if (setKeyPool.size() >= nTargetSize + 1)
+                break;
             int64 nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            if (!walletdb.WritePool(nEnd, CKeyPool(AddGeneratedKey(key))))
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
             setKeyPool.insert(nEnd);
             printf("keypool added key %" PRI64d ", size=%" PRIszu "\n", nEnd, setKeyPool.size());
         }
+        if (!batch.Commit())
+            throw runtime_error("TopUpKeyPool() : writing generated keys failed");
     }
     return true;
 }
@@ -2184,6 +2810,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateLedger(pcoin->GetHash());
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -2196,6 +2823,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateLedger(pcoin->GetHash());
                 }
             }
         }
@@ -2219,6 +2847,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateLedger(txin.prevout.hash);
             }
         }
     }
@@ -25,6 +25,78 @@ class CReserveKey;
 class COutput;
 class CCoinControl;
 
+/** Wallet balance totals, by state of the coins */
+class CWalletBalances
+{
+public:
+    int64 nBalance;
+    int64 nUnconfirmed;
+    int64 nImmature;
+    int64 nStake;
+    int64 nNewMint;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nBalance = 0;
+        nUnconfirmed = 0;
+        nImmature = 0;
+        nStake = 0;
+        nNewMint = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nBalance == 0 && nUnconfirmed == 0 && nImmature == 0 && nStake == 0 && nNewMint == 0;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nBalance += b.nBalance;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nStake += b.nStake;
+        nNewMint += b.nNewMint;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nBalance -= b.nBalance;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nStake -= b.nStake;
+        nNewMint -= b.nNewMint;
+        return *this;
+    }
+};
+
+/** What one wallet transaction adds to the balances */
+class CWalletLedgerEntry
+{
+public:
+    const CWalletTx* pwtx;
+    CWalletBalances balances;
+    // May change with the chain tip alone: unconfirmed, not final or immature
+    bool fPending;
+
+    CWalletLedgerEntry()
+    {
+        pwtx = NULL;
+        fPending = false;
+    }
+};
+
+// Blocks read ahead by the rescan workers
+static const unsigned int RESCAN_BATCH = 64;
+
+// Blocks between rescan progress reports (and saved best-block locators)
+static const int RESCAN_PROGRESS_INTERVAL = 1000;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -71,6 +143,8 @@ class CWallet : public CCryptoKeyStore
 {
 private:
     bool SelectCoins(int64 nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool SelectCoins(int64 nTargetValue, unsigned int nSpendTime, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
+    void AvailableCoinsSorted(std::vector<COutput>& vCoins, const CCoinControl *coinControl=NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -80,6 +154,21 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Balance ledger: entries of the transactions that hold spendable, unconfirmed
+    // or immature coins, and their totals as of pindexLedger (NULL: rebuild)
+    mutable std::map<uint256, CWalletLedgerEntry> mapLedger;
+    mutable std::set<uint256> setLedgerPending;
+    mutable CWalletBalances ledgerTotals;
+    mutable CBlockIndex* pindexLedger;
+
+    void GetLedgerEntry(const CWalletTx& wtx, CWalletLedgerEntry& entry) const;
+    void UpdateLedger(const uint256& hash) const;
+    void RefreshLedger() const;
+
+    void IndexWalletTx(const uint256& hash, CWalletTx& wtx);
+    void UnindexWalletTx(const uint256& hash, CWalletTx& wtx);
+    void BuildWalletTxIndex();
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -88,6 +177,13 @@ public:
 
     std::set<int64> setKeyPool;
 
+    // Held for the whole of a rescan, so only one runs at a time
+    mutable CCriticalSection cs_rescan;
+
+    // Height of the last block rescanned, -1 when no rescan is running
+    mutable CCriticalSection cs_rescanHeight;
+    int nRescanHeight; // guarded by cs_rescanHeight
+
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
@@ -101,6 +197,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        pindexLedger = NULL;
+        nRescanHeight = -1;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -111,6 +209,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        pindexLedger = NULL;
+        nRescanHeight = -1;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -119,16 +219,28 @@ public:
 
     std::map<CTxDestination, std::string> mapAddressBook;
 
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::multimap<int64, TxPair > TxItems;
+
+    // Indexes of mapWallet, kept up to date by AddToWallet and EraseFromWallet:
+    // transactions by order position, by destination of any output, and by
+    // block (0 for transactions not in a block)
+    TxItems wtxOrdered;
+    std::map<CTxDestination, std::set<uint256> > mapAddressTx;
+    std::map<uint256, std::set<uint256> > mapBlockTx;
+
     CPubKey vchDefaultKey;
 
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     // keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
+    // Adds a key made by the caller, as GenerateNewKey does
+    CPubKey AddGeneratedKey(const CKey& key);
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
@@ -152,9 +264,6 @@ public:
      */
     int64 IncOrderPosNext(CWalletDB *pwalletdb = NULL);
 
-    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef std::multimap<int64, TxPair > TxItems;
-
     /** Get the wallet's activity log
         @return multimap of ordered transactions and accounting entries
         @warning Returned pointers are *only* valid within the scope of passed acentries
@@ -162,13 +271,26 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    void InvalidateLedger();
+    CWalletBalances GetBalances() const;
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
+    int GetRescanHeight() const
+    {
+        LOCK(cs_rescanHeight);
+        return nRescanHeight;
+    }
+    void SetRescanHeight(int nHeight)
+    {
+        LOCK(cs_rescanHeight);
+        nRescanHeight = nHeight;
+    }
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     int ScanForWalletTransaction(const uint256& hashTx);
     void ReacceptWalletTransactions();
+    bool VerifyKeys();
     void ResendWalletTransactions();
     int64 GetBalance() const;
     int64 GetUnconfirmedBalance() const;
@@ -861,4 +983,6 @@ private:
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+void ThreadVerifyWallet(void* parg);
+
 #endif
@@ -7,6 +7,8 @@
 #include "walletdb.h"
 #include "wallet.h"
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 using namespace boost;
@@ -15,6 +17,13 @@ using namespace boost;
 static uint64 nAccountingEntryNumber = 0;
 extern bool fWalletUnlockMintOnly;
 
+CWalletDBBatch::CWalletDBBatch(CWallet* pwallet) :
+    lock(pwallet->cs_wallet, "cs_wallet", __FILE__, __LINE__)
+{
+    if (pwallet->fFileBacked)
+        pbatch.reset(new CDBBatch(pwallet->strWalletFile, GetArg("-walletdurability", 1)));
+}
+
 //
 // CWalletDB
 //
@@ -183,6 +192,103 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
 }
 
 
+// Deserialize a "tx" record and check it; old records are upgraded in place
+static bool ReadWalletTx(CDataStream& ssValue, const uint256& hash, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    try {
+        ssValue >> wtx;
+        if (!wtx.CheckTransaction() || wtx.GetHash() != hash)
+            return false;
+
+        // Undo serialize changes in 31600
+        if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+        {
+            if (!ssValue.empty())
+            {
+                char fTmp;
+                char fUnused;
+                ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                                   wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+                wtx.fTimeReceivedIsTxTime = fTmp;
+            }
+            else
+            {
+                strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+                wtx.fTimeReceivedIsTxTime = 0;
+            }
+            fUpgraded = true;
+        }
+    } catch (...)
+    {
+        return false;
+    }
+    return true;
+}
+
+// Bind a transaction read by ReadWalletTx to the wallet
+static void LoadWalletTx(CWallet* pwallet, const uint256& hash, CWalletTx& wtx, bool fUpgraded,
+                         vector<uint256>& vWalletUpgrade, bool& fAnyUnordered)
+{
+    wtx.BindWallet(pwallet);
+    if (fUpgraded)
+        vWalletUpgrade.push_back(hash);
+
+    if (wtx.nOrderPos == -1)
+        fAnyUnordered = true;
+
+    if (fDebug && fDumpAll)
+    {
+        printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
+        printf(" %12" PRI64d "   %s  %s\n",
+            wtx.vout[0].nValue,
+            wtx.hashBlock.ToString().c_str(),
+            wtx.mapValue["message"].c_str());
+    }
+}
+
+// Deserialize a "key" or "wkey" record. The private key must match the
+// record's public key; with fVerify the EC consistency of the key is checked
+// too, otherwise that is left to CWallet::VerifyKeys.
+static bool ReadWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CKey& key, bool fVerify, string& strErr)
+{
+    try {
+        vector<unsigned char> vchPubKey;
+        ssKey >> vchPubKey;
+        CPrivKey pkey;
+        if (strType == "key")
+            ssValue >> pkey;
+        else
+        {
+            CWalletKey wkey;
+            ssValue >> wkey;
+            pkey = wkey.vchPrivKey;
+        }
+        key.SetPubKey(vchPubKey);
+        if (!key.SetPrivKey(pkey, !fVerify))
+        {
+            strErr = "Error reading wallet database: CPrivKey corrupt";
+            return false;
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            strErr = strType == "key" ? "Error reading wallet database: CPrivKey pubkey inconsistency" :
+                                        "Error reading wallet database: CWalletKey pubkey inconsistency";
+            return false;
+        }
+        if (fVerify && !key.IsValid())
+        {
+            strErr = strType == "key" ? "Error reading wallet database: invalid CPrivKey" :
+                                        "Error reading wallet database: invalid CWalletKey";
+            return false;
+        }
+    } catch (...)
+    {
+        return false;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
@@ -204,46 +310,13 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             uint256 hash;
             ssKey >> hash;
             CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
-                wtx.BindWallet(pwallet);
-            else
+            bool fUpgraded = false;
+            if (!ReadWalletTx(ssValue, hash, wtx, fUpgraded, strErr))
             {
                 pwallet->mapWallet.erase(hash);
                 return false;
             }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                fAnyUnordered = true;
-
-            if (fDebug && fDumpAll)
-            {
-                printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-                printf(" %12" PRI64d "   %s  %s\n",
-                    wtx.vout[0].nValue,
-                    wtx.hashBlock.ToString().c_str(),
-                    wtx.mapValue["message"].c_str());
-            }
+            LoadWalletTx(pwallet, hash, wtx, fUpgraded, vWalletUpgrade, fAnyUnordered);
         }
         else if (strType == "acentry")
         {
@@ -264,51 +337,9 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "key" || strType == "wkey")
         {
-            vector<unsigned char> vchPubKey;
-            ssKey >> vchPubKey;
             CKey key;
-            if (strType == "key")
-            {
-                CPrivKey pkey;
-                ssValue >> pkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(pkey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CPrivKey";
-                    return false;
-                }
-            }
-            else
-            {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(wkey.vchPrivKey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CWalletKey";
-                    return false;
-                }
-            }
+            if (!ReadWalletKey(strType, ssKey, ssValue, key, true, strErr))
+                return false;
             if (!pwallet->LoadKey(key))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -388,6 +419,71 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+static void LoadWalletError(const string& strType, DBErrors& result, bool& fNoncriticalErrors)
+{
+    // losing keys is considered a catastrophic error, anything else
+    // we assume the user can live with:
+    if (IsKeyType(strType))
+        result = DB_CORRUPT;
+    else
+    {
+        // Leave other errors alone, if we try to fix them we might make things worse.
+        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+        if (strType == "tx")
+            // Rescan if there is a bad transaction record:
+            SoftSetBoolArg("-rescan", true);
+    }
+}
+
+// Records LoadWallet hands to its worker threads at a time
+static const unsigned int WALLET_LOAD_BATCH = 1000;
+
+/** A "tx", "key" or "wkey" record, decoded by a LoadWallet worker thread */
+class CWalletLoadRecord
+{
+public:
+    string strType;
+    CDataStream ssKey;
+    CDataStream ssValue;
+    uint256 hash;
+    CWalletTx wtx;
+    CKey key;
+    bool fOK;
+    bool fUpgraded;
+    string strErr;
+
+    CWalletLoadRecord(const string& strTypeIn, const CDataStream& ssKeyIn, const CDataStream& ssValueIn)
+        : strType(strTypeIn), ssKey(ssKeyIn), ssValue(ssValueIn), fOK(false), fUpgraded(false)
+    {
+    }
+};
+
+static bool IsParallelType(const string& strType)
+{
+    return (strType == "tx" || strType == "key" || strType == "wkey");
+}
+
+// Decode records of pvRecords; touches nothing but the records, so it runs
+// while the cursor thread keeps reading and loading other record types
+static void LoadWalletWorker(vector<CWalletLoadRecord>* pvRecords, unsigned int nStart, unsigned int nStride)
+{
+    for (unsigned int i = nStart; i < pvRecords->size(); i += nStride)
+    {
+        CWalletLoadRecord& record = (*pvRecords)[i];
+        if (record.strType == "tx")
+        {
+            try {
+                record.ssKey >> record.hash;
+            } catch (...) {
+                continue;
+            }
+            record.fOK = ReadWalletTx(record.ssValue, record.hash, record.wtx, record.fUpgraded, record.strErr);
+        }
+        else
+            record.fOK = ReadWalletKey(record.strType, record.ssKey, record.ssValue, record.key, false, record.strErr);
+    }
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -416,40 +512,88 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
-        LOOP
+        // Transactions and keys, the bulk of a large wallet, are decoded and
+        // checked by worker threads (-par) a batch at a time while this thread
+        // reads the next batch off the cursor. The keys' EC consistency check
+        // is left to CWallet::VerifyKeys, after the wallet is up.
+        int nThreads = max(1, (int)GetArg("-par", boost::thread::hardware_concurrency()));
+        vector<CWalletLoadRecord> vDecoding;
+        boost::scoped_ptr<boost::thread_group> pthreads;
+        bool fEnd = false;
+        while (true)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            vector<CWalletLoadRecord> vRead;
+            vRead.reserve(WALLET_LOAD_BATCH);
+            while (!fEnd && vRead.size() < WALLET_LOAD_BATCH)
             {
-                printf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                // Read next record
+                CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+                if (ret == DB_NOTFOUND)
+                {
+                    fEnd = true;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    printf("Error reading next record from wallet database\n");
+                    result = DB_CORRUPT;
+                    fEnd = true;
+                    break;
+                }
+
+                // ssRest is the key past its type
+                string strType, strErr;
+                CDataStream ssRest(ssKey);
+                try {
+                    ssRest >> strType;
+                } catch (...) {
+                }
+                if (IsParallelType(strType))
+                {
+                    vRead.push_back(CWalletLoadRecord(strType, ssRest, ssValue));
+                    continue;
+                }
+
+                // Try to be tolerant of single corrupt records:
+                if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
+                                  vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+                    LoadWalletError(strType, result, fNoncriticalErrors);
+                if (!strErr.empty())
+                    printf("%s\n", strErr.c_str());
             }
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+            if (pthreads)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
+                pthreads->join_all();
+                BOOST_FOREACH(CWalletLoadRecord& record, vDecoding)
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    if (record.fOK && record.strType == "tx")
+                    {
+                        CWalletTx& wtx = pwallet->mapWallet[record.hash];
+                        wtx = record.wtx;
+                        LoadWalletTx(pwallet, record.hash, wtx, record.fUpgraded, vWalletUpgrade, fAnyUnordered);
+                    }
+                    else if (record.fOK && !pwallet->LoadKey(record.key))
+                    {
+                        record.strErr = "Error reading wallet database: LoadKey failed";
+                        record.fOK = false;
+                    }
+                    if (!record.fOK)
+                        LoadWalletError(record.strType, result, fNoncriticalErrors);
+                    if (!record.strErr.empty())
+                        printf("%s\n", record.strErr.c_str());
                 }
+                pthreads.reset();
             }
-            if (!strErr.empty())
-                printf("%s\n", strErr.c_str());
+
+            if (vRead.empty())
+                break;
+            vDecoding.swap(vRead);
+            pthreads.reset(new boost::thread_group());
+            for (int i = 0; i < nThreads && i < (int)vDecoding.size(); i++)
+                pthreads->create_thread(boost::bind(&LoadWalletWorker, &vDecoding, i, nThreads));
         }
         pcursor->close();
     }
@@ -8,6 +8,8 @@
 #include "db.h"
 #include "base58.h"
 
+#include <boost/scoped_ptr.hpp>
+
 class CKeyPool;
 class CAccount;
 class CAccountingEntry;
@@ -160,4 +162,25 @@ public:
     static bool Recover(CDBEnv& dbenv, std::string filename);
 };
 
+/** Groups the wallet writes of one block or one RPC call into a single
+ * database transaction (see CDBBatch), committed with -walletdurability.
+ * Holds cs_wallet while in scope, so wallet writes of other threads wait
+ * for the commit rather than for the batch's database locks. Callers
+ * Commit() explicitly to learn whether the writes reached wallet.dat.
+ */
+class CWalletDBBatch
+{
+private:
+    CCriticalBlock lock;
+    boost::scoped_ptr<CDBBatch> pbatch;
+
+public:
+    explicit CWalletDBBatch(CWallet* pwallet);
+
+    bool Commit()
+    {
+        return !pbatch || pbatch->Commit();
+    }
+};
+
 #endif // BITCOIN_WALLETDB_H